@@ -49,6 +49,11 @@ android {
         viewBinding = true
     }
 
+    // Keep filter lists uncompressed so native code can read them in place
+    androidResources {
+        noCompress += "txt"
+    }
+
     // Add NDK build configuration
     externalNativeBuild {
         cmake {
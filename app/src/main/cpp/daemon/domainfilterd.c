@@ -0,0 +1,381 @@
+// domainfilterd.c
+// Runs the packet engine as a plain Linux process: on a tun device for a
+// gateway, or on one end of a socketpair so tests and soak runs can feed it
+// packets without privileges.
+//
+// Usage: domainfilterd [options] [<list>=]<file>...
+//   -t <name>      create or attach tun device <name> (default dftun0)
+//   -f <fd>        use an inherited descriptor that carries IP packets
+//   -x <command>   run <command> with the other end of a socketpair in
+//                  $DOMAINFILTER_TUN_FD and stop when it exits
+//   -M <mtu>       interface MTU (default 1500)
+//   -m <mark>      SO_MARK for upstream sockets, to route them around the tun
+//   -b <device>    SO_BINDTODEVICE for upstream sockets
+//   -B trie|hash   matcher backend (default trie)
+//   -r <lists>     reject blocked flows of these lists, comma separated
+//   -L             connect upstream on the SYN instead of the first request
+//   -i <seconds>   statistics interval, 0 for none (default 10)
+//
+// <list> is advertising, tracking, malware or custom; a bare file is custom.
+// SIGHUP reloads every file and swaps the rules in at once, keeping the old
+// ones if any file fails. SIGINT and SIGTERM stop.
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "domainfilter.h"
+#include "packet_pool.h"
+#include "packet_trace.h"
+#include "vpn_engine.h"
+
+#define MAX_LISTS 16
+
+static const struct {
+    const char *name;
+    uint8_t category;
+} categories[] = {
+        {"advertising", FILTER_CATEGORY_ADVERTISING},
+        {"tracking",    FILTER_CATEGORY_TRACKING},
+        {"malware",     FILTER_CATEGORY_MALWARE},
+        {"custom",      FILTER_CATEGORY_CUSTOM},
+};
+
+static const char *list_files[MAX_LISTS];
+static uint8_t list_categories[MAX_LISTS];
+static size_t num_lists = 0;
+
+// Upstream socket options
+static int upstream_mark = 0;
+static const char *upstream_device = NULL;
+
+static int tun_fd = -1;
+static int tun_mtu = 1500;
+static int engine_result = 0;
+
+static void usage() {
+    fprintf(stderr, "usage: domainfilterd [-t name | -f fd | -x command] [-M mtu] [-m mark] [-b device]\n"
+                    "                     [-B trie|hash] [-r lists] [-L] [-i seconds] [<list>=]<file>...\n");
+}
+
+static int category_for(const char *name, size_t len, uint8_t *category) {
+    for (size_t i = 0; i < sizeof(categories) / sizeof(categories[0]); i++) {
+        if (strlen(categories[i].name) == len && memcmp(categories[i].name, name, len) == 0) {
+            *category = categories[i].category;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// "advertising,malware" to a category mask
+static int parse_categories(const char *names, uint8_t *mask) {
+    *mask = 0;
+    while (*names != '\0') {
+        size_t len = strcspn(names, ",");
+        uint8_t category;
+        if (category_for(names, len, &category) < 0) {
+            return -1;
+        }
+        *mask |= category;
+        names += len + (names[len] == ',');
+    }
+    return 0;
+}
+
+static int add_list(const char *arg) {
+    const char *equals = strchr(arg, '=');
+    uint8_t category = FILTER_CATEGORY_CUSTOM;
+    if (equals != NULL && category_for(arg, (size_t)(equals - arg), &category) == 0) {
+        arg = equals + 1;
+    }
+    if (num_lists == MAX_LISTS) {
+        return -1;
+    }
+    list_files[num_lists] = arg;
+    list_categories[num_lists] = category;
+    num_lists++;
+    return 0;
+}
+
+static int open_tun(const char *name) {
+    int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror("/dev/net/tun");
+        return -1;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Start command with the other end of a datagram socketpair, so every
+// write is one packet as on a tun device
+static pid_t spawn_peer(const char *command, int *fd) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGPIPE, SIG_DFL);
+
+        char value[16];
+        snprintf(value, sizeof(value), "%d", fds[1]);
+        setenv("DOMAINFILTER_TUN_FD", value, 1);
+        close(fds[0]);
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    *fd = fds[0];
+    return pid;
+}
+
+static int protect_socket(int fd, void *ctx) {
+    (void)ctx;
+    if (upstream_mark != 0 && setsockopt(fd, SOL_SOCKET, SO_MARK, &upstream_mark, sizeof(upstream_mark)) < 0) {
+        return -1;
+    }
+    if (upstream_device != NULL &&
+        setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, upstream_device, (socklen_t)strlen(upstream_device)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int protect_sockets(int *fds, int count, void *ctx) {
+    for (int i = 0; i < count; i++) {
+        if (protect_socket(fds[i], ctx) < 0) {
+            fds[i] = -1;
+        }
+    }
+    return 0;
+}
+
+static void *engine_main(void *arg) {
+    (void)arg;
+    vpn_engine_config_t config = {
+            .protect = protect_socket,
+            .protect_batch = protect_sockets,
+    };
+    engine_result = vpn_engine_run(tun_fd, tun_mtu, &config);
+
+    // Wake the main thread if the loop ended on its own
+    kill(getpid(), SIGUSR1);
+    return NULL;
+}
+
+static int load_lists() {
+    int rules = filter_reload_lists(list_files, list_categories, num_lists);
+    if (rules < 0) {
+        fprintf(stderr, "domainfilterd: failed to load the lists\n");
+    }
+    return rules;
+}
+
+static uint64_t clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static long resident_kb() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    long pages = 0;
+    if (file != NULL) {
+        if (fscanf(file, "%*d %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(file);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Throughput since the previous report, then memory
+static void report_stats(uint64_t now, uint64_t *last_time, vpn_engine_stats_t *last) {
+    vpn_engine_stats_t stats;
+    filter_stats_t filter;
+    packet_pool_stats_t pool;
+    vpn_engine_get_stats(&stats);
+    filter_get_stats(&filter);
+    packet_pool_get_stats(&pool);
+
+    double seconds = now > *last_time ? (double)(now - *last_time) / 1000.0 : 1.0;
+    fprintf(stderr,
+            "in %.0f pkt/s %.2f Mbit/s, out %.0f pkt/s %.2f Mbit/s, %u flows, %u filtered, "
+            "rss %ld KiB, rules %llu KiB, pool %u/%u\n",
+            (double)(stats.packets_in - last->packets_in) / seconds,
+            (double)(stats.bytes_in - last->bytes_in) * 8 / seconds / 1e6,
+            (double)(stats.packets_out - last->packets_out) / seconds,
+            (double)(stats.bytes_out - last->bytes_out) * 8 / seconds / 1e6,
+            stats.flows, stats.filtered, resident_kb(),
+            (unsigned long long)(filter.bytes_used / 1024), pool.in_use, pool.buffers);
+
+    *last_time = now;
+    *last = stats;
+}
+
+int main(int argc, char **argv) {
+    const char *tun_name = "dftun0";
+    const char *command = NULL;
+    int backend = FILTER_BACKEND_TRIE;
+    uint8_t reject = 0;
+    int lazy_connect = 1;
+    int interval = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:f:x:M:m:b:B:r:Li:")) != -1) {
+        switch (opt) {
+            case 't': tun_name = optarg; break;
+            case 'f': tun_fd = atoi(optarg); break;
+            case 'x': command = optarg; break;
+            case 'M': tun_mtu = atoi(optarg); break;
+            case 'm': upstream_mark = (int)strtol(optarg, NULL, 0); break;
+            case 'b': upstream_device = optarg; break;
+            case 'L': lazy_connect = 0; break;
+            case 'i': interval = atoi(optarg); break;
+            case 'B':
+                if (strcmp(optarg, "trie") == 0) {
+                    backend = FILTER_BACKEND_TRIE;
+                } else if (strcmp(optarg, "hash") == 0) {
+                    backend = FILTER_BACKEND_HASH;
+                } else {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (parse_categories(optarg, &reject) < 0) {
+                    fprintf(stderr, "domainfilterd: unknown list in %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (add_list(argv[i]) < 0) {
+            fprintf(stderr, "domainfilterd: at most %d lists\n", MAX_LISTS);
+            return 1;
+        }
+    }
+    if (tun_mtu < 576 || tun_mtu > 65535) {
+        usage();
+        return 1;
+    }
+
+    if (filter_init_backend(backend) < 0 || load_lists() < 0) {
+        return 1;
+    }
+    packet_trace_init_from_env();
+    vpn_engine_set_reject_categories(reject);
+    vpn_engine_set_lazy_connect(lazy_connect);
+
+    // A write to a socket the server reset fails with EPIPE instead of
+    // killing the daemon, as ART arranges for the app
+    signal(SIGPIPE, SIG_IGN);
+
+    // Signals are taken by the main thread only; the engine threads inherit
+    // the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pid_t child = -1;
+    if (command != NULL) {
+        child = spawn_peer(command, &tun_fd);
+    } else if (tun_fd < 0) {
+        tun_fd = open_tun(tun_name);
+    }
+    if (tun_fd < 0) {
+        filter_cleanup();
+        return 1;
+    }
+
+    pthread_t engine;
+    if (pthread_create(&engine, NULL, engine_main, NULL) != 0) {
+        perror("pthread_create");
+        return 1;
+    }
+
+    int status = 0;
+    uint64_t last_time = clock_ms();
+    vpn_engine_stats_t last;
+    memset(&last, 0, sizeof(last));
+
+    for (int done = 0; !done;) {
+        struct timespec timeout = {interval > 0 ? interval : 3600, 0};
+        int sig = sigtimedwait(&signals, NULL, &timeout);
+
+        if (sig == SIGHUP) {
+            int rules = load_lists();
+            if (rules >= 0) {
+                fprintf(stderr, "domainfilterd: reloaded %d rules\n", rules);
+            }
+        } else if (sig == SIGCHLD) {
+            int child_status;
+            if (child > 0 && waitpid(child, &child_status, WNOHANG) == child) {
+                status = WIFEXITED(child_status) ? WEXITSTATUS(child_status) : 1;
+                child = -1;
+                done = 1;
+            }
+        } else if (sig == SIGINT || sig == SIGTERM || sig == SIGUSR1) {
+            done = 1;
+        } else if (sig < 0 && errno == EAGAIN && interval > 0) {
+            report_stats(clock_ms(), &last_time, &last);
+        }
+    }
+
+    // The engine closes its flows on its own thread; the tun device and the
+    // lists go only once it has returned
+    vpn_engine_stop();
+    pthread_join(engine, NULL);
+    if (interval > 0) {
+        report_stats(clock_ms(), &last_time, &last);
+    }
+    if (child > 0 && kill(child, SIGTERM) == 0) {
+        waitpid(child, NULL, 0);
+    }
+
+    close(tun_fd);
+    filter_cleanup();
+    return engine_result < 0 ? 1 : status;
+}
@@ -0,0 +1,305 @@
+// dns_forwarder.c
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "include/dns_forwarder.h"
+#include "include/flow_timer.h"
+#include "include/filter_ipset.h"
+#include "include/packet_builder.h"
+
+#define TAG "DnsForwarder"
+#include "include/native_log.h"
+
+#define DNS_HEADER   12
+#define DNS_MAX_SIZE 4096
+#define ID_ATTEMPTS  16     // Random IDs tried before a query is dropped
+
+// A query waiting for its answer
+typedef struct {
+    uint32_t client_ip;     // Network byte order
+    uint32_t server_ip;     // Where the client sent the query
+    uint16_t client_port;   // Host byte order
+    uint16_t client_id;     // Transaction ID chosen by the client
+    uint16_t upstream_id;   // Transaction ID used upstream
+    uint8_t socket;         // Index of the upstream socket used
+    uint8_t in_use;
+    flow_timer_t timer;
+} dns_pending_t;
+
+static int upstream_fds[DNS_FORWARD_SOCKETS];
+static int upstream_queries[DNS_FORWARD_SOCKETS];   // Pending queries per socket
+static int num_upstream = 0;
+static dns_pending_t pending[DNS_FORWARD_PENDING];
+static uint16_t free_slots[DNS_FORWARD_PENDING];
+static int num_free_slots = 0;
+static uint16_t id_slots[1 << 16];      // Pending slot + 1 for each upstream ID in use
+static flow_wheel_t pending_timers;
+static dns_forwarder_stats_t forwarder_stats;
+
+// Socket rotation: the socket being retired (-1 if none), when it stopped
+// taking queries, and when the next one is due
+static int retiring_socket = -1;
+static uint64_t retire_start_ms;
+static uint64_t next_rotation_ms;
+static int next_rotated = 0;
+
+static void release(dns_pending_t *query) {
+    flow_timer_cancel(&query->timer);
+    query->in_use = 0;
+    id_slots[query->upstream_id] = 0;
+    upstream_queries[query->socket]--;
+    free_slots[num_free_slots++] = (uint16_t)(query - pending);
+}
+
+// Bind to a random ephemeral source port picked by the kernel
+static int bind_upstream(int fd) {
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        LOGE("Failed to bind DNS socket: %s", strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return 0;
+}
+
+int dns_forwarder_start(const int *fds, int count, uint64_t now_ms) {
+    if (count > DNS_FORWARD_SOCKETS) {
+        count = DNS_FORWARD_SOCKETS;
+    }
+
+    num_upstream = 0;
+    for (int i = 0; i < count; i++) {
+        if (bind_upstream(fds[i]) < 0) {
+            close(fds[i]);
+            continue;
+        }
+        upstream_queries[num_upstream] = 0;
+        upstream_fds[num_upstream++] = fds[i];
+    }
+
+    memset(pending, 0, sizeof(pending));
+    memset(id_slots, 0, sizeof(id_slots));
+    for (int i = 0; i < DNS_FORWARD_PENDING; i++) {
+        free_slots[i] = (uint16_t)(DNS_FORWARD_PENDING - 1 - i);
+    }
+    num_free_slots = DNS_FORWARD_PENDING;
+    flow_wheel_init(&pending_timers, now_ms);
+    memset(&forwarder_stats, 0, sizeof(forwarder_stats));
+    retiring_socket = -1;
+    next_rotation_ms = now_ms + DNS_FORWARD_ROTATE_MS;
+    next_rotated = 0;
+
+    LOGI("DNS forwarder started with %d sockets", num_upstream);
+    return num_upstream > 0 ? 0 : -1;
+}
+
+void dns_forwarder_stop() {
+    for (int i = 0; i < num_upstream; i++) {
+        close(upstream_fds[i]);
+    }
+    num_upstream = 0;
+    num_free_slots = 0;
+    retiring_socket = -1;
+}
+
+int dns_forwarder_fds(int *fds, int max) {
+    int count = num_upstream < max ? num_upstream : max;
+    memcpy(fds, upstream_fds, count * sizeof(int));
+    return count;
+}
+
+int dns_forwarder_query(const void *packet, size_t len) {
+    const struct iphdr *ip = packet;
+    size_t ip_header_len = ip->ihl * 4;
+    if (num_upstream == 0 || len < ip_header_len + sizeof(struct udphdr) + DNS_HEADER) {
+        return -1;
+    }
+
+    const struct udphdr *udp = (const struct udphdr *)((const uint8_t *)packet + ip_header_len);
+    const uint8_t *dns = (const uint8_t *)udp + sizeof(struct udphdr);
+    size_t dns_len = ntohs(udp->len) - sizeof(struct udphdr);
+    if (ntohs(udp->len) < sizeof(struct udphdr) + DNS_HEADER ||
+        dns_len > len - ip_header_len - sizeof(struct udphdr) || dns_len > DNS_MAX_SIZE) {
+        return -1;
+    }
+
+    if (num_free_slots == 0) {
+        forwarder_stats.dropped++;
+        return -1;
+    }
+
+    // All 16 bits of the ID are random. An ID still in use is drawn again;
+    // with at most DNS_FORWARD_PENDING in flight that is rare.
+    uint16_t id = 0;
+    int attempts = 0;
+    do {
+        id = (uint16_t)arc4random();
+    } while (id_slots[id] != 0 && ++attempts < ID_ATTEMPTS);
+    if (id_slots[id] != 0) {
+        forwarder_stats.dropped++;
+        return -1;
+    }
+
+    // Any socket but one being retired. With a single socket it stays in use.
+    int socket = (int)arc4random_uniform((uint32_t)num_upstream);
+    if (socket == retiring_socket && num_upstream > 1) {
+        socket = (socket + 1 + (int)arc4random_uniform((uint32_t)num_upstream - 1)) % num_upstream;
+    }
+
+    uint16_t slot = free_slots[--num_free_slots];
+    dns_pending_t *query = &pending[slot];
+    query->client_ip = ip->saddr;
+    query->server_ip = ip->daddr;
+    query->client_port = ntohs(udp->source);
+    query->client_id = (uint16_t)(dns[0] << 8 | dns[1]);
+    query->upstream_id = id;
+    query->socket = (uint8_t)socket;
+    query->in_use = 1;
+    id_slots[id] = (uint16_t)(slot + 1);
+    upstream_queries[socket]++;
+
+    uint8_t message[DNS_MAX_SIZE];
+    memcpy(message, dns, dns_len);
+    message[0] = (uint8_t)(query->upstream_id >> 8);
+    message[1] = (uint8_t)query->upstream_id;
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = udp->dest;
+    server.sin_addr.s_addr = ip->daddr;
+
+    if (sendto(upstream_fds[query->socket], message, dns_len, 0,
+               (struct sockaddr *)&server, sizeof(server)) < 0) {
+        LOGE("Failed to forward DNS query: %s", strerror(errno));
+        forwarder_stats.dropped++;
+        release(query);
+        return -1;
+    }
+
+    flow_timer_arm(&pending_timers, &query->timer, DNS_FORWARD_TIMEOUT_MS);
+    forwarder_stats.queries++;
+    return 0;
+}
+
+int dns_forwarder_receive(int fd, void *out, size_t size) {
+    uint8_t message[DNS_MAX_SIZE];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+
+    ssize_t received = recvfrom(fd, message, sizeof(message), 0, (struct sockaddr *)&from, &from_len);
+    if (received < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOGE("Failed to receive DNS answer: %s", strerror(errno));
+        }
+        return -1;
+    }
+    if (received < DNS_HEADER) {
+        return 0;
+    }
+
+    // Only accept the answer from the server, socket and ID the query used
+    uint16_t id = (uint16_t)(message[0] << 8 | message[1]);
+    if (id_slots[id] == 0) {
+        forwarder_stats.dropped++;
+        return 0;
+    }
+    dns_pending_t *query = &pending[id_slots[id] - 1];
+    if (upstream_fds[query->socket] != fd ||
+        from.sin_addr.s_addr != query->server_ip || from.sin_port != htons(53)) {
+        forwarder_stats.dropped++;
+        return 0;
+    }
+
+    message[0] = (uint8_t)(query->client_id >> 8);
+    message[1] = (uint8_t)query->client_id;
+
+    // Remember where blocked names resolve to
+    ipset_learn_dns_response(message, (size_t)received);
+
+    int length = packet_build_udp4(out, size, query->server_ip, 53, query->client_ip,
+                                   query->client_port, message, (size_t)received);
+    release(query);
+
+    // An answer too large for out is dropped; -1 would end the caller's
+    // drain with more answers still queued on the socket
+    if (length < 0) {
+        forwarder_stats.dropped++;
+        return 0;
+    }
+    forwarder_stats.answers++;
+    return length;
+}
+
+static void expire_query(flow_timer_t *timer, void *ctx) {
+    dns_pending_t *query = flow_timer_entry(timer, dns_pending_t, timer);
+    forwarder_stats.timeouts++;
+    release(query);
+}
+
+void dns_forwarder_expire(uint64_t now_ms) {
+    flow_wheel_advance(&pending_timers, now_ms, expire_query, NULL);
+}
+
+int dns_forwarder_retiring(uint64_t now_ms) {
+    if (num_upstream == 0) {
+        return -1;
+    }
+
+    if (retiring_socket < 0) {
+        if (now_ms < next_rotation_ms) {
+            return -1;
+        }
+        retiring_socket = next_rotated;
+        retire_start_ms = now_ms;
+        next_rotated = (next_rotated + 1) % num_upstream;
+    }
+
+    // Queries still waiting on it expire within DNS_FORWARD_TIMEOUT_MS
+    if (upstream_queries[retiring_socket] > 0 && now_ms < retire_start_ms + DNS_FORWARD_TIMEOUT_MS) {
+        return -1;
+    }
+    return retiring_socket;
+}
+
+int dns_forwarder_replace(int index, int fd, uint64_t now_ms) {
+    if (index < 0 || index >= num_upstream) {
+        return -1;
+    }
+
+    retiring_socket = -1;
+    next_rotation_ms = now_ms + DNS_FORWARD_ROTATE_MS;
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind_upstream(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Answers to queries left on the old socket can no longer be matched
+    for (int i = 0; i < DNS_FORWARD_PENDING; i++) {
+        if (pending[i].in_use && pending[i].socket == index) {
+            forwarder_stats.timeouts++;
+            release(&pending[i]);
+        }
+    }
+
+    close(upstream_fds[index]);
+    upstream_fds[index] = fd;
+    forwarder_stats.rotations++;
+    return 0;
+}
+
+void dns_forwarder_get_stats(dns_forwarder_stats_t *stats) {
+    *stats = forwarder_stats;
+}
@@ -5,12 +5,10 @@
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #include <arpa/inet.h>
-#include <android/log.h>
 #include "include/domainfilter.h"
 
 #define TAG "DomainExtract"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#include "include/native_log.h"
 
 // Extract domain from DNS packet
 static int extract_dns_domain(const uint8_t *dns_data, size_t dns_len, char *domain, size_t domain_size) {
@@ -93,6 +91,11 @@ static int extract_http_host(const uint8_t *http_data, size_t http_len, char *do
                 pos++;
             }
 
+            // The rest of the line is in a later segment
+            if (pos == http_len) {
+                return 0;
+            }
+
             // Strip port if present
             for (size_t j = 0; j < domain_pos; j++) {
                 if (domain[j] == ':') {
@@ -300,4 +303,39 @@ int extract_domain_from_packet(const void *packet, size_t len, char *domain, siz
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Domain extraction over the first bytes of a stream
+int extract_domain_from_stream(const void *data, size_t len, uint16_t dst_port, char *domain, size_t domain_size) {
+    const uint8_t *stream = data;
+
+    // HTTP: wait for the end of the request headers, so that a Host line
+    // split across segments is never read half
+    if (dst_port == 80) {
+        for (size_t i = 0; i + 4 <= len; i++) {
+            if (memcmp(stream + i, "\r\n\r\n", 4) == 0) {
+                int found = extract_http_host(stream, i + 4, domain, domain_size);
+                return found > 0 ? found : -1;
+            }
+        }
+        return 0;
+    }
+
+    // HTTPS: wait for the whole first record, which holds the ClientHello
+    if (dst_port == 443) {
+        if (len < 5) {
+            return 0;
+        }
+        if (stream[0] != 0x16) {
+            return -1;
+        }
+        size_t record_len = (size_t)(stream[3] << 8 | stream[4]);
+        if (len < record_len + 5) {
+            return 0;
+        }
+        int found = extract_tls_sni(stream, record_len + 5, domain, domain_size);
+        return found > 0 ? found : -1;
+    }
+
+    return -1;
+}
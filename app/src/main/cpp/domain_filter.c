@@ -1,94 +1,251 @@
 // domain_filter.c
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <pthread.h>
-#include <android/log.h>
-#include <ctype.h> // Added this header for isdigit()
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "include/domainfilter.h"
+#include "include/filter_backend.h"
+#include "include/filter_batch.h"
+#include "include/filter_builtin.h"
+#include "include/filter_regex.h"
+#include "include/filter_rules.h"
 
 #define TAG "DomainFilter"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
-
-// Trie node structure for efficient domain filtering
-typedef struct trie_node {
-    struct trie_node *children[256]; // Support for international domains
-    uint8_t is_end;                  // Is this the end of a domain?
-    uint8_t wildcard;                // Is this a wildcard node?
-} trie_node_t;
-
-// Global filter trie root
-static trie_node_t *filter_trie = NULL;
+#include "include/native_log.h"
+
+// Names handed to the matcher at once by filter_check_domains
+#define FILTER_LOOKUP_GROUP 64
+
+// Domain rules go to the selected matcher backend
+static const filter_backend_t *const filter_backends[] = {
+        [FILTER_BACKEND_TRIE] = &filter_backend_trie,
+        [FILTER_BACKEND_HASH] = &filter_backend_hash,
+};
+static const filter_backend_t *filter_backend = &filter_backend_trie;
+static int filter_ready = 0;
+
+// Regex rules share one lazily built automaton
+static filter_regex_t filter_regex;
+static size_t filter_regex_cache_limit = REGEX_DEFAULT_CACHE_LIMIT;
 static pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Create a new trie node
-static trie_node_t *create_node() {
-    trie_node_t *node = (trie_node_t *)calloc(1, sizeof(trie_node_t));
-    return node;
+// Rules only apply if one of their lists is enabled
+static uint8_t filter_categories = 0xff;
+
+// What each list contributed, indexed by category bit
+static filter_list_stats_t filter_list_stats[8];
+
+// Create an empty matcher. Caller holds filter_mutex.
+static int create_root() {
+    regex_init(&filter_regex);
+    regex_set_cache_limit(&filter_regex, filter_regex_cache_limit);
+    if (filter_backend->init() < 0) {
+        return -1;
+    }
+    filter_ready = 1;
+    return 0;
+}
+
+// Release the matcher. Caller holds filter_mutex.
+static void destroy_root() {
+    if (filter_ready) {
+        filter_backend->destroy();
+        regex_destroy(&filter_regex);
+        memset(filter_list_stats, 0, sizeof(filter_list_stats));
+        filter_ready = 0;
+    }
 }
 
 // Initialize the filter engine
 void filter_init() {
     pthread_mutex_lock(&filter_mutex);
 
-    if (filter_trie == NULL) {
-        filter_trie = create_node();
+    if (!filter_ready && create_root() < 0) {
+        LOGE("Failed to allocate filter root");
     }
 
     pthread_mutex_unlock(&filter_mutex);
     LOGI("Domain filter initialized");
 }
 
-// Clean up a trie node recursively
-static void free_node(trie_node_t *node) {
-    if (node == NULL) {
-        return;
+// Start over with an empty matcher using the given FILTER_BACKEND_*
+int filter_init_backend(int backend) {
+    if (backend < 0 || backend >= (int)(sizeof(filter_backends) / sizeof(filter_backends[0]))) {
+        LOGE("Unknown filter backend %d", backend);
+        return -1;
     }
 
-    for (int i = 0; i < 256; i++) {
-        if (node->children[i] != NULL) {
-            free_node(node->children[i]);
-        }
-    }
+    pthread_mutex_lock(&filter_mutex);
+    destroy_root();
+    filter_backend = filter_backends[backend];
+    int result = create_root();
+    pthread_mutex_unlock(&filter_mutex);
 
-    free(node);
+    if (result < 0) {
+        LOGE("Failed to initialize %s filter backend", filter_backends[backend]->name);
+        return -1;
+    }
+    LOGI("Domain filter initialized with %s backend", filter_backend->name);
+    return 0;
 }
 
 // Clean up the filter engine
 void filter_cleanup() {
     pthread_mutex_lock(&filter_mutex);
+    destroy_root();
+    pthread_mutex_unlock(&filter_mutex);
+    LOGI("Domain filter cleaned up");
+}
+
+// Report matcher memory usage
+void filter_get_stats(filter_stats_t *stats) {
+    filter_backend_stats_t backend_stats;
+    memset(&backend_stats, 0, sizeof(backend_stats));
+
+    pthread_mutex_lock(&filter_mutex);
+    if (filter_ready) {
+        filter_backend->get_stats(&backend_stats);
+    }
+    stats->backend = filter_backend == &filter_backend_hash ? FILTER_BACKEND_HASH : FILTER_BACKEND_TRIE;
+    stats->regex_rules = filter_regex.num_rules;
+    stats->regex_cache_bytes = filter_regex.cache_bytes;
+    stats->regex_cache_flushes = filter_regex.cache_flushes;
+    pthread_mutex_unlock(&filter_mutex);
 
-    if (filter_trie != NULL) {
-        free_node(filter_trie);
-        filter_trie = NULL;
+    stats->nodes = backend_stats.entries;
+    stats->node_capacity = backend_stats.capacity;
+    stats->bytes_used = backend_stats.bytes_used;
+    stats->bytes_reserved = backend_stats.bytes_reserved;
+    stats->bytes_shared = backend_stats.bytes_shared;
+    stats->chunks = backend_stats.chunks;
+    stats->fragmentation = backend_stats.fragmentation;
+}
+
+// Report what a list (one FILTER_CATEGORY_* bit) contributed to the matcher
+int filter_get_list_stats(uint8_t category, filter_list_stats_t *stats) {
+    if (category == 0) {
+        return -1;
     }
 
+    pthread_mutex_lock(&filter_mutex);
+    *stats = filter_list_stats[__builtin_ctz(category)];
     pthread_mutex_unlock(&filter_mutex);
-    LOGI("Domain filter cleaned up");
+    return 0;
 }
 
-// Insert a domain into the filter trie
-// For blocking example.com, the domain is inserted in reverse order: com.example
-// This makes wildcard matching easier
-void filter_add_domain(const char *domain) {
-    if (domain == NULL || *domain == '\0') {
-        return;
+// Cap the memory used by the regex DFA cache
+void filter_set_regex_cache_limit(size_t bytes) {
+    pthread_mutex_lock(&filter_mutex);
+    filter_regex_cache_limit = bytes;
+    regex_set_cache_limit(&filter_regex, bytes);
+    pthread_mutex_unlock(&filter_mutex);
+}
+
+// Select which lists (FILTER_CATEGORY_*) are enforced
+void filter_set_categories(uint8_t categories) {
+    pthread_mutex_lock(&filter_mutex);
+    filter_categories = categories;
+    pthread_mutex_unlock(&filter_mutex);
+}
+
+// Add the rules below node src of a prebuilt image to the backend, one call
+// per list. path holds the reversed name spelled by the edges down to src.
+static int add_builtin_rules(const filter_builtin_t *builtin, const filter_splits_t *splits, uint32_t src,
+                             char *path, size_t depth) {
+    const filter_node_t *const *chunks = builtin->chunks;
+    uint32_t child = chunks[src >> ARENA_CHUNK_SHIFT][src & ARENA_CHUNK_MASK].first_child;
+
+    while (child != ARENA_NODE_NONE) {
+        const filter_node_t *node = &chunks[child >> ARENA_CHUNK_SHIFT][child & ARENA_CHUNK_MASK];
+        if (depth + 1 >= 256) {
+            return -1;
+        }
+        path[depth] = (char)node->ch;
+
+        uint8_t flags[FILTER_CATEGORY_BITS];
+        splits_node_flags(splits, node, child, flags);
+        for (int i = 0; i < FILTER_CATEGORY_BITS; i++) {
+            if (flags[i] != 0 && filter_backend->add(path, depth + 1, flags[i], (uint8_t)(1u << i)) < 0) {
+                return -1;
+            }
+        }
+        if (add_builtin_rules(builtin, splits, child, path, depth + 1) < 0) {
+            return -1;
+        }
+        child = node->next_sibling;
     }
 
-    // Reverse domain for insertion
-    char reversed[256];
-    size_t domain_len = strlen(domain);
+    return 0;
+}
 
-    if (domain_len >= sizeof(reversed)) {
-        LOGE("Domain too long: %s", domain);
-        return;
+// Make a prebuilt image the active matcher. With nothing else loaded and a
+// trie backend this is just a pointer assignment; otherwise the image is
+// merged into the rules already loaded.
+int filter_attach_builtin(const filter_builtin_t *builtin) {
+    if (builtin->num_nodes == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&filter_mutex);
+
+    int result = (int)builtin->num_rules;
+    int replace = !filter_ready || (filter_backend->is_empty() && filter_regex.num_rules == 0);
+
+    if (!filter_ready && create_root() < 0) {
+        result = -1;
+    } else if (filter_backend->attach != NULL) {
+        if (filter_backend->attach(builtin, replace) < 0) {
+            result = -1;
+        }
+    } else {
+        char path[256];
+        filter_splits_t splits;
+        splits_attach_readonly(&splits, builtin->splits, builtin->split_capacity);
+        if (filter_backend->prepare() < 0 || add_builtin_rules(builtin, &splits, ARENA_NODE_NONE, path, 0) < 0) {
+            result = -1;
+        }
+    }
+
+    if (result < 0) {
+        LOGE("Out of filter memory merging built-in lists");
+    }
+    pthread_mutex_unlock(&filter_mutex);
+    return result;
+}
+
+// Write the matcher as C source for a prebuilt image
+int filter_write_builtin_source(FILE *out) {
+    pthread_mutex_lock(&filter_mutex);
+
+    if (!filter_ready || filter_regex.num_rules > 0 || filter_backend->serialize == NULL) {
+        pthread_mutex_unlock(&filter_mutex);
+        LOGE("Built-in lists must be non-empty, free of regex rules and use a serializable backend");
+        return -1;
+    }
+
+    int result = filter_backend->serialize(out);
+
+    pthread_mutex_unlock(&filter_mutex);
+    return result;
+}
+
+// Reverse the labels of a domain: ads.Example.com becomes com.example.ads
+// Returns the length written to out, or -1 if the domain does not fit
+static int reverse_domain(const char *domain, size_t domain_len, char *reversed, size_t size) {
+    if (domain_len >= size) {
+        return -1;
     }
 
     // Find domain parts and reverse them
     size_t pos = 0;
     const char *start = domain;
-    const char *end = domain + domain_len;
-    const char *current = end;
+    const char *current = domain + domain_len;
 
     // Handle trailing dot
     if (domain_len > 0 && domain[domain_len - 1] == '.') {
@@ -103,15 +260,15 @@ void filter_add_domain(const char *domain) {
             current--;
         }
 
-        // Copy the part
+        // Copy the part. Names are matched in lowercase.
         for (const char *p = current; p < part_end; p++) {
-            if (pos < sizeof(reversed) - 1) {
-                reversed[pos++] = *p;
+            if (pos < size - 1) {
+                reversed[pos++] = (char)tolower((unsigned char)*p);
             }
         }
 
         // Add separator
-        if (current > start && pos < sizeof(reversed) - 1) {
+        if (current > start && pos < size - 1) {
             reversed[pos++] = '.';
         }
 
@@ -123,201 +280,633 @@ void filter_add_domain(const char *domain) {
 
     // Null terminate
     reversed[pos] = '\0';
+    return (int)pos;
+}
+
+// Make sure the matcher exists and can be modified. Caller holds filter_mutex.
+static int prepare_update() {
+    if ((!filter_ready && create_root() < 0) || filter_backend->prepare() < 0) {
+        LOGE("Failed to allocate filter root");
+        return -1;
+    }
+    return 0;
+}
+
+// Insert a domain rule into the matcher with the given node flags
+// For blocking example.com, the domain is inserted in reverse order: com.example
+// This makes wildcard matching easier
+// Caller holds filter_mutex and has called prepare_update().
+static int add_domain_rule_locked(const char *domain, size_t domain_len, uint8_t flags, uint8_t category) {
+    char reversed[256];
+    int pos = reverse_domain(domain, domain_len, reversed, sizeof(reversed));
+
+    if (pos <= 0) {
+        LOGE("Domain too long: %.*s", (int)domain_len, domain);
+        return -1;
+    }
+
+    if (filter_backend->add(reversed, pos, flags, category) < 0) {
+        LOGE("Out of filter memory adding: %.*s", (int)domain_len, domain);
+        return -1;
+    }
+    return 0;
+}
 
-    // Insert into trie
+static int add_domain_rule(const char *domain, size_t domain_len, uint8_t flags, uint8_t category) {
     pthread_mutex_lock(&filter_mutex);
 
-    trie_node_t *node = filter_trie;
-    if (node == NULL) {
-        // Initialize if needed
-        node = filter_trie = create_node();
+    int result = prepare_update();
+    if (result == 0) {
+        result = add_domain_rule_locked(domain, domain_len, flags, category);
     }
 
-    // Check for wildcard domain
-    int is_wildcard = 0;
-    if (pos > 2 && reversed[0] == '*' && reversed[1] == '.') {
-        is_wildcard = 1;
-        memmove(reversed, reversed + 2, pos - 1); // Remove "*."
-        pos -= 2;
+    pthread_mutex_unlock(&filter_mutex);
+    return result;
+}
+
+// Split the "*." prefix (subdomains only) off a plain domain
+static uint8_t plain_domain_flags(const char **domain, size_t *len) {
+    if (*len > 2 && (*domain)[0] == '*' && (*domain)[1] == '.') {
+        *domain += 2;
+        *len -= 2;
+        return FILTER_NODE_SUBDOMAINS(FILTER_ACTION_BLOCK);
     }
+    return FILTER_ACTION_BLOCK;
+}
 
-    // Insert each character
-    for (size_t i = 0; i < pos; i++) {
-        unsigned char c = reversed[i];
+// Add a plain domain as a user rule.
+// Caller holds filter_mutex and has called prepare_update().
+static int add_plain_domain_locked(const char *domain, size_t len) {
+    uint8_t flags = plain_domain_flags(&domain, &len);
+    return add_domain_rule_locked(domain, len, flags, FILTER_CATEGORY_CUSTOM);
+}
 
-        if (node->children[c] == NULL) {
-            node->children[c] = create_node();
+// Queue a domain rule in a load batch. Returns -1 if it does not fit.
+static int batch_domain_rule(filter_batch_t *batch, const char *domain, size_t domain_len, uint8_t flags) {
+    char reversed[256];
+    int pos = reverse_domain(domain, domain_len, reversed, sizeof(reversed));
+
+    if (pos <= 0) {
+        LOGE("Domain too long: %.*s", (int)domain_len, domain);
+        return -1;
+    }
+    if (filter_batch_add(batch, reversed, pos, flags) < 0) {
+        LOGE("Out of memory queueing: %.*s", (int)domain_len, domain);
+        return -1;
+    }
+    return 0;
+}
+
+// Add the rules of a load batch that can still change a verdict. The batch
+// is sorted, so rules for parent domains, from this load or an earlier one,
+// are in the matcher by the time their subdomains are checked. Only rules
+// of the same list count: the others may be switched off.
+// Caller holds filter_mutex and has called prepare_update().
+static int commit_batch(filter_batch_t *batch, uint8_t category, filter_list_stats_t *stats) {
+    stats->duplicates += filter_batch_sort(batch);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        const filter_batch_rule_t *rule = &batch->rules[i];
+        uint8_t actions = rule->flags & FILTER_ACTION_MASK;
+        uint8_t subdomain_actions = rule->flags >> FILTER_NODE_SUBDOMAIN_SHIFT;
+
+        // What already applies to the name, and to the names below it
+        char name[257];
+        memcpy(name, rule->reversed, rule->len);
+        name[rule->len] = '.';
+        uint8_t covered = filter_backend->lookup(name, rule->len, category);
+        uint8_t covered_below = filter_backend->lookup(name, rule->len + 1, category) | actions;
+
+        if (filter_actions_covered(covered, actions) &&
+            filter_actions_covered(covered_below, subdomain_actions)) {
+            stats->redundant++;
+            continue;
         }
 
-        node = node->children[c];
+        if (filter_backend->add(rule->reversed, rule->len, rule->flags, category) < 0) {
+            LOGE("Out of filter memory adding: %.*s", (int)rule->len, rule->reversed);
+            return -1;
+        }
+        stats->added++;
     }
 
-    node->is_end = 1;
-    node->wildcard = is_wildcard;
+    return 0;
+}
+
+// Fold the results of a load into its list's totals. Caller holds filter_mutex.
+static void record_list_stats(uint8_t category, const filter_list_stats_t *stats) {
+    filter_list_stats_t *total = &filter_list_stats[__builtin_ctz(category)];
+    total->rules += stats->rules;
+    total->added += stats->added;
+    total->duplicates += stats->duplicates;
+    total->redundant += stats->redundant;
+    total->unsupported += stats->unsupported;
+}
 
+// Normalize, dedup and add a batch of rules from one list in one update
+static int commit_load(filter_batch_t *batch, uint8_t category, filter_list_stats_t *stats) {
+    pthread_mutex_lock(&filter_mutex);
+    int result = prepare_update();
+    if (result == 0) {
+        result = commit_batch(batch, category, stats);
+        record_list_stats(category, stats);
+    }
     pthread_mutex_unlock(&filter_mutex);
-    LOGI("Added domain to filter: %s", domain);
+    return result;
 }
 
-// Load domains from a file
-int filter_load_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        LOGE("Failed to open filter file: %s", filename);
+// Add many domains in one update: the lock is taken once for the batch.
+// lengths may be NULL for NUL-terminated names. Returns the number accepted.
+int filter_add_domains(const char *const *domains, const size_t *lengths, size_t n) {
+    filter_list_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    filter_batch_t batch;
+    filter_batch_init(&batch);
+
+    for (size_t i = 0; i < n; i++) {
+        const char *domain = domains[i];
+        size_t len = lengths ? lengths[i] : strlen(domain);
+        if (len == 0) {
+            continue;
+        }
+        uint8_t flags = plain_domain_flags(&domain, &len);
+        if (batch_domain_rule(&batch, domain, len, flags) == 0) {
+            stats.rules++;
+        } else {
+            stats.unsupported++;
+        }
+    }
+
+    int result = commit_load(&batch, FILTER_CATEGORY_CUSTOM, &stats);
+    filter_batch_destroy(&batch);
+
+    LOGI("Added %llu of %zu domains to filter (%llu redundant)",
+         (unsigned long long)stats.rules, n, (unsigned long long)(stats.duplicates + stats.redundant));
+    return result < 0 ? 0 : (int)stats.rules;
+}
+
+// Add newline-separated domains from a buffer in one update
+int filter_add_domains_packed(const char *data, size_t len) {
+    const char *p = data;
+    const char *end = data + len;
+    size_t lines = 0;
+    filter_list_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    filter_batch_t batch;
+    filter_batch_init(&batch);
+
+    while (p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        const char *line_end = newline ? newline : end;
+        const char *name = p;
+
+        while (name < line_end && isspace((unsigned char)*name)) {
+            name++;
+        }
+        while (line_end > name && isspace((unsigned char)line_end[-1])) {
+            line_end--;
+        }
+        if (line_end > name) {
+            size_t name_len = line_end - name;
+            uint8_t flags = plain_domain_flags(&name, &name_len);
+            lines++;
+            if (batch_domain_rule(&batch, name, name_len, flags) == 0) {
+                stats.rules++;
+            } else {
+                stats.unsupported++;
+            }
+        }
+
+        p = (newline ? newline : end) + 1;
+    }
+
+    int result = commit_load(&batch, FILTER_CATEGORY_CUSTOM, &stats);
+    filter_batch_destroy(&batch);
+
+    LOGI("Added %llu of %zu domains to filter (%llu redundant)",
+         (unsigned long long)stats.rules, lines, (unsigned long long)(stats.duplicates + stats.redundant));
+    return result < 0 ? 0 : (int)stats.rules;
+}
+
+// Insert a domain into the filter. A leading "*." blocks subdomains only.
+void filter_add_domain(const char *domain) {
+    if (domain == NULL || *domain == '\0') {
+        return;
+    }
+
+    pthread_mutex_lock(&filter_mutex);
+    int result = prepare_update();
+    if (result == 0) {
+        result = add_plain_domain_locked(domain, strlen(domain));
+    }
+    pthread_mutex_unlock(&filter_mutex);
+
+    if (result == 0) {
+        LOGI("Added domain to filter: %s", domain);
+    }
+}
+
+// Add a parsed regex rule. Returns 1 if added, -1 on error.
+static int add_regex_rule(const filter_rule_t *rule) {
+    pthread_mutex_lock(&filter_mutex);
+    int result = -1;
+    if (filter_ready || create_root() == 0) {
+        result = regex_add(&filter_regex, rule->pattern, rule->pattern_len, rule->flags) == 0 ? 1 : -1;
+    }
+    pthread_mutex_unlock(&filter_mutex);
+    return result;
+}
+
+// Add a rule in plain, hosts or adblock syntax
+// Returns 1 if a rule was added, 0 if the line holds no rule, -1 on error
+static int add_rule(const char *line, size_t len, uint8_t category) {
+    filter_rule_t rule;
+    int parsed = filter_parse_rule(line, len, &rule);
+
+    if (parsed <= 0) {
+        return parsed;
+    }
+
+    if (rule.type == FILTER_RULE_DOMAIN) {
+        return add_domain_rule(rule.pattern, rule.pattern_len, rule.flags, category) == 0 ? 1 : -1;
+    }
+    return add_regex_rule(&rule);
+}
+
+int filter_add_rule(const char *rule) {
+    if (rule == NULL) {
         return -1;
     }
+    return add_rule(rule, strlen(rule), FILTER_CATEGORY_CUSTOM);
+}
 
-    char line[256];
-    int count = 0;
+// Rules of one list, parsed but not yet in the matcher
+typedef struct {
+    filter_batch_t batch;
+    filter_rule_t *regex;       // Patterns point into the parsed buffer
+    size_t num_regex;
+    size_t regex_capacity;
+    filter_list_stats_t stats;
+} parsed_list_t;
+
+static void parsed_list_init(parsed_list_t *list) {
+    memset(list, 0, sizeof(*list));
+    filter_batch_init(&list->batch);
+}
 
-    while (fgets(line, sizeof(line), file)) {
-        // Remove trailing newline
-        size_t len = strlen(line);
-        if (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
-            line[--len] = '\0';
+static void parsed_list_destroy(parsed_list_t *list) {
+    filter_batch_destroy(&list->batch);
+    free(list->regex);
+    memset(list, 0, sizeof(*list));
+}
+
+// Keep a regex rule for the commit. Returns -1 if out of memory.
+static int parsed_list_add_regex(parsed_list_t *list, const filter_rule_t *rule) {
+    if (list->num_regex == list->regex_capacity) {
+        size_t capacity = list->regex_capacity ? list->regex_capacity * 2 : 16;
+        filter_rule_t *regex = realloc(list->regex, capacity * sizeof(filter_rule_t));
+        if (regex == NULL) {
+            return -1;
         }
-        if (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
-            line[--len] = '\0';
+        list->regex = regex;
+        list->regex_capacity = capacity;
+    }
+    list->regex[list->num_regex++] = *rule;
+    return 0;
+}
+
+// Parse rules straight out of a caller-owned buffer, which must outlive
+// the parsed list. Lines are located with memchr and handed to the parser
+// in place, so nothing is copied per line and there is no line length
+// limit. No lock is needed: nothing reaches the matcher yet.
+static void parse_buffer(const char *data, size_t len, parsed_list_t *list) {
+    const char *p = data;
+    const char *end = data + len;
+
+    while (p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        const char *line_end = newline ? newline : end;
+
+        filter_rule_t rule;
+        int parsed = filter_parse_rule(p, line_end - p, &rule);
+        if (parsed > 0 && rule.type == FILTER_RULE_DOMAIN) {
+            parsed = batch_domain_rule(&list->batch, rule.pattern, rule.pattern_len, rule.flags) == 0 ? 1 : -1;
+        } else if (parsed > 0) {
+            parsed = parsed_list_add_regex(list, &rule) == 0 ? 1 : -1;
         }
 
-        // Skip comments and empty lines
-        if (len == 0 || line[0] == '#') {
-            continue;
+        if (parsed > 0) {
+            list->stats.rules++;
+        } else if (parsed < 0) {
+            list->stats.unsupported++;
         }
 
-        // Skip IP addresses in hosts file format
-        if (isdigit(line[0]) || line[0] == ':') {
-            // Find the domain part
-            char *domain = line;
-            while (*domain && !isspace(*domain)) {
-                domain++;
-            }
-            while (*domain && isspace(*domain)) {
-                domain++;
-            }
-            if (*domain) {
-                filter_add_domain(domain);
-                count++;
-            }
+        p = line_end + 1;
+    }
+}
+
+// Add a parsed list to the matcher. Domain rules go through the dedup pass
+// first. Caller holds filter_mutex and has called prepare_update().
+static int commit_list_locked(parsed_list_t *list, uint8_t category) {
+    for (size_t i = 0; i < list->num_regex; i++) {
+        const filter_rule_t *rule = &list->regex[i];
+        if (regex_add(&filter_regex, rule->pattern, rule->pattern_len, rule->flags) == 0) {
+            list->stats.added++;
         } else {
-            // Add domain directly
-            filter_add_domain(line);
-            count++;
+            list->stats.rules--;
+            list->stats.unsupported++;
         }
     }
 
-    fclose(file);
-    LOGI("Loaded %d domains from %s", count, filename);
-    return count;
+    int result = commit_batch(&list->batch, category, &list->stats);
+    record_list_stats(category, &list->stats);
+    return result;
 }
 
-// Check if a domain matches the filter
-// For checking example.com, the domain is checked in reverse: com.example
-int filter_check_domain(const char *domain) {
-    if (domain == NULL || *domain == '\0' || filter_trie == NULL) {
-        return 0;
+static void log_list_stats(const parsed_list_t *list, const char *name) {
+    LOGI("Loaded %llu rules from %s: %llu added, %llu duplicate, %llu redundant (%llu unsupported)",
+         (unsigned long long)list->stats.rules, name, (unsigned long long)list->stats.added,
+         (unsigned long long)list->stats.duplicates, (unsigned long long)list->stats.redundant,
+         (unsigned long long)list->stats.unsupported);
+}
+
+// Parse a buffer and add its rules under one lock
+static int load_buffer(const char *data, size_t len, uint8_t category, const char *name) {
+    parsed_list_t list;
+    parsed_list_init(&list);
+    parse_buffer(data, len, &list);
+
+    pthread_mutex_lock(&filter_mutex);
+    int result = prepare_update();
+    if (result == 0) {
+        result = commit_list_locked(&list, category);
     }
+    pthread_mutex_unlock(&filter_mutex);
 
-    // Reverse domain for checking
-    char reversed[256];
-    size_t domain_len = strlen(domain);
+    if (result == 0) {
+        log_list_stats(&list, name);
+    }
+    int rules = (int)list.stats.rules;
+    parsed_list_destroy(&list);
+    return result < 0 ? -1 : rules;
+}
+
+// Load rules from a memory buffer as user rules
+int filter_load_buffer(const char *data, size_t len) {
+    if (data == NULL) {
+        return -1;
+    }
+    return load_buffer(data, len, FILTER_CATEGORY_CUSTOM, "buffer");
+}
 
-    if (domain_len >= sizeof(reversed)) {
-        LOGE("Domain too long for checking: %s", domain);
+// Load rules from a memory buffer into the given list category
+int filter_load_list_buffer(const char *data, size_t len, uint8_t category) {
+    if (data == NULL) {
+        return -1;
+    }
+    return load_buffer(data, len, category, "buffer");
+}
+
+// Map a list file for parsing in place. An empty file maps to NULL.
+static int map_file(const char *filename, void **data, size_t *size) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Failed to open filter file: %s", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        LOGE("Failed to stat filter file: %s", filename);
+        close(fd);
+        return -1;
+    }
+
+    *data = NULL;
+    *size = (size_t)st.st_size;
+    if (st.st_size == 0) {
+        close(fd);
         return 0;
     }
 
-    // Find domain parts and reverse them
-    size_t pos = 0;
-    const char *start = domain;
-    const char *end = domain + domain_len;
-    const char *current = end;
+    *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*data == MAP_FAILED) {
+        LOGE("Failed to map filter file: %s", filename);
+        return -1;
+    }
+    madvise(*data, st.st_size, MADV_SEQUENTIAL);
+    return 0;
+}
 
-    // Handle trailing dot
-    if (domain_len > 0 && domain[domain_len - 1] == '.') {
-        current--;
+// Load rules from a file into the given list category. The file is mapped
+// and parsed in place.
+int filter_load_list(const char *filename, uint8_t category) {
+    void *data;
+    size_t size;
+    if (map_file(filename, &data, &size) < 0) {
+        return -1;
     }
 
-    while (current > start) {
-        const char *part_end = current;
+    if (data == NULL) {
+        LOGI("Loaded 0 rules from %s", filename);
+        return 0;
+    }
 
-        // Find start of part (or end of previous part)
-        while (current > start && *(current - 1) != '.') {
-            current--;
-        }
+    int count = load_buffer(data, size, category, filename);
 
-        // Copy the part
-        for (const char *p = current; p < part_end; p++) {
-            if (pos < sizeof(reversed) - 1) {
-                reversed[pos++] = *p;
-            }
+    munmap(data, size);
+    return count;
+}
+
+// Replace all rules with those of the given list files in one step. Every
+// file is read and parsed before the lock is taken, and the matcher is
+// rebuilt under a single hold of it, so lookups see either the old rules or
+// all of the new ones. If a file cannot be read nothing changes.
+int filter_reload_lists(const char *const *filenames, const uint8_t *categories, size_t n) {
+    parsed_list_t *lists = calloc(n > 0 ? n : 1, sizeof(parsed_list_t));
+    void **maps = calloc(n > 0 ? n : 1, sizeof(void *));
+    size_t *sizes = calloc(n > 0 ? n : 1, sizeof(size_t));
+    int result = lists != NULL && maps != NULL && sizes != NULL ? 0 : -1;
+
+    size_t mapped = 0;
+    for (; result == 0 && mapped < n; mapped++) {
+        if (map_file(filenames[mapped], &maps[mapped], &sizes[mapped]) < 0) {
+            result = -1;
+            break;
         }
+        parsed_list_init(&lists[mapped]);
+        if (maps[mapped] != NULL) {
+            parse_buffer(maps[mapped], sizes[mapped], &lists[mapped]);
+        }
+    }
 
-        // Add separator
-        if (current > start && pos < sizeof(reversed) - 1) {
-            reversed[pos++] = '.';
+    int rules = 0;
+    if (result == 0) {
+        pthread_mutex_lock(&filter_mutex);
+        destroy_root();
+        result = prepare_update();
+        for (size_t i = 0; i < n && result == 0; i++) {
+            result = commit_list_locked(&lists[i], categories[i]);
+            rules += (int)lists[i].stats.rules;
         }
+        pthread_mutex_unlock(&filter_mutex);
+    }
 
-        // Skip the dot
-        if (current > start) {
-            current--;
+    for (size_t i = 0; i < mapped; i++) {
+        if (result == 0) {
+            log_list_stats(&lists[i], filenames[i]);
+        }
+        parsed_list_destroy(&lists[i]);
+        if (maps[i] != NULL) {
+            munmap(maps[i], sizes[i]);
         }
     }
+    free(lists);
+    free(maps);
+    free(sizes);
 
-    // Null terminate
-    reversed[pos] = '\0';
+    if (result < 0) {
+        LOGE("Filter reload failed");
+        return -1;
+    }
+    return rules;
+}
 
-    pthread_mutex_lock(&filter_mutex);
+// Load rules from a file as user rules
+int filter_load_file(const char *filename) {
+    return filter_load_list(filename, FILTER_CATEGORY_CUSTOM);
+}
 
-    // Exact match check
-    int blocked = 0;
-    trie_node_t *node = filter_trie;
+// Verdict for a domain given the matcher actions for its reversed name
+static int resolve_domain_locked(const char *domain, size_t domain_len, const char *reversed, size_t pos,
+                                 uint8_t actions, uint8_t *blocking) {
+    // Regex rules run over the original name unless nothing can override
+    uint8_t regex_actions = 0;
+    if (filter_regex.num_rules > 0 && !(actions & FILTER_ACTION_IMPORTANT)) {
+        regex_actions = regex_match(&filter_regex, domain, domain_len);
+    }
 
-    for (size_t i = 0; i < pos && node != NULL; i++) {
-        unsigned char c = reversed[i];
+    int blocked = filter_resolve_actions(actions | regex_actions);
+    if (blocked && blocking != NULL) {
+        // Blocks are the rare case, so each list is looked up again on its own
+        *blocking = 0;
+        for (uint8_t category = 1; category != 0; category <<= 1) {
+            if ((filter_categories & category) &&
+                filter_resolve_actions(filter_backend->lookup(reversed, pos, category))) {
+                *blocking |= category;
+            }
+        }
 
-        // Check for exact match at this level
-        if (node->is_end) {
-            blocked = 1;
-            break;
+        // Regex rules do not keep their list; a block that needed one is
+        // put down to the user's rules
+        if (*blocking == 0) {
+            *blocking = FILTER_CATEGORY_CUSTOM;
         }
+    }
+    return blocked;
+}
+
+// Check a domain against the domain and regex rules. Caller holds filter_mutex.
+// For checking example.com, the domain is checked in reverse: com.example
+// Block, exception and $important rules are collected along the way and the
+// highest priority action wins. If blocking is not NULL and the domain is
+// blocked, it is set to the lists responsible.
+static int check_domain_locked(const char *domain, size_t domain_len, uint8_t *blocking) {
+    if (!filter_ready || domain_len == 0) {
+        return 0;
+    }
+
+    // Reverse domain for checking
+    char reversed[256];
+    int pos = reverse_domain(domain, domain_len, reversed, sizeof(reversed));
 
-        node = node->children[c];
+    if (pos < 0) {
+        LOGE("Domain too long for checking: %.*s", (int)domain_len, domain);
+        return 0;
     }
 
-    // Check final node
-    if (node != NULL && node->is_end) {
-        blocked = 1;
+    uint8_t actions = filter_backend->lookup(reversed, pos, filter_categories);
+    return resolve_domain_locked(domain, domain_len, reversed, (size_t)pos, actions, blocking);
+}
+
+// Check if a domain matches the filter
+int filter_check_domain(const char *domain) {
+    return filter_check_domain_categories(domain, NULL);
+}
+
+// Check a domain and report which lists (FILTER_CATEGORY_*) block it
+int filter_check_domain_categories(const char *domain, uint8_t *categories) {
+    if (categories != NULL) {
+        *categories = 0;
+    }
+    if (domain == NULL || *domain == '\0' || !filter_ready) {
+        return 0;
     }
 
-    // If not blocked, check for wildcard matches
-    if (!blocked) {
-        // For each level of the domain, check if there's a wildcard match
-        // For example.com, check if *.example.com matches
-        for (size_t i = 0; i < pos; i++) {
-            // Skip to the next part
-            while (i < pos && reversed[i] != '.') {
-                i++;
-            }
-            if (i >= pos) {
-                break;
-            }
+    pthread_mutex_lock(&filter_mutex);
+    int blocked = check_domain_locked(domain, strlen(domain), categories);
+    pthread_mutex_unlock(&filter_mutex);
+    return blocked;
+}
 
-            // Check if wildcard matches from this part forward
-            node = filter_trie;
+// Check many domains under one lock. out[i] is set to 1 if domains[i] is blocked.
+// The names go to the matcher in groups so that a backend with
+// lookup_batch can overlap their memory accesses. A lone name has nothing
+// to overlap with and takes the single lookup path.
+void filter_check_domains(const char **domains, size_t n, uint8_t *out) {
+    if (n < 2) {
+        if (n == 1) {
+            pthread_mutex_lock(&filter_mutex);
+            out[0] = (uint8_t)check_domain_locked(domains[0], domains[0] != NULL ? strlen(domains[0]) : 0, NULL);
+            pthread_mutex_unlock(&filter_mutex);
+        }
+        return;
+    }
 
-            for (size_t j = i + 1; j < pos && node != NULL; j++) {
-                unsigned char c = reversed[j];
-                node = node->children[c];
+    char reversed[FILTER_LOOKUP_GROUP][256];
+    const char *names[FILTER_LOOKUP_GROUP];
+    size_t lens[FILTER_LOOKUP_GROUP];
+    size_t domain_lens[FILTER_LOOKUP_GROUP];
+    size_t indices[FILTER_LOOKUP_GROUP];
+    uint8_t actions[FILTER_LOOKUP_GROUP];
+
+    pthread_mutex_lock(&filter_mutex);
+    for (size_t start = 0; start < n; start += FILTER_LOOKUP_GROUP) {
+        size_t end = n - start < FILTER_LOOKUP_GROUP ? n : start + FILTER_LOOKUP_GROUP;
+        size_t count = 0;
+
+        for (size_t i = start; i < end; i++) {
+            out[i] = 0;
+            size_t domain_len = domains[i] != NULL ? strlen(domains[i]) : 0;
+            if (!filter_ready || domain_len == 0) {
+                continue;
             }
 
-            if (node != NULL && node->is_end && node->wildcard) {
-                blocked = 1;
-                break;
+            int pos = reverse_domain(domains[i], domain_len, reversed[count], sizeof(reversed[count]));
+            if (pos < 0) {
+                LOGE("Domain too long for checking: %.*s", (int)domain_len, domains[i]);
+                continue;
             }
+            names[count] = reversed[count];
+            lens[count] = (size_t)pos;
+            domain_lens[count] = domain_len;
+            indices[count] = i;
+            count++;
         }
-    }
 
+        if (filter_backend->lookup_batch != NULL && count >= 2) {
+            filter_backend->lookup_batch(names, lens, count, filter_categories, actions);
+        } else {
+            for (size_t j = 0; j < count; j++) {
+                actions[j] = filter_backend->lookup(names[j], lens[j], filter_categories);
+            }
+        }
+
+        for (size_t j = 0; j < count; j++) {
+            size_t i = indices[j];
+            out[i] = (uint8_t)resolve_domain_locked(domains[i], domain_lens[j], names[j], lens[j], actions[j], NULL);
+        }
+    }
     pthread_mutex_unlock(&filter_mutex);
-    return blocked;
-}
\ No newline at end of file
+}
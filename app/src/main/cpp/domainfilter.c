@@ -1,77 +1,56 @@
 // domainfilter.c
 #include <jni.h>
 #include <android/log.h>
+#include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <pthread.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netinet/ip.h>
-#include <netinet/tcp.h>
-#include <netinet/udp.h>
-#include <arpa/inet.h>
+#include <android/asset_manager.h>
+#include <android/asset_manager_jni.h>
 #include "include/domainfilter.h"
+#include "include/filter_ipset.h"
+#include "include/socket_pool.h"
+#include "include/dns_forwarder.h"
+#include "include/packet_pool.h"
+#include "include/packet_trace.h"
+#include "include/uring_io.h"
+#include "include/vpn_engine.h"
 
 #define TAG "DomainFilter"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
 
+// The packet engine lives in vpn_engine.c; this file connects it and the
+// filter to FilterVpnService and FilterManager.
+
 // Global variables
-static int vpn_fd = -1;
-static int running = 0;
-static JNIEnv *jni_env = NULL;
+static JavaVM *java_vm = NULL;
 static jobject vpn_service = NULL;
 static jmethodID protect_socket_method = NULL;
-static int filtered_count = 0;
-
-// Connection tracking structure
-typedef struct {
-    int protocol;           // IPPROTO_TCP or IPPROTO_UDP
-    uint32_t src_ip;
-    uint16_t src_port;
-    uint32_t dst_ip;
-    uint16_t dst_port;
-    int socket_fd;          // Socket for forwarding traffic
-    uint64_t last_active;   // Timestamp for timeout
-
-    // TCP state tracking
-    uint32_t tcp_seq_in;    // Sequence number for incoming data
-    uint32_t tcp_seq_out;   // Sequence number for outgoing data
-    uint32_t tcp_ack_in;    // Acknowledgment for incoming data
-    uint32_t tcp_ack_out;   // Acknowledgment for outgoing data
-    int tcp_state;          // TCP connection state
-} connection_t;
-
-// Simple connection tracker (in production, use a hash table)
-#define MAX_CONNECTIONS 1024
-static connection_t connections[MAX_CONNECTIONS];
-static int num_connections = 0;
-static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static jmethodID protect_sockets_method = NULL;
 
 // Forward declarations
-static int process_packet(const void *packet, size_t len);
-static int handle_outgoing_packet(const void *packet, size_t len);
-static int handle_incoming_data();
-static connection_t *find_or_create_connection(const void *packet, size_t len);
-static void cleanup_connections();
-static uint64_t get_time_ms();
+static JNIEnv *get_jni_env();
+static int protect_socket(int fd, void *ctx);
+static int protect_pool_sockets(int *fds, int count, void *ctx);
+static void detach_pool_thread(void *ctx);
 
 // JNI function to initialize the module
 JNIEXPORT void JNICALL
 Java_com_example_domainfilter_FilterVpnService_jniInit(JNIEnv *env, jobject thiz) {
     LOGI("Initializing native module");
 
-    // Save JNI environment and VPN service object
-    jni_env = env;
+    // Tracing can be switched on from the host before the service starts
+    packet_trace_init_from_env();
+
+    // Save the VM and VPN service object. Each thread gets its own JNIEnv.
+    (*env)->GetJavaVM(env, &java_vm);
     vpn_service = (*env)->NewGlobalRef(env, thiz);
 
-    // Get method ID for protectSocket
+    // Get method IDs for protectSocket and protectSockets
     jclass vpn_class = (*env)->GetObjectClass(env, vpn_service);
     protect_socket_method = (*env)->GetMethodID(env, vpn_class, "protectSocket", "(I)V");
+    protect_sockets_method = (*env)->GetMethodID(env, vpn_class, "protectSockets", "([I)V");
 
-    if (protect_socket_method == NULL) {
+    if (protect_socket_method == NULL || protect_sockets_method == NULL) {
         LOGE("Failed to get protectSocket method");
         return;
     }
@@ -79,372 +58,268 @@ Java_com_example_domainfilter_FilterVpnService_jniInit(JNIEnv *env, jobject thiz
     LOGI("Native module initialized");
 }
 
-// JNI function to start packet processing
+// JNI function to start packet processing. Runs the packet loop on the
+// calling thread until jniStop.
 JNIEXPORT void JNICALL
-Java_com_example_domainfilter_FilterVpnService_jniStart(JNIEnv *env, jobject thiz, jint fd) {
-    if (running) {
-        LOGI("Already running, ignoring start request");
-        return;
-    }
-
-    LOGI("Starting native packet processing with fd: %d", fd);
-    vpn_fd = fd;
-    running = 1;
-    filtered_count = 0;
-
-    // Make socket non-blocking
-    int flags = fcntl(vpn_fd, F_GETFL, 0);
-    fcntl(vpn_fd, F_SETFL, flags | O_NONBLOCK);
-
-    // Initialize connection tracking
-    memset(connections, 0, sizeof(connections));
-    num_connections = 0;
-
-    // Main processing loop (on this thread)
-    unsigned char buffer[4096];
-
-    while (running) {
-        // Process outgoing packets (from apps to VPN)
-        ssize_t length = read(vpn_fd, buffer, sizeof(buffer));
-        if (length > 0) {
-            process_packet(buffer, length);
-        } else if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            LOGE("Error reading from VPN interface: %s", strerror(errno));
-        }
-
-        // Process incoming packets (from network to apps)
-        handle_incoming_data();
-
-        // Cleanup idle connections periodically
-        static uint64_t last_cleanup = 0;
-        uint64_t now = get_time_ms();
-        if (now - last_cleanup > 10000) { // Every 10 seconds
-            cleanup_connections();
-            last_cleanup = now;
-        }
-
-        // Small sleep to prevent CPU thrashing
-        usleep(10000); // 10ms
+Java_com_example_domainfilter_FilterVpnService_jniStart(JNIEnv *env, jobject thiz, jint fd, jint mtu) {
+    vpn_engine_config_t config = {
+            .protect = protect_socket,
+            .protect_batch = protect_pool_sockets,
+            .thread_exit = detach_pool_thread,
+            .ctx = NULL,
+    };
+    vpn_engine_run(fd, mtu, &config);
+
+    // The loop and its pool thread no longer call into the service
+    if (vpn_service != NULL) {
+        (*env)->DeleteGlobalRef(env, vpn_service);
+        vpn_service = NULL;
     }
-
-    LOGI("Packet processing loop ended");
 }
 
-// JNI function to stop packet processing
+// JNI function to stop packet processing. jniStart returns once the loop
+// has closed its flows.
 JNIEXPORT void JNICALL
 Java_com_example_domainfilter_FilterVpnService_jniStop(JNIEnv *env, jobject thiz) {
-    LOGI("Stopping native packet processing");
-    running = 0;
-
-    // Cleanup resources
-    pthread_mutex_lock(&conn_mutex);
-    for (int i = 0; i < num_connections; i++) {
-        if (connections[i].socket_fd > 0) {
-            close(connections[i].socket_fd);
-            connections[i].socket_fd = -1;
-        }
-    }
-    num_connections = 0;
-    pthread_mutex_unlock(&conn_mutex);
-
-    if (vpn_service != NULL) {
-        (*jni_env)->DeleteGlobalRef(jni_env, vpn_service);
-        vpn_service = NULL;
-    }
-
-    LOGI("Native packet processing stopped");
+    vpn_engine_stop();
 }
 
 // JNI function to get filtered count
 JNIEXPORT jint JNICALL
 Java_com_example_domainfilter_FilterVpnService_jniGetFilteredCount(JNIEnv *env, jobject thiz) {
-    return filtered_count;
+    return vpn_engine_filtered_count();
 }
 
-// Main packet processing function
-static int process_packet(const void *packet, size_t len) {
-    if (len < sizeof(struct iphdr)) {
-        LOGE("Packet too small");
-        return -1;
-    }
-
-    const struct iphdr *ip = packet;
+// JNI function to set the upstream socket pool watermarks
+JNIEXPORT void JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniSetSocketPool(JNIEnv *env, jobject thiz, jint low, jint high) {
+    socket_pool_set_watermarks(low, high);
+}
 
-    // Handle only IPv4 packets for simplicity
-    if (ip->version != 4) {
-        return -1;
-    }
+// JNI function to select the lists whose blocked flows are rejected
+JNIEXPORT void JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniSetRejectCategories(JNIEnv *env, jobject thiz, jint categories) {
+    vpn_engine_set_reject_categories((uint8_t)categories);
+}
 
-    // Extract domain for DNS or HTTP/HTTPS traffic
-    char domain[256];
-    if (extract_domain_from_packet(packet, len, domain, sizeof(domain)) > 0) {
-        // Check if domain is blocked
-        if (filter_check_domain(domain)) {
-            LOGI("Blocking domain: %s", domain);
-            filtered_count++;
-            // Return without forwarding (block)
-            return 0;
-        }
-    }
+// JNI function to switch deferred upstream connects for HTTP and HTTPS
+JNIEXPORT void JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniSetLazyConnect(JNIEnv *env, jobject thiz, jboolean enabled) {
+    vpn_engine_set_lazy_connect(enabled);
+}
 
-    // Forward packet to real network
-    return handle_outgoing_packet(packet, len);
+// JNI function to trace one packet in every sampleRate, 0 to stop
+JNIEXPORT void JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniSetTracing(JNIEnv *env, jobject thiz, jint sampleRate) {
+    packet_trace_enable(sampleRate > 0 ? (uint32_t)sampleRate : 0);
 }
 
-// Handle outgoing packet (from app to network)
-static int handle_outgoing_packet(const void *packet, size_t len) {
-    // Find or create connection tracking entry
-    connection_t *conn = find_or_create_connection(packet, len);
-    if (conn == NULL) {
-        LOGE("Failed to create connection");
-        return -1;
+// JNI function to write the recorded trace events to a file
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniDumpTrace(JNIEnv *env, jobject thiz, jstring filePath) {
+    jint result = -1;
+    const char *file_path = (*env)->GetStringUTFChars(env, filePath, NULL);
+    if (file_path != NULL) {
+        result = packet_trace_dump(file_path);
+        (*env)->ReleaseStringUTFChars(env, filePath, file_path);
     }
 
-    const struct iphdr *ip = packet;
-
-    // Extract payload to forward
-    const unsigned char *payload;
-    size_t payload_len;
-
-    if (ip->protocol == IPPROTO_TCP) {
-        const struct tcphdr *tcp = (const struct tcphdr *)((const char *)ip + (ip->ihl * 4));
-        payload = (const unsigned char *)tcp + (tcp->doff * 4);
-        payload_len = ntohs(ip->tot_len) - (ip->ihl * 4) - (tcp->doff * 4);
-
-        // Handle TCP state tracking here (simplified)
-        // In reality, you'd need full TCP state machine
+    packet_trace_stats_t stats;
+    packet_trace_get_stats(&stats);
+    LOGI("Trace: %llu packets sampled, %llu events, %llu dropped",
+         (unsigned long long)stats.sampled, (unsigned long long)stats.events,
+         (unsigned long long)stats.dropped);
+    return result;
+}
 
-    } else if (ip->protocol == IPPROTO_UDP) {
-        const struct udphdr *udp = (const struct udphdr *)((const char *)ip + (ip->ihl * 4));
-        payload = (const unsigned char *)udp + 8; // UDP header is 8 bytes
-        payload_len = ntohs(udp->len) - 8;
-    } else {
-        // Unsupported protocol
-        return -1;
+// Copy statistics into a new Java long array
+static jlongArray new_stats_array(JNIEnv *env, const jlong *values, jsize count) {
+    jlongArray result = (*env)->NewLongArray(env, count);
+    if (result != NULL) {
+        (*env)->SetLongArrayRegion(env, result, 0, count, values);
     }
+    return result;
+}
 
-    // Forward payload to real network if there's data to send
-    if (payload_len > 0) {
-        ssize_t sent = send(conn->socket_fd, payload, payload_len, 0);
-        if (sent < 0) {
-            LOGE("Failed to send data: %s", strerror(errno));
-            return -1;
-        }
-    }
+#define STATS_ARRAY(env, values) new_stats_array(env, values, sizeof(values) / sizeof(values[0]))
+
+// Upstream connects, in the order of FilterVpnService.ConnectStats
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetConnectStats(JNIEnv *env, jobject thiz) {
+    vpn_engine_stats_t stats;
+    vpn_engine_get_stats(&stats);
+
+    jlong values[] = {
+            (jlong)stats.connects_started,
+            (jlong)stats.connects_completed,
+            (jlong)stats.connects_failed,
+            (jlong)stats.connect_latency_avg_ms,
+            (jlong)stats.connect_latency_max_ms,
+            (jlong)stats.queued,
+            (jlong)stats.queue_drops,
+            (jlong)stats.resets,
+            (jlong)stats.unreachables,
+            (jlong)stats.deferred,
+            (jlong)stats.unconnected
+    };
+    return STATS_ARRAY(env, values);
+}
 
-    // Update last active time
-    conn->last_active = get_time_ms();
+// Packets through the tun device, in the order of FilterVpnService.TunStats
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetTunStats(JNIEnv *env, jobject thiz) {
+    vpn_engine_stats_t stats;
+    vpn_engine_get_stats(&stats);
+
+    jlong values[] = {
+            (jlong)stats.packets_in,
+            (jlong)stats.bytes_in,
+            (jlong)stats.packets_out,
+            (jlong)stats.bytes_out,
+            (jlong)stats.flows
+    };
+    return STATS_ARRAY(env, values);
+}
 
-    return 0;
+// In the order of FilterVpnService.SocketPoolStats
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetSocketPoolStats(JNIEnv *env, jobject thiz) {
+    socket_pool_stats_t stats;
+    socket_pool_get_stats(&stats);
+
+    jlong values[] = {
+            (jlong)stats.ready_tcp,
+            (jlong)stats.ready_udp,
+            (jlong)stats.low_watermark,
+            (jlong)stats.high_watermark,
+            (jlong)stats.taken,
+            (jlong)stats.misses,
+            (jlong)stats.protect_failures
+    };
+    return STATS_ARRAY(env, values);
 }
 
-// Handle incoming data (from network to app)
-static int handle_incoming_data() {
-    fd_set readfds;
-    struct timeval tv;
+// In the order of FilterVpnService.DnsStats
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetDnsStats(JNIEnv *env, jobject thiz) {
+    dns_forwarder_stats_t stats;
+    dns_forwarder_get_stats(&stats);
+
+    jlong values[] = {
+            (jlong)stats.queries,
+            (jlong)stats.answers,
+            (jlong)stats.timeouts,
+            (jlong)stats.dropped,
+            (jlong)stats.rotations
+    };
+    return STATS_ARRAY(env, values);
+}
 
-    FD_ZERO(&readfds);
-    int max_fd = -1;
+// In the order of FilterVpnService.UringStats
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetUringStats(JNIEnv *env, jobject thiz) {
+    uring_io_stats_t stats;
+    uring_io_get_stats(&stats);
+
+    jlong values[] = {
+            (jlong)stats.enters,
+            (jlong)stats.received,
+            (jlong)stats.sent,
+            (jlong)stats.fallbacks,
+            (jlong)stats.no_buffers,
+            (jlong)stats.errors
+    };
+    return STATS_ARRAY(env, values);
+}
 
-    // Add all connection sockets to select set
-    pthread_mutex_lock(&conn_mutex);
-    for (int i = 0; i < num_connections; i++) {
-        if (connections[i].socket_fd > 0) {
-            FD_SET(connections[i].socket_fd, &readfds);
-            if (connections[i].socket_fd > max_fd) {
-                max_fd = connections[i].socket_fd;
-            }
-        }
-    }
-    pthread_mutex_unlock(&conn_mutex);
+// In the order of FilterVpnService.PacketPoolStats
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetPacketPoolStats(JNIEnv *env, jobject thiz) {
+    packet_pool_stats_t stats;
+    packet_pool_get_stats(&stats);
+
+    jlong values[] = {
+            (jlong)stats.buffers,
+            (jlong)stats.in_use,
+            (jlong)stats.in_use_max,
+            (jlong)stats.allocs,
+            (jlong)stats.exhausted
+    };
+    return STATS_ARRAY(env, values);
+}
 
-    if (max_fd < 0) {
-        return 0; // No connections
+// JNIEnv for the calling thread, attaching it to the VM if needed
+static JNIEnv *get_jni_env() {
+    JNIEnv *env = NULL;
+    if (java_vm == NULL) {
+        return NULL;
     }
-
-    // Set timeout to 10ms
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000;
-
-    int ready = select(max_fd + 1, &readfds, NULL, NULL, &tv);
-    if (ready <= 0) {
-        return 0; // No data or error
+    if ((*java_vm)->GetEnv(java_vm, (void **)&env, JNI_VERSION_1_6) == JNI_OK) {
+        return env;
     }
-
-    // Process readable sockets
-    pthread_mutex_lock(&conn_mutex);
-    for (int i = 0; i < num_connections; i++) {
-        if (connections[i].socket_fd > 0 && FD_ISSET(connections[i].socket_fd, &readfds)) {
-            unsigned char buffer[4096];
-            ssize_t received = recv(connections[i].socket_fd, buffer, sizeof(buffer), 0);
-
-            if (received > 0) {
-                // Update last active time
-                connections[i].last_active = get_time_ms();
-
-                // Create a response packet
-                unsigned char packet[4096];
-                size_t packet_len = 0;
-
-                // Craft IP and TCP/UDP headers (this is complex!)
-                // In reality, you need to build proper headers with checksums
-
-                // This is where you'd create a proper response packet
-                // with correct IP, TCP/UDP headers for writing to the VPN interface
-
-                // For TCP, you'd also need to update sequence numbers, etc.
-
-                // Write response packet to VPN interface
-                if (packet_len > 0) {
-                    write(vpn_fd, packet, packet_len);
-                }
-            } else if (received == 0) {
-                // Connection closed
-                close(connections[i].socket_fd);
-                connections[i].socket_fd = -1;
-            } else if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                LOGE("Recv error: %s", strerror(errno));
-                close(connections[i].socket_fd);
-                connections[i].socket_fd = -1;
-            }
-        }
+    if ((*java_vm)->AttachCurrentThread(java_vm, &env, NULL) != JNI_OK) {
+        LOGE("Failed to attach thread to the VM");
+        return NULL;
     }
-    pthread_mutex_unlock(&conn_mutex);
+    return env;
+}
 
+// Engine callback: protect a socket it had to create itself
+static int protect_socket(int fd, void *ctx) {
+    JNIEnv *env = get_jni_env();
+    if (env != NULL && vpn_service != NULL && protect_socket_method != NULL) {
+        (*env)->CallVoidMethod(env, vpn_service, protect_socket_method, fd);
+    }
     return 0;
 }
 
-// Find or create connection tracking entry
-static connection_t *find_or_create_connection(const void *packet, size_t len) {
-    const struct iphdr *ip = packet;
-    uint32_t src_ip = ntohl(ip->saddr);
-    uint32_t dst_ip = ntohl(ip->daddr);
-    uint16_t src_port = 0, dst_port = 0;
-
-    if (ip->protocol == IPPROTO_TCP) {
-        const struct tcphdr *tcp = (const struct tcphdr *)((const char *)ip + (ip->ihl * 4));
-        src_port = ntohs(tcp->source);
-        dst_port = ntohs(tcp->dest);
-    } else if (ip->protocol == IPPROTO_UDP) {
-        const struct udphdr *udp = (const struct udphdr *)((const char *)ip + (ip->ihl * 4));
-        src_port = ntohs(udp->source);
-        dst_port = ntohs(udp->dest);
-    } else {
-        return NULL; // Unsupported protocol
+// Socket pool callback: protect a batch with one call into the service.
+// protectSockets() sets entries it could not protect to -1.
+static int protect_pool_sockets(int *fds, int count, void *ctx) {
+    JNIEnv *env = get_jni_env();
+    if (env == NULL || vpn_service == NULL || protect_sockets_method == NULL) {
+        return -1;
     }
 
-    pthread_mutex_lock(&conn_mutex);
-
-    // Look for existing connection
-    for (int i = 0; i < num_connections; i++) {
-        if (connections[i].protocol == ip->protocol &&
-            connections[i].src_ip == src_ip &&
-            connections[i].src_port == src_port &&
-            connections[i].dst_ip == dst_ip &&
-            connections[i].dst_port == dst_port) {
-
-            pthread_mutex_unlock(&conn_mutex);
-            return &connections[i];
-        }
+    jintArray array = (*env)->NewIntArray(env, count);
+    if (array == NULL) {
+        (*env)->ExceptionClear(env);
+        return -1;
     }
 
-    // Create new connection if not found
-    if (num_connections < MAX_CONNECTIONS) {
-        connection_t *conn = &connections[num_connections];
-        memset(conn, 0, sizeof(connection_t));
-
-        conn->protocol = ip->protocol;
-        conn->src_ip = src_ip;
-        conn->src_port = src_port;
-        conn->dst_ip = dst_ip;
-        conn->dst_port = dst_port;
-
-        // Create socket for real network
-        int sock_type = (ip->protocol == IPPROTO_TCP) ? SOCK_STREAM : SOCK_DGRAM;
-        conn->socket_fd = socket(AF_INET, sock_type, 0);
-
-        if (conn->socket_fd < 0) {
-            LOGE("Failed to create socket: %s", strerror(errno));
-            pthread_mutex_unlock(&conn_mutex);
-            return NULL;
-        }
-
-        // Protect socket from VPN routing
-        if (vpn_service != NULL && protect_socket_method != NULL) {
-            (*jni_env)->CallVoidMethod(jni_env, vpn_service, protect_socket_method, conn->socket_fd);
-        }
-
-        // For UDP, connect is optional but simplifies sending
-        // For TCP, we must connect
-        struct sockaddr_in addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(dst_port);
-        addr.sin_addr.s_addr = htonl(dst_ip);
-
-        if (connect(conn->socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-            LOGE("Failed to connect socket: %s", strerror(errno));
-            close(conn->socket_fd);
-            pthread_mutex_unlock(&conn_mutex);
-            return NULL;
-        }
-
-        // Make socket non-blocking
-        int flags = fcntl(conn->socket_fd, F_GETFL, 0);
-        fcntl(conn->socket_fd, F_SETFL, flags | O_NONBLOCK);
+    (*env)->SetIntArrayRegion(env, array, 0, count, (const jint *)fds);
+    (*env)->CallVoidMethod(env, vpn_service, protect_sockets_method, array);
 
-        conn->last_active = get_time_ms();
-        num_connections++;
-
-        pthread_mutex_unlock(&conn_mutex);
-        return conn;
+    int result = 0;
+    if ((*env)->ExceptionCheck(env)) {
+        (*env)->ExceptionClear(env);
+        result = -1;
+    } else {
+        (*env)->GetIntArrayRegion(env, array, 0, count, (jint *)fds);
     }
-
-    pthread_mutex_unlock(&conn_mutex);
-    return NULL; // Too many connections
+    (*env)->DeleteLocalRef(env, array);
+    return result;
 }
 
-// Cleanup inactive connections
-static void cleanup_connections() {
-    pthread_mutex_lock(&conn_mutex);
-
-    uint64_t now = get_time_ms();
-    uint64_t timeout = 60000; // 60 seconds timeout
-
-    for (int i = 0; i < num_connections; i++) {
-        if (connections[i].socket_fd > 0 && now - connections[i].last_active > timeout) {
-            LOGI("Cleaning up inactive connection");
-            close(connections[i].socket_fd);
-            connections[i].socket_fd = -1;
-        }
-    }
-
-    // Compact the connections array by removing closed connections
-    int j = 0;
-    for (int i = 0; i < num_connections; i++) {
-        if (connections[i].socket_fd > 0) {
-            if (i != j) {
-                memcpy(&connections[j], &connections[i], sizeof(connection_t));
-            }
-            j++;
-        }
+static void detach_pool_thread(void *ctx) {
+    if (java_vm != NULL) {
+        (*java_vm)->DetachCurrentThread(java_vm);
     }
-    num_connections = j;
-
-    pthread_mutex_unlock(&conn_mutex);
-}
-
-// Get current time in milliseconds
-static uint64_t get_time_ms() {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000ULL);
 }
 
 // JNI functions for filter manager
 JNIEXPORT void JNICALL
 Java_com_example_domainfilter_util_FilterManager_jniInitFilter(JNIEnv *env, jobject thiz) {
     filter_init();
+    ipset_clear();
+}
+
+// Drop all rules and start over with another matcher backend
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniInitFilterBackend(JNIEnv *env, jobject thiz, jint backend) {
+    int result = filter_init_backend(backend);
+    ipset_clear();
+    return result;
 }
 
 JNIEXPORT void JNICALL
@@ -475,4 +350,233 @@ Java_com_example_domainfilter_util_FilterManager_jniCheckDomain(JNIEnv *env, job
         (*env)->ReleaseStringUTFChars(env, domain, domain_str);
     }
     return result;
-}
\ No newline at end of file
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniGetFilterStats(JNIEnv *env, jobject thiz) {
+    filter_stats_t stats;
+    filter_get_stats(&stats);
+
+    // Order must match FilterManager.FilterStats
+    jlong values[] = {
+            (jlong)stats.nodes,
+            (jlong)stats.node_capacity,
+            (jlong)stats.bytes_used,
+            (jlong)stats.bytes_reserved,
+            (jlong)stats.bytes_shared,
+            (jlong)stats.chunks,
+            (jlong)stats.fragmentation,
+            (jlong)stats.regex_rules,
+            (jlong)stats.regex_cache_bytes,
+            (jlong)stats.regex_cache_flushes,
+            (jlong)stats.backend
+    };
+
+    jlongArray result = (*env)->NewLongArray(env, sizeof(values) / sizeof(values[0]));
+    if (result != NULL) {
+        (*env)->SetLongArrayRegion(env, result, 0, sizeof(values) / sizeof(values[0]), values);
+    }
+    return result;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniGetListStats(JNIEnv *env, jobject thiz, jint category) {
+    filter_list_stats_t stats;
+    if (filter_get_list_stats((uint8_t)category, &stats) < 0) {
+        return NULL;
+    }
+
+    // Order must match FilterManager.ListStats
+    jlong values[] = {
+            (jlong)stats.rules,
+            (jlong)stats.added,
+            (jlong)stats.duplicates,
+            (jlong)stats.redundant,
+            (jlong)stats.unsupported
+    };
+
+    jlongArray result = (*env)->NewLongArray(env, sizeof(values) / sizeof(values[0]));
+    if (result != NULL) {
+        (*env)->SetLongArrayRegion(env, result, 0, sizeof(values) / sizeof(values[0]), values);
+    }
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniUseBuiltinFilters(JNIEnv *env, jobject thiz, jint categories) {
+    int count = filter_use_builtin((uint8_t)categories);
+    ipset_clear();
+    LOGI("Activated %d built-in rules (categories 0x%02x)", count, categories);
+    return count;
+}
+
+// Load rules from a direct ByteBuffer without copying it
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniLoadFilterBuffer(JNIEnv *env, jobject thiz, jobject buffer, jint length) {
+    const char *data = (*env)->GetDirectBufferAddress(env, buffer);
+    jlong capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+
+    if (data == NULL || length < 0 || length > capacity) {
+        LOGE("Filter buffer is not a direct buffer or too short");
+        return -1;
+    }
+
+    return filter_load_buffer(data, (size_t)length);
+}
+
+// Load rules from an APK asset. Uncompressed assets are mapped straight
+// from the APK; compressed ones are inflated once by the asset manager.
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniLoadFilterAsset(JNIEnv *env, jobject thiz, jobject assetManager, jstring path, jint category) {
+    AAssetManager *manager = AAssetManager_fromJava(env, assetManager);
+    const char *asset_path = (*env)->GetStringUTFChars(env, path, NULL);
+    if (manager == NULL || asset_path == NULL) {
+        if (asset_path != NULL) {
+            (*env)->ReleaseStringUTFChars(env, path, asset_path);
+        }
+        return -1;
+    }
+
+    int count = -1;
+    AAsset *asset = AAssetManager_open(manager, asset_path, AASSET_MODE_BUFFER);
+    if (asset != NULL) {
+        const char *data = AAsset_getBuffer(asset);
+        off_t length = AAsset_getLength(asset);
+        if (data != NULL) {
+            count = filter_load_list_buffer(data, (size_t)length, (uint8_t)category);
+        }
+        AAsset_close(asset);
+    }
+
+    if (count < 0) {
+        LOGE("Failed to load filter asset: %s", asset_path);
+    }
+    (*env)->ReleaseStringUTFChars(env, path, asset_path);
+    return count;
+}
+
+// Strings copied out of a Java array per round, and the longest name taken
+#define JNI_BATCH 64
+#define JNI_DOMAIN_MAX 256
+
+// Copy up to JNI_BATCH strings starting at index into names/lengths without
+// pinning or allocating per element. Strings that do not fit are left empty.
+static jsize copy_domain_batch(JNIEnv *env, jobjectArray domains, jsize index, jsize total,
+                               char names[][JNI_DOMAIN_MAX], size_t *lengths) {
+    jsize n = total - index < JNI_BATCH ? total - index : JNI_BATCH;
+
+    for (jsize i = 0; i < n; i++) {
+        jstring domain = (jstring)(*env)->GetObjectArrayElement(env, domains, index + i);
+        lengths[i] = 0;
+        names[i][0] = '\0';
+
+        if (domain != NULL) {
+            jsize utf_len = (*env)->GetStringUTFLength(env, domain);
+            if (utf_len > 0 && utf_len < JNI_DOMAIN_MAX) {
+                (*env)->GetStringUTFRegion(env, domain, 0, (*env)->GetStringLength(env, domain), names[i]);
+                names[i][utf_len] = '\0';
+                lengths[i] = (size_t)utf_len;
+            }
+            (*env)->DeleteLocalRef(env, domain);
+        }
+    }
+
+    return n;
+}
+
+// Add every name in one update: the array is collected into one
+// newline-separated buffer and committed like jniAddDomainsBuffer, so a
+// large array is never left half applied
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniAddDomains(JNIEnv *env, jobject thiz, jobjectArray domains) {
+    jsize total = (*env)->GetArrayLength(env, domains);
+    size_t capacity = 4096;
+    size_t len = 0;
+    char *data = malloc(capacity);
+    if (data == NULL) {
+        LOGE("Out of memory collecting domains");
+        return 0;
+    }
+
+    for (jsize i = 0; i < total; i++) {
+        jstring domain = (jstring)(*env)->GetObjectArrayElement(env, domains, i);
+        if (domain == NULL) {
+            continue;
+        }
+
+        // Names too long to be a domain, or with line breaks, are skipped
+        jsize utf_len = (*env)->GetStringUTFLength(env, domain);
+        if (utf_len > 0 && utf_len < JNI_DOMAIN_MAX) {
+            if (len + (size_t)utf_len + 1 > capacity) {
+                char *grown = realloc(data, capacity * 2);
+                if (grown == NULL) {
+                    LOGE("Out of memory collecting domains");
+                    (*env)->DeleteLocalRef(env, domain);
+                    free(data);
+                    return 0;
+                }
+                data = grown;
+                capacity *= 2;
+            }
+            (*env)->GetStringUTFRegion(env, domain, 0, (*env)->GetStringLength(env, domain), data + len);
+            if (memchr(data + len, '\n', (size_t)utf_len) == NULL) {
+                len += (size_t)utf_len;
+                data[len++] = '\n';
+            }
+        }
+        (*env)->DeleteLocalRef(env, domain);
+    }
+
+    int count = filter_add_domains_packed(data, len);
+    free(data);
+    return count;
+}
+
+// Add newline-separated domains straight from a direct ByteBuffer
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniAddDomainsBuffer(JNIEnv *env, jobject thiz, jobject buffer, jint length) {
+    const char *data = (*env)->GetDirectBufferAddress(env, buffer);
+    jlong capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+    if (data == NULL || length < 0 || length > capacity) {
+        LOGE("Invalid domain buffer");
+        return -1;
+    }
+    return filter_add_domains_packed(data, (size_t)length);
+}
+
+// Check many domains in one call. The result is a bitset: bit i of byte
+// i / 8 is set if domains[i] is blocked.
+JNIEXPORT jbyteArray JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniCheckDomains(JNIEnv *env, jobject thiz, jobjectArray domains) {
+    char names[JNI_BATCH][JNI_DOMAIN_MAX];
+    const char *ptrs[JNI_BATCH];
+    size_t lengths[JNI_BATCH];
+    uint8_t blocked[JNI_BATCH];
+    jsize total = (*env)->GetArrayLength(env, domains);
+    jsize bytes = (total + 7) / 8;
+
+    jbyteArray result = (*env)->NewByteArray(env, bytes);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    for (jsize i = 0; i < JNI_BATCH; i++) {
+        ptrs[i] = names[i];
+    }
+
+    // JNI_BATCH is a multiple of 8, so every batch fills whole bytes
+    jbyte bits[JNI_BATCH / 8];
+    for (jsize index = 0; index < total;) {
+        jsize n = copy_domain_batch(env, domains, index, total, names, lengths);
+        filter_check_domains(ptrs, (size_t)n, blocked);
+
+        memset(bits, 0, sizeof(bits));
+        for (jsize i = 0; i < n; i++) {
+            bits[i >> 3] |= (jbyte)(blocked[i] << (i & 7));
+        }
+        (*env)->SetByteArrayRegion(env, result, index / 8, (n + 7) / 8, bits);
+        index += n;
+    }
+
+    return result;
+}
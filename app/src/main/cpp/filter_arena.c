@@ -0,0 +1,255 @@
+// filter_arena.c
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "include/filter_arena.h"
+
+#define TAG "FilterArena"
+#include "include/native_log.h"
+
+#define CHUNK_BYTES (ARENA_CHUNK_NODES * sizeof(filter_node_t))
+#define MAX_CHUNKS  (1u << (32 - ARENA_CHUNK_SHIFT))
+
+// Map a fresh zeroed chunk. Pages are only committed once nodes are written.
+static filter_node_t *map_chunk() {
+    void *chunk = mmap(NULL, CHUNK_BYTES, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+        return NULL;
+    }
+    return (filter_node_t *)chunk;
+}
+
+// Initialize an empty arena
+int arena_init(filter_arena_t *arena) {
+    memset(arena, 0, sizeof(*arena));
+    return 0;
+}
+
+// Release every chunk at once. No per-node work is done.
+void arena_destroy(filter_arena_t *arena) {
+    if (!arena->readonly) {
+        for (uint32_t i = 0; i < arena->num_chunks; i++) {
+            munmap(arena->chunks[i], CHUNK_BYTES);
+        }
+        free(arena->chunks);
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+// Use prebuilt nodes in place
+void arena_attach_readonly(filter_arena_t *arena, const filter_node_t *const *chunks,
+                           uint32_t num_chunks, uint32_t num_nodes) {
+    memset(arena, 0, sizeof(*arena));
+    arena->chunks = (filter_node_t **)chunks;
+    arena->num_chunks = num_chunks;
+    arena->max_chunks = num_chunks;
+    arena->used = num_nodes;
+    arena->readonly = 1;
+}
+
+// Copy prebuilt nodes into arena chunks so they can be modified
+int arena_make_writable(filter_arena_t *arena) {
+    if (!arena->readonly) {
+        return 0;
+    }
+
+    uint32_t max_chunks = arena->num_chunks > 8 ? arena->num_chunks * 2 : 16;
+    filter_node_t **chunks = calloc(max_chunks, sizeof(*chunks));
+    if (chunks == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < arena->num_chunks; i++) {
+        chunks[i] = map_chunk();
+        if (chunks[i] == NULL) {
+            for (uint32_t j = 0; j < i; j++) {
+                munmap(chunks[j], CHUNK_BYTES);
+            }
+            free(chunks);
+            LOGE("Failed to map arena chunk");
+            return -1;
+        }
+
+        // The last chunk is only partially filled
+        uint32_t nodes = ARENA_CHUNK_NODES;
+        if (i == arena->num_chunks - 1 && (arena->used & ARENA_CHUNK_MASK) != 0) {
+            nodes = arena->used & ARENA_CHUNK_MASK;
+        }
+        memcpy(chunks[i], arena->chunks[i], nodes * sizeof(filter_node_t));
+    }
+
+    arena->chunks = chunks;
+    arena->max_chunks = max_chunks;
+    arena->readonly = 0;
+    return 0;
+}
+
+// Allocate a zeroed node and return its index
+uint32_t arena_alloc(filter_arena_t *arena) {
+    if (arena->readonly && arena_make_writable(arena) < 0) {
+        return ARENA_NODE_INVALID;
+    }
+
+    uint32_t index = arena->used;
+
+    // Current chunk is full, map another one
+    if ((index >> ARENA_CHUNK_SHIFT) >= arena->num_chunks) {
+        if (arena->num_chunks >= MAX_CHUNKS - 1) {
+            LOGE("Arena exhausted at %u nodes", index);
+            return ARENA_NODE_INVALID;
+        }
+
+        if (arena->num_chunks == arena->max_chunks) {
+            uint32_t new_max = arena->max_chunks ? arena->max_chunks * 2 : 16;
+            filter_node_t **chunks = realloc(arena->chunks, new_max * sizeof(*chunks));
+            if (chunks == NULL) {
+                LOGE("Failed to grow arena chunk table");
+                return ARENA_NODE_INVALID;
+            }
+            arena->chunks = chunks;
+            arena->max_chunks = new_max;
+        }
+
+        filter_node_t *chunk = map_chunk();
+        if (chunk == NULL) {
+            LOGE("Failed to map arena chunk");
+            return ARENA_NODE_INVALID;
+        }
+        arena->chunks[arena->num_chunks++] = chunk;
+    }
+
+    arena->used++;
+    return index;
+}
+
+// Report arena usage. Fragmentation is the share of reserved node slots
+// that hold no node (tail of the last chunk plus unused chunk table slots).
+void arena_get_stats(const filter_arena_t *arena, filter_arena_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    stats->chunks = arena->num_chunks;
+    stats->nodes_used = arena->used;
+    stats->nodes_capacity = (uint64_t)arena->num_chunks * ARENA_CHUNK_NODES;
+    stats->bytes_used = stats->nodes_used * sizeof(filter_node_t);
+
+    // A prebuilt image lives in the library mapping and reserves nothing
+    if (arena->readonly) {
+        stats->bytes_shared = stats->bytes_used;
+        return;
+    }
+
+    stats->bytes_reserved = (uint64_t)arena->num_chunks * CHUNK_BYTES +
+                            (uint64_t)arena->max_chunks * sizeof(filter_node_t *);
+
+    if (stats->bytes_reserved > 0) {
+        stats->fragmentation = (uint32_t)(
+                (stats->bytes_reserved - stats->bytes_used) * 1000 / stats->bytes_reserved);
+    }
+}
+
+// Slot of node in a split table, or the free slot where it would go
+static filter_split_t *split_slot(filter_split_t *entries, uint32_t capacity, uint32_t node) {
+    uint32_t mask = capacity - 1;
+    uint32_t index = (node * 2654435761u) & mask;
+    while (entries[index].node != node && entries[index].node != ARENA_NODE_NONE) {
+        index = (index + 1) & mask;
+    }
+    return &entries[index];
+}
+
+// Rehash into a table of the given capacity
+static int splits_resize(filter_splits_t *splits, uint32_t capacity) {
+    filter_split_t *entries = calloc(capacity, sizeof(*entries));
+    if (entries == NULL) {
+        LOGE("Failed to grow split table");
+        return -1;
+    }
+
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < splits->capacity; i++) {
+        if (splits->entries[i].node != ARENA_NODE_NONE) {
+            *split_slot(entries, capacity, splits->entries[i].node) = splits->entries[i];
+            used++;
+        }
+    }
+
+    if (!splits->readonly) {
+        free(splits->entries);
+    }
+    splits->entries = entries;
+    splits->capacity = capacity;
+    splits->used = used;
+    splits->readonly = 0;
+    return 0;
+}
+
+void splits_destroy(filter_splits_t *splits) {
+    if (!splits->readonly) {
+        free(splits->entries);
+    }
+    memset(splits, 0, sizeof(*splits));
+}
+
+// Use a prebuilt table in place
+void splits_attach_readonly(filter_splits_t *splits, const filter_split_t *entries, uint32_t capacity) {
+    memset(splits, 0, sizeof(*splits));
+    splits->entries = (filter_split_t *)entries;
+    splits->capacity = capacity;
+    splits->readonly = 1;
+    for (uint32_t i = 0; i < capacity; i++) {
+        splits->used += entries[i].node != ARENA_NODE_NONE;
+    }
+}
+
+// Copy a prebuilt table so it can be modified
+int splits_make_writable(filter_splits_t *splits) {
+    if (!splits->readonly) {
+        return 0;
+    }
+    if (splits->capacity == 0) {
+        splits->readonly = 0;
+        return 0;
+    }
+    return splits_resize(splits, splits->capacity);
+}
+
+const uint8_t *splits_find(const filter_splits_t *splits, uint32_t node) {
+    if (splits->capacity == 0) {
+        return NULL;
+    }
+    const filter_split_t *entry = split_slot(splits->entries, splits->capacity, node);
+    return entry->node == node ? entry->flags : NULL;
+}
+
+int splits_set(filter_splits_t *splits, uint32_t node, const uint8_t *flags) {
+    if (splits->readonly && splits_make_writable(splits) < 0) {
+        return -1;
+    }
+
+    // Keep the table at most half full
+    if ((splits->used + 1) * 2 > splits->capacity &&
+        splits_resize(splits, splits->capacity ? splits->capacity * 2 : 64) < 0) {
+        return -1;
+    }
+
+    filter_split_t *entry = split_slot(splits->entries, splits->capacity, node);
+    if (entry->node == ARENA_NODE_NONE) {
+        entry->node = node;
+        splits->used++;
+    }
+    memcpy(entry->flags, flags, sizeof(entry->flags));
+    return 0;
+}
+
+void splits_node_flags(const filter_splits_t *splits, const filter_node_t *node, uint32_t index,
+                       uint8_t *flags) {
+    const uint8_t *split = (node->flags & FILTER_NODE_SPLIT) ? splits_find(splits, index) : NULL;
+    for (int i = 0; i < FILTER_CATEGORY_BITS; i++) {
+        if (split != NULL) {
+            flags[i] = split[i];
+        } else {
+            flags[i] = (node->categories & (1u << i)) ? node->flags : 0;
+        }
+    }
+}
@@ -0,0 +1,106 @@
+// filter_batch.c
+#include <stdlib.h>
+#include <string.h>
+#include "include/filter_batch.h"
+#include "include/filter_rules.h"
+
+#define BATCH_INITIAL_RULES 1024
+#define BATCH_INITIAL_NAMES (BATCH_INITIAL_RULES * 16)
+
+void filter_batch_init(filter_batch_t *batch) {
+    memset(batch, 0, sizeof(*batch));
+}
+
+void filter_batch_destroy(filter_batch_t *batch) {
+    free(batch->names);
+    free(batch->rules);
+    memset(batch, 0, sizeof(*batch));
+}
+
+int filter_batch_add(filter_batch_t *batch, const char *reversed, size_t len, uint8_t flags) {
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : BATCH_INITIAL_RULES;
+        filter_batch_rule_t *rules = realloc(batch->rules, capacity * sizeof(filter_batch_rule_t));
+        if (rules == NULL) {
+            return -1;
+        }
+        batch->rules = rules;
+        batch->capacity = capacity;
+    }
+
+    if (batch->names_len + len > batch->names_capacity) {
+        size_t capacity = batch->names_capacity ? batch->names_capacity * 2 : BATCH_INITIAL_NAMES;
+        while (capacity < batch->names_len + len) {
+            capacity *= 2;
+        }
+        char *names = realloc(batch->names, capacity);
+        if (names == NULL) {
+            return -1;
+        }
+        batch->names = names;
+        batch->names_capacity = capacity;
+    }
+
+    filter_batch_rule_t *rule = &batch->rules[batch->count++];
+    memcpy(batch->names + batch->names_len, reversed, len);
+    rule->offset = (uint32_t)batch->names_len;
+    rule->len = (uint16_t)len;
+    rule->flags = flags;
+    rule->reversed = NULL;
+    batch->names_len += len;
+    return 0;
+}
+
+static int compare_rules(const void *a, const void *b) {
+    const filter_batch_rule_t *x = a;
+    const filter_batch_rule_t *y = b;
+    size_t len = x->len < y->len ? x->len : y->len;
+    int result = memcmp(x->reversed, y->reversed, len);
+    if (result != 0) {
+        return result;
+    }
+    return (int)x->len - (int)y->len;
+}
+
+int filter_actions_covered(uint8_t covered, uint8_t actions) {
+    actions &= FILTER_ACTION_MASK;
+    if (actions == 0) {
+        return 1;
+    }
+
+    // Bits at or above the highest priority action of the rule
+    uint8_t highest = actions & FILTER_ACTION_IMPORTANT ? FILTER_ACTION_IMPORTANT
+                    : actions & FILTER_ACTION_ALLOW ? FILTER_ACTION_ALLOW : FILTER_ACTION_BLOCK;
+    return (covered & FILTER_ACTION_MASK & ~(highest - 1)) != 0;
+}
+
+size_t filter_batch_sort(filter_batch_t *batch) {
+    // The name buffer no longer moves
+    for (size_t i = 0; i < batch->count; i++) {
+        batch->rules[i].reversed = batch->names + batch->rules[i].offset;
+    }
+    qsort(batch->rules, batch->count, sizeof(filter_batch_rule_t), compare_rules);
+
+    size_t out = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        filter_batch_rule_t *rule = &batch->rules[i];
+        if (out > 0 && compare_rules(&batch->rules[out - 1], rule) == 0) {
+            batch->rules[out - 1].flags |= rule->flags;
+        } else {
+            batch->rules[out++] = *rule;
+        }
+    }
+    size_t merged = batch->count - out;
+    batch->count = out;
+
+    // example.com also covers *.example.com
+    for (size_t i = 0; i < batch->count; i++) {
+        filter_batch_rule_t *rule = &batch->rules[i];
+        uint8_t subdomains = rule->flags >> FILTER_NODE_SUBDOMAIN_SHIFT;
+        if (subdomains != 0 && filter_actions_covered(rule->flags, subdomains)) {
+            rule->flags &= FILTER_ACTION_MASK;
+        }
+    }
+
+    return merged;
+}
@@ -0,0 +1,13 @@
+// filter_builtin.c
+#include "include/domainfilter.h"
+#include "include/filter_builtin.h"
+
+// Activate the default lists compiled into the library. Only the selected
+// categories are enforced, user rules always are.
+int filter_use_builtin(uint8_t categories) {
+    int rules = filter_attach_builtin(&filter_builtin);
+    if (rules >= 0) {
+        filter_set_categories(categories | FILTER_CATEGORY_CUSTOM);
+    }
+    return rules;
+}
@@ -0,0 +1,201 @@
+// filter_hash.c
+#include <stdlib.h>
+#include <string.h>
+#include "include/filter_backend.h"
+#include "include/filter_rules.h"
+
+#define TAG "FilterHash"
+#include "include/native_log.h"
+
+// Each rule is stored as a 64-bit hash of its reversed domain. The hash is
+// built one character at a time, so a lookup hashes the query once and
+// probes the table at every label boundary: one probe per label, however
+// long the rules are. Distinct names colliding on all 64 bits is treated as
+// impossible.
+#define HASH_BUCKET_ENTRIES  4          // 16-byte entries per cache line
+#define HASH_INITIAL_BUCKETS 256
+#define FNV_OFFSET           0xcbf29ce484222325ull
+#define FNV_PRIME            0x100000001b3ull
+
+typedef struct {
+    uint64_t key;           // Finalized hash, 0 if the slot is empty
+    uint8_t flags[FILTER_CATEGORY_BITS]; // FILTER_NODE_* actions per category bit
+} hash_entry_t;
+
+typedef struct {
+    _Alignas(64) hash_entry_t entries[HASH_BUCKET_ENTRIES];
+} hash_bucket_t;
+
+static hash_bucket_t *hash_buckets;
+static size_t hash_num_buckets;     // Power of two
+static size_t hash_used;
+
+static inline uint64_t hash_step(uint64_t h, unsigned char c) {
+    return (h ^ c) * FNV_PRIME;
+}
+
+// Mix the running hash into a table key. 0 marks empty slots.
+static inline uint64_t hash_key(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+// Find the slot holding key, or the empty slot where it would go
+static hash_entry_t *find_slot(hash_bucket_t *buckets, size_t num_buckets, uint64_t key) {
+    size_t mask = num_buckets - 1;
+    size_t index = (size_t)(key >> 7) & mask;
+
+    for (;;) {
+        hash_bucket_t *bucket = &buckets[index];
+        for (int i = 0; i < HASH_BUCKET_ENTRIES; i++) {
+            if (bucket->entries[i].key == key || bucket->entries[i].key == 0) {
+                return &bucket->entries[i];
+            }
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static hash_bucket_t *alloc_buckets(size_t count) {
+    void *memory = NULL;
+    if (posix_memalign(&memory, sizeof(hash_bucket_t), count * sizeof(hash_bucket_t)) != 0) {
+        return NULL;
+    }
+    memset(memory, 0, count * sizeof(hash_bucket_t));
+    return memory;
+}
+
+// Double the table once it is two thirds full
+static int grow() {
+    size_t num_buckets = hash_num_buckets * 2;
+    hash_bucket_t *buckets = alloc_buckets(num_buckets);
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    for (size_t b = 0; b < hash_num_buckets; b++) {
+        for (int i = 0; i < HASH_BUCKET_ENTRIES; i++) {
+            const hash_entry_t *entry = &hash_buckets[b].entries[i];
+            if (entry->key != 0) {
+                *find_slot(buckets, num_buckets, entry->key) = *entry;
+            }
+        }
+    }
+
+    free(hash_buckets);
+    hash_buckets = buckets;
+    hash_num_buckets = num_buckets;
+    return 0;
+}
+
+static int hash_init() {
+    hash_buckets = alloc_buckets(HASH_INITIAL_BUCKETS);
+    if (hash_buckets == NULL) {
+        return -1;
+    }
+    hash_num_buckets = HASH_INITIAL_BUCKETS;
+    hash_used = 0;
+    return 0;
+}
+
+static void hash_destroy() {
+    free(hash_buckets);
+    hash_buckets = NULL;
+    hash_num_buckets = 0;
+    hash_used = 0;
+}
+
+static int hash_prepare() {
+    return 0;
+}
+
+static int hash_add(const char *reversed, size_t len, uint8_t flags, uint8_t category) {
+    if ((hash_used + 1) * 3 > hash_num_buckets * HASH_BUCKET_ENTRIES * 2 && grow() < 0) {
+        return -1;
+    }
+
+    uint64_t h = FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        h = hash_step(h, (unsigned char)reversed[i]);
+    }
+
+    uint64_t key = hash_key(h);
+    hash_entry_t *entry = find_slot(hash_buckets, hash_num_buckets, key);
+    if (entry->key == 0) {
+        entry->key = key;
+        hash_used++;
+    }
+
+    // Rules for the same domain accumulate per list, the lookup merges the
+    // enabled lists and picks by priority
+    for (int i = 0; i < FILTER_CATEGORY_BITS; i++) {
+        if (category & (1u << i)) {
+            entry->flags[i] |= flags;
+        }
+    }
+    return 0;
+}
+
+// Probe one name. more_labels is set when the query continues below it,
+// which is when subdomain-only rules apply.
+static uint8_t probe(uint64_t h, uint8_t categories, int more_labels) {
+    const hash_entry_t *entry = find_slot(hash_buckets, hash_num_buckets, hash_key(h));
+    if (entry->key == 0) {
+        return 0;
+    }
+
+    uint8_t flags = filter_category_flags(entry->flags, categories);
+    uint8_t actions = flags & FILTER_ACTION_MASK;
+    if (more_labels) {
+        actions |= (flags >> FILTER_NODE_SUBDOMAIN_SHIFT) & FILTER_ACTION_MASK;
+    }
+    return actions;
+}
+
+static uint8_t hash_lookup(const char *reversed, size_t len, uint8_t categories) {
+    uint8_t actions = 0;
+    uint64_t h = FNV_OFFSET;
+
+    for (size_t i = 0; i < len; i++) {
+        if (reversed[i] == '.') {
+            actions |= probe(h, categories, 1);
+        }
+        h = hash_step(h, (unsigned char)reversed[i]);
+    }
+
+    return actions | probe(h, categories, 0);
+}
+
+static int hash_is_empty() {
+    return hash_used == 0;
+}
+
+static void hash_get_stats(filter_backend_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    stats->entries = hash_used;
+    stats->capacity = (uint64_t)hash_num_buckets * HASH_BUCKET_ENTRIES;
+    stats->bytes_used = hash_used * sizeof(hash_entry_t);
+    stats->bytes_reserved = hash_num_buckets * sizeof(hash_bucket_t);
+    stats->chunks = hash_buckets != NULL;
+    if (stats->bytes_reserved > 0) {
+        stats->fragmentation = (uint32_t)(
+                (stats->bytes_reserved - stats->bytes_used) * 1000 / stats->bytes_reserved);
+    }
+}
+
+const filter_backend_t filter_backend_hash = {
+        .name = "hash",
+        .init = hash_init,
+        .destroy = hash_destroy,
+        .prepare = hash_prepare,
+        .add = hash_add,
+        .lookup = hash_lookup,
+        .lookup_batch = NULL,
+        .is_empty = hash_is_empty,
+        .get_stats = hash_get_stats,
+        .attach = NULL,
+        .serialize = NULL,
+};
@@ -0,0 +1,354 @@
+// filter_ipset.c
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "include/filter_ipset.h"
+#include "include/domainfilter.h"
+
+#define TAG "FilterIpSet"
+#include "include/native_log.h"
+
+#define DNS_TYPE_A     1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_AAAA  28
+#define DNS_CLASS_IN   1
+#define DNS_MAX_JUMPS  16
+
+// One slot. seq is odd while a writer updates it (per-entry seqlock), so
+// readers never block and simply retry or treat a torn entry as a miss.
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t expires;   // Monotonic seconds, 0 if the slot is empty
+    _Atomic uint32_t addr[4];
+    _Atomic uint32_t categories;    // FILTER_CATEGORY_* that blocked the address
+    uint32_t reserved;
+} ipset_entry_t;
+
+typedef struct {
+    _Alignas(64) ipset_entry_t entries[IPSET_WAYS];
+} ipset_bucket_t;
+
+static ipset_bucket_t ipset_table[IPSET_BUCKETS];
+
+// Coarse monotonic clock, good enough for DNS TTLs
+static uint32_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec + 1;
+}
+
+static ipset_bucket_t *bucket_for(const uint32_t words[4]) {
+    uint32_t h = words[0] * 0x9e3779b1u ^ words[1] * 0x85ebca77u ^
+                 words[2] * 0xc2b2ae3du ^ words[3];
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return &ipset_table[h & (IPSET_BUCKETS - 1)];
+}
+
+// Forget every learned address
+void ipset_clear() {
+    for (size_t i = 0; i < IPSET_BUCKETS; i++) {
+        for (int w = 0; w < IPSET_WAYS; w++) {
+            atomic_store_explicit(&ipset_table[i].entries[w].expires, 0, memory_order_release);
+        }
+    }
+}
+
+// Take the seqlock of an entry for writing. Returns 0 if another writer
+// holds it.
+static int begin_write(ipset_entry_t *entry, uint32_t *seq) {
+    *seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+    if ((*seq & 1) || !atomic_compare_exchange_strong_explicit(&entry->seq, seq, *seq + 1,
+                                                              memory_order_acquire,
+                                                              memory_order_relaxed)) {
+        return 0;
+    }
+    atomic_thread_fence(memory_order_release);
+    return 1;
+}
+
+static int same_address(ipset_entry_t *entry, const uint32_t words[4]) {
+    int same = 1;
+    for (int i = 0; i < 4; i++) {
+        same &= atomic_load_explicit(&entry->addr[i], memory_order_relaxed) == words[i];
+    }
+    return same;
+}
+
+// Insert or refresh an address. A writer that loses the race for a slot
+// drops the update; the next answer for the name will learn it again.
+void ipset_add(const uint8_t addr[16], uint32_t ttl, uint8_t categories) {
+    uint32_t words[4];
+    memcpy(words, addr, sizeof(words));
+
+    if (ttl < IPSET_MIN_TTL) {
+        ttl = IPSET_MIN_TTL;
+    } else if (ttl > IPSET_MAX_TTL) {
+        ttl = IPSET_MAX_TTL;
+    }
+
+    uint32_t now = now_seconds();
+    ipset_bucket_t *bucket = bucket_for(words);
+    ipset_entry_t *victim = NULL;
+    uint32_t victim_expires = UINT32_MAX;
+    uint32_t merged = categories;
+
+    // Reuse the slot holding this address, else an empty or expired one,
+    // else the one closest to expiry
+    for (int w = 0; w < IPSET_WAYS; w++) {
+        ipset_entry_t *entry = &bucket->entries[w];
+        uint32_t expires = atomic_load_explicit(&entry->expires, memory_order_relaxed);
+
+        if (same_address(entry, words) && expires != 0) {
+            victim = entry;
+            if (expires > now) {
+                merged |= atomic_load_explicit(&entry->categories, memory_order_relaxed);
+            }
+            break;
+        }
+        if (expires <= now) {
+            expires = 0;
+        }
+        if (expires < victim_expires) {
+            victim = entry;
+            victim_expires = expires;
+        }
+    }
+
+    uint32_t seq;
+    if (!begin_write(victim, &seq)) {
+        return;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        atomic_store_explicit(&victim->addr[i], words[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&victim->categories, merged, memory_order_relaxed);
+    atomic_store_explicit(&victim->expires, now + ttl, memory_order_relaxed);
+    atomic_store_explicit(&victim->seq, seq + 2, memory_order_release);
+}
+
+// Forget an address, if it was learned
+void ipset_remove(const uint8_t addr[16]) {
+    uint32_t words[4];
+    memcpy(words, addr, sizeof(words));
+
+    ipset_bucket_t *bucket = bucket_for(words);
+    for (int w = 0; w < IPSET_WAYS; w++) {
+        ipset_entry_t *entry = &bucket->entries[w];
+        if (atomic_load_explicit(&entry->expires, memory_order_relaxed) == 0 || !same_address(entry, words)) {
+            continue;
+        }
+
+        uint32_t seq;
+        if (begin_write(entry, &seq)) {
+            atomic_store_explicit(&entry->expires, 0, memory_order_relaxed);
+            atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+        }
+    }
+}
+
+// Probe the address's bucket. An entry being rewritten counts as a miss.
+uint8_t ipset_contains(const uint8_t addr[16]) {
+    uint32_t words[4];
+    memcpy(words, addr, sizeof(words));
+
+    ipset_bucket_t *bucket = bucket_for(words);
+    uint32_t now = 0;
+
+    for (int w = 0; w < IPSET_WAYS; w++) {
+        ipset_entry_t *entry = &bucket->entries[w];
+        uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+        uint32_t expires = atomic_load_explicit(&entry->expires, memory_order_relaxed);
+        if ((seq & 1) || expires == 0) {
+            continue;
+        }
+
+        int same = same_address(entry, words);
+        uint32_t categories = atomic_load_explicit(&entry->categories, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (!same || atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+
+        if (now == 0) {
+            now = now_seconds();
+        }
+        if (expires > now) {
+            return (uint8_t)categories;
+        }
+    }
+
+    return 0;
+}
+
+uint8_t ipset_contains_v4(uint32_t addr) {
+    uint8_t mapped[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    memcpy(mapped + 12, &addr, 4);
+    return ipset_contains(mapped);
+}
+
+// Number of live entries, for diagnostics
+uint32_t ipset_count() {
+    uint32_t now = now_seconds();
+    uint32_t count = 0;
+    for (size_t i = 0; i < IPSET_BUCKETS; i++) {
+        for (int w = 0; w < IPSET_WAYS; w++) {
+            if (atomic_load_explicit(&ipset_table[i].entries[w].expires, memory_order_relaxed) > now) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+static uint16_t read16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t read32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Decode a possibly compressed name at pos into out (lowercase, dotted).
+// Returns the offset just past the name in place, or -1 if malformed.
+static long read_name(const uint8_t *dns, size_t len, size_t pos, char *out, size_t out_size) {
+    size_t out_pos = 0;
+    long next = -1;
+    int jumps = 0;
+
+    while (pos < len) {
+        uint8_t label_len = dns[pos];
+
+        if (label_len == 0) {
+            if (next < 0) {
+                next = (long)pos + 1;
+            }
+            out[out_pos] = '\0';
+            return next;
+        }
+
+        if ((label_len & 0xC0) == 0xC0) {
+            if (pos + 1 >= len || ++jumps > DNS_MAX_JUMPS) {
+                return -1;
+            }
+            if (next < 0) {
+                next = (long)pos + 2;
+            }
+            pos = ((label_len & 0x3F) << 8) | dns[pos + 1];
+            continue;
+        }
+
+        if ((label_len & 0xC0) != 0 || pos + 1 + label_len > len ||
+            out_pos + label_len + 1 >= out_size) {
+            return -1;
+        }
+
+        if (out_pos > 0) {
+            out[out_pos++] = '.';
+        }
+        for (size_t i = 0; i < label_len; i++) {
+            out[out_pos++] = (char)tolower(dns[pos + 1 + i]);
+        }
+        pos += 1 + label_len;
+    }
+
+    return -1;
+}
+
+// Learn addresses from a DNS response. The query for a blocked name is
+// normally dropped before it leaves the device, so in practice this catches
+// names that are only blocked further down a CNAME chain (CNAME cloaking)
+// and answers for names that were blocked after the query went out. An
+// answer for an allowed name shows its addresses are shared, so they are
+// forgotten again.
+int ipset_learn_dns_response(const uint8_t *dns, size_t len) {
+    if (len < 12 || !(dns[2] & 0x80) || (dns[3] & 0x0F) != 0) {
+        return 0;  // Not a successful response
+    }
+
+    uint16_t qdcount = read16(dns + 4);
+    uint16_t ancount = read16(dns + 6);
+    if (qdcount != 1 || ancount == 0) {
+        return 0;
+    }
+
+    char name[256];
+    long pos = read_name(dns, len, 12, name, sizeof(name));
+    if (pos < 0 || (size_t)pos + 4 > len) {
+        return 0;
+    }
+
+    uint8_t categories = 0;
+    int blocked = filter_check_domain_categories(name, &categories);
+    size_t answers = (size_t)pos + 4;
+
+    // First pass: is any name in the chain blocked, and by which lists?
+    pos = (long)answers;
+    for (uint16_t i = 0; i < ancount; i++) {
+        pos = read_name(dns, len, (size_t)pos, name, sizeof(name));
+        if (pos < 0 || (size_t)pos + 10 > len) {
+            return 0;
+        }
+
+        const uint8_t *rr = dns + pos;
+        uint16_t rdlen = read16(rr + 8);
+        if ((size_t)pos + 10 + rdlen > len) {
+            return 0;
+        }
+
+        uint8_t cname_categories = 0;
+        if (read16(rr) == DNS_TYPE_CNAME &&
+            read_name(dns, len, (size_t)pos + 10, name, sizeof(name)) >= 0 &&
+            filter_check_domain_categories(name, &cname_categories)) {
+            blocked = 1;
+            categories |= cname_categories;
+        }
+        pos += 10 + rdlen;
+    }
+
+    // Second pass: learn the addresses, or forget them for an allowed name
+    int learned = 0;
+    pos = (long)answers;
+    for (uint16_t i = 0; i < ancount; i++) {
+        pos = read_name(dns, len, (size_t)pos, name, sizeof(name));
+        if (pos < 0 || (size_t)pos + 10 > len) {
+            break;
+        }
+
+        const uint8_t *rr = dns + pos;
+        uint16_t type = read16(rr);
+        uint32_t ttl = read32(rr + 4);
+        uint16_t rdlen = read16(rr + 8);
+        if ((size_t)pos + 10 + rdlen > len) {
+            break;
+        }
+
+        if (read16(rr + 2) == DNS_CLASS_IN) {
+            uint8_t addr[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+            int found = 0;
+            if (type == DNS_TYPE_A && rdlen == 4) {
+                memcpy(addr + 12, rr + 10, 4);
+                found = 1;
+            } else if (type == DNS_TYPE_AAAA && rdlen == 16) {
+                memcpy(addr, rr + 10, 16);
+                found = 1;
+            }
+
+            if (found && blocked) {
+                ipset_add(addr, ttl, categories);
+                learned++;
+            } else if (found) {
+                ipset_remove(addr);
+            }
+        }
+        pos += 10 + rdlen;
+    }
+
+    if (learned > 0) {
+        LOGI("Learned %d blocked addresses", learned);
+    }
+    return learned;
+}
@@ -0,0 +1,894 @@
+// filter_regex.c
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "include/filter_regex.h"
+
+#define TAG "FilterRegex"
+#include "include/native_log.h"
+
+// Limits that keep a single hostile rule from blowing up the automaton
+#define MAX_RULE_STATES 4096
+#define MAX_REPEAT      32
+#define MAX_DEPTH       32
+
+#define NFA_NONE    UINT32_MAX
+#define DFA_UNKNOWN (-1)
+#define DFA_BUCKETS 4096
+
+// NFA state kinds. CHAR consumes one byte of its set, BOL/EOL only pass at
+// the start/end of the text, MATCH reports the rule's actions.
+enum {
+    NFA_CHAR,
+    NFA_EPS,
+    NFA_SPLIT,
+    NFA_BOL,
+    NFA_EOL,
+    NFA_MATCH
+};
+
+struct regex_nfa_state {
+    uint8_t op;
+    uint8_t actions;   // NFA_MATCH only
+    uint32_t set;      // NFA_CHAR only
+    uint32_t out;
+    uint32_t out1;     // NFA_SPLIT only
+};
+
+// A cached DFA state: a sorted set of NFA states plus lazily filled transitions
+struct regex_dfa_state {
+    regex_dfa_state_t *hash_next;
+    uint32_t hash;
+    uint32_t index;       // Position in dfa_states
+    uint32_t num_nfa;
+    uint8_t actions;      // Actions of the MATCH states in the set
+    uint8_t eol_actions;  // Actions that match if the text ends here
+    int32_t *next;        // Per byte class, index into dfa_states or DFA_UNKNOWN
+    uint32_t nfa[];
+};
+
+// NFA fragment under construction. end is a state whose out is unset.
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} frag_t;
+
+typedef struct {
+    filter_regex_t *re;
+    const char *pattern;
+    size_t len;
+    size_t pos;
+    uint32_t first_state;
+    int depth;
+    int error;
+} parser_t;
+
+static frag_t parse_alt(parser_t *p);
+
+// Initialize an empty rule set
+void regex_init(filter_regex_t *re) {
+    memset(re, 0, sizeof(*re));
+    re->root = NFA_NONE;
+    re->cache_limit = REGEX_DEFAULT_CACHE_LIMIT;
+}
+
+// Drop every cached DFA state
+static void flush_cache(filter_regex_t *re) {
+    for (uint32_t i = 0; i < re->num_dfa_states; i++) {
+        free(re->dfa_states[i]);
+    }
+    re->num_dfa_states = 0;
+    re->dfa_start = NULL;
+    re->cache_bytes = 0;
+
+    if (re->dfa_buckets != NULL) {
+        memset(re->dfa_buckets, 0, re->num_dfa_buckets * sizeof(*re->dfa_buckets));
+    }
+}
+
+void regex_destroy(filter_regex_t *re) {
+    flush_cache(re);
+    free(re->dfa_states);
+    free(re->dfa_buckets);
+    free(re->states);
+    free(re->sets);
+    free(re->mark);
+    free(re->stack);
+    free(re->set_a);
+    free(re->set_b);
+    free(re->set_c);
+    regex_init(re);
+}
+
+void regex_set_cache_limit(filter_regex_t *re, size_t bytes) {
+    re->cache_limit = bytes;
+    if (re->cache_bytes > bytes) {
+        flush_cache(re);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Rule compiler
+// ---------------------------------------------------------------------------
+
+static uint32_t new_state(parser_t *p, uint8_t op) {
+    filter_regex_t *re = p->re;
+
+    if (re->num_states - p->first_state >= MAX_RULE_STATES) {
+        p->error = 1;
+        return NFA_NONE;
+    }
+
+    if (re->num_states == re->max_states) {
+        uint32_t new_max = re->max_states ? re->max_states * 2 : 256;
+        struct regex_nfa_state *states = realloc(re->states, new_max * sizeof(*states));
+        if (states == NULL) {
+            p->error = 1;
+            return NFA_NONE;
+        }
+        re->states = states;
+        re->max_states = new_max;
+    }
+
+    uint32_t index = re->num_states++;
+    struct regex_nfa_state *s = &re->states[index];
+    memset(s, 0, sizeof(*s));
+    s->op = op;
+    s->out = NFA_NONE;
+    s->out1 = NFA_NONE;
+    return index;
+}
+
+static inline int set_has(const uint32_t *set, uint8_t c) {
+    return (set[c >> 5] >> (c & 31)) & 1;
+}
+
+static inline void set_add(uint32_t *set, uint8_t c) {
+    set[c >> 5] |= 1u << (c & 31);
+}
+
+// Regex rules match hostnames, so letters are case-insensitive
+static void set_add_folded(uint32_t *set, uint8_t c) {
+    set_add(set, c);
+    if (isalpha(c)) {
+        set_add(set, (uint8_t)tolower(c));
+        set_add(set, (uint8_t)toupper(c));
+    }
+}
+
+// Intern a character set and return its index
+static uint32_t intern_set(parser_t *p, const uint32_t *set) {
+    filter_regex_t *re = p->re;
+
+    for (uint32_t i = 0; i < re->num_sets; i++) {
+        if (memcmp(re->sets[i], set, sizeof(re->sets[i])) == 0) {
+            return i;
+        }
+    }
+
+    if (re->num_sets == re->max_sets) {
+        uint32_t new_max = re->max_sets ? re->max_sets * 2 : 32;
+        uint32_t (*sets)[8] = realloc(re->sets, new_max * sizeof(*sets));
+        if (sets == NULL) {
+            p->error = 1;
+            return 0;
+        }
+        re->sets = sets;
+        re->max_sets = new_max;
+    }
+
+    memcpy(re->sets[re->num_sets], set, sizeof(re->sets[0]));
+    re->dirty = 1;
+    return re->num_sets++;
+}
+
+static frag_t frag_state(parser_t *p, uint8_t op) {
+    uint32_t s = new_state(p, op);
+    frag_t f = { s, s };
+    return f;
+}
+
+static frag_t frag_set(parser_t *p, const uint32_t *set) {
+    frag_t f = frag_state(p, NFA_CHAR);
+    if (!p->error) {
+        p->re->states[f.start].set = intern_set(p, set);
+    }
+    return f;
+}
+
+static frag_t frag_concat(parser_t *p, frag_t a, frag_t b) {
+    if (p->error) {
+        return a;
+    }
+    p->re->states[a.end].out = b.start;
+    frag_t f = { a.start, b.end };
+    return f;
+}
+
+static frag_t frag_alt(parser_t *p, frag_t a, frag_t b) {
+    uint32_t split = new_state(p, NFA_SPLIT);
+    uint32_t end = new_state(p, NFA_EPS);
+    frag_t f = { split, end };
+    if (p->error) {
+        return f;
+    }
+
+    filter_regex_t *re = p->re;
+    re->states[split].out = a.start;
+    re->states[split].out1 = b.start;
+    re->states[a.end].out = end;
+    re->states[b.end].out = end;
+    return f;
+}
+
+// a* (min 0) or a+ (min 1)
+static frag_t frag_loop(parser_t *p, frag_t a, int min) {
+    uint32_t split = new_state(p, NFA_SPLIT);
+    uint32_t end = new_state(p, NFA_EPS);
+    frag_t f = { min ? a.start : split, end };
+    if (p->error) {
+        return f;
+    }
+
+    filter_regex_t *re = p->re;
+    re->states[split].out = a.start;
+    re->states[split].out1 = end;
+    re->states[a.end].out = split;
+    return f;
+}
+
+static frag_t frag_optional(parser_t *p, frag_t a) {
+    uint32_t split = new_state(p, NFA_SPLIT);
+    uint32_t end = new_state(p, NFA_EPS);
+    frag_t f = { split, end };
+    if (p->error) {
+        return f;
+    }
+
+    filter_regex_t *re = p->re;
+    re->states[split].out = a.start;
+    re->states[split].out1 = end;
+    re->states[a.end].out = end;
+    return f;
+}
+
+// Parse an escape sequence into a character set. Returns -1 if unsupported.
+static int parse_escape(parser_t *p, uint32_t *set) {
+    if (p->pos >= p->len) {
+        return -1;
+    }
+
+    char c = p->pattern[p->pos++];
+    int negate = isupper((unsigned char)c);
+
+    switch (tolower((unsigned char)c)) {
+        case 'd':
+            for (int b = '0'; b <= '9'; b++) set_add(set, b);
+            break;
+        case 'w':
+            for (int b = 0; b < 256; b++) {
+                if (isalnum(b) || b == '_') set_add(set, b);
+            }
+            break;
+        case 's':
+            for (int b = 0; b < 256; b++) {
+                if (isspace(b)) set_add(set, b);
+            }
+            break;
+        default:
+            // Backreferences and word boundaries cannot be compiled to a DFA
+            if (isalnum((unsigned char)c)) {
+                if (c == 't') { set_add(set, '\t'); return 0; }
+                if (c == 'n') { set_add(set, '\n'); return 0; }
+                return -1;
+            }
+            set_add(set, (uint8_t)c);
+            return 0;
+    }
+
+    if (negate) {
+        for (int i = 0; i < 8; i++) {
+            set[i] = ~set[i];
+        }
+    }
+    return 0;
+}
+
+// Parse a bracket expression, the opening '[' already consumed
+static int parse_class(parser_t *p, uint32_t *set) {
+    int negate = 0;
+    int first = 1;
+    uint32_t items[8];
+    memset(items, 0, sizeof(items));
+
+    if (p->pos < p->len && p->pattern[p->pos] == '^') {
+        negate = 1;
+        p->pos++;
+    }
+
+    while (p->pos < p->len) {
+        char c = p->pattern[p->pos];
+        if (c == ']' && !first) {
+            p->pos++;
+
+            for (int b = 0; b < 256; b++) {
+                if (set_has(items, b)) set_add_folded(set, b);
+            }
+            if (negate) {
+                for (int i = 0; i < 8; i++) set[i] = ~set[i];
+            }
+            return 0;
+        }
+        first = 0;
+        p->pos++;
+
+        if (c == '\\') {
+            uint32_t escaped[8];
+            memset(escaped, 0, sizeof(escaped));
+            if (parse_escape(p, escaped) < 0) {
+                return -1;
+            }
+            for (int i = 0; i < 8; i++) items[i] |= escaped[i];
+            continue;
+        }
+
+        // Range a-z
+        if (p->pos + 1 < p->len && p->pattern[p->pos] == '-' && p->pattern[p->pos + 1] != ']') {
+            unsigned char lo = (unsigned char)c;
+            unsigned char hi = (unsigned char)p->pattern[p->pos + 1];
+            if (hi == '\\' || hi < lo) {
+                return -1;
+            }
+            for (int b = lo; b <= hi; b++) set_add(items, b);
+            p->pos += 2;
+            continue;
+        }
+
+        set_add(items, (uint8_t)c);
+    }
+
+    return -1; // Unterminated class
+}
+
+// Parse a single atom: literal, class, group or anchor
+static frag_t parse_atom(parser_t *p) {
+    frag_t none = { NFA_NONE, NFA_NONE };
+    uint32_t set[8];
+    memset(set, 0, sizeof(set));
+
+    char c = p->pattern[p->pos++];
+    switch (c) {
+        case '(': {
+            if (++p->depth > MAX_DEPTH) {
+                p->error = 1;
+                return none;
+            }
+            if (p->pos < p->len && p->pattern[p->pos] == '?') {
+                // Only non-capturing groups, lookaround is not regular
+                if (p->pos + 1 >= p->len || p->pattern[p->pos + 1] != ':') {
+                    p->error = 1;
+                    return none;
+                }
+                p->pos += 2;
+            }
+            frag_t f = parse_alt(p);
+            if (p->error || p->pos >= p->len || p->pattern[p->pos] != ')') {
+                p->error = 1;
+                return none;
+            }
+            p->pos++;
+            p->depth--;
+            return f;
+        }
+        case '[':
+            if (parse_class(p, set) < 0) {
+                p->error = 1;
+                return none;
+            }
+            return frag_set(p, set);
+        case '.':
+            memset(set, 0xff, sizeof(set));
+            return frag_set(p, set);
+        case '^':
+            return frag_state(p, NFA_BOL);
+        case '$':
+            return frag_state(p, NFA_EOL);
+        case '\\':
+            if (parse_escape(p, set) < 0) {
+                p->error = 1;
+                return none;
+            }
+            return frag_set(p, set);
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+        case ')':
+        case '|':
+            p->error = 1;
+            return none;
+        default:
+            set_add_folded(set, (uint8_t)c);
+            return frag_set(p, set);
+    }
+}
+
+// Parse {m}, {m,} or {m,n}. Returns -1 if the brace is not a valid counter.
+static int parse_counter(parser_t *p, int *min, int *max) {
+    size_t pos = p->pos + 1;
+    int lo = 0, hi;
+    int digits = 0;
+
+    while (pos < p->len && isdigit((unsigned char)p->pattern[pos])) {
+        lo = lo * 10 + (p->pattern[pos++] - '0');
+        if (++digits > 3) return -1;
+    }
+    if (digits == 0) {
+        return -1;
+    }
+
+    hi = lo;
+    if (pos < p->len && p->pattern[pos] == ',') {
+        pos++;
+        hi = -1;
+        if (pos < p->len && isdigit((unsigned char)p->pattern[pos])) {
+            hi = 0;
+            digits = 0;
+            while (pos < p->len && isdigit((unsigned char)p->pattern[pos])) {
+                hi = hi * 10 + (p->pattern[pos++] - '0');
+                if (++digits > 3) return -1;
+            }
+        }
+    }
+    if (pos >= p->len || p->pattern[pos] != '}') {
+        return -1;
+    }
+    if (lo > MAX_REPEAT || hi > MAX_REPEAT || (hi >= 0 && hi < lo)) {
+        return -1;
+    }
+
+    p->pos = pos + 1;
+    *min = lo;
+    *max = hi;
+    return 0;
+}
+
+// Parse an atom and its quantifiers
+static frag_t parse_repeat(parser_t *p) {
+    size_t atom_start = p->pos;
+    frag_t f = parse_atom(p);
+    size_t atom_end = p->pos;
+
+    while (!p->error && p->pos < p->len) {
+        char c = p->pattern[p->pos];
+        int min, max;
+
+        if (c == '*') {
+            p->pos++;
+            f = frag_loop(p, f, 0);
+        } else if (c == '+') {
+            p->pos++;
+            f = frag_loop(p, f, 1);
+        } else if (c == '?') {
+            p->pos++;
+            f = frag_optional(p, f);
+        } else if (c == '{' && parse_counter(p, &min, &max) == 0) {
+            // Expand the counter by re-parsing the atom for each copy
+            size_t resume = p->pos;
+            frag_t out = frag_state(p, NFA_EPS);
+            for (int i = 0; i < (max < 0 ? min + 1 : max) && !p->error; i++) {
+                frag_t copy = f;
+                if (i > 0) {
+                    p->pos = atom_start;
+                    copy = parse_atom(p);
+                    if (p->pos != atom_end) {
+                        p->error = 1;
+                    }
+                }
+                if (p->error) {
+                    break;
+                }
+                if (max < 0 && i == min) {
+                    copy = frag_loop(p, copy, 0);
+                } else if (i >= min) {
+                    copy = frag_optional(p, copy);
+                }
+                out = frag_concat(p, out, copy);
+            }
+            p->pos = resume;
+            f = out;
+        } else {
+            break;
+        }
+
+        // Lazy quantifiers match the same language
+        if (p->pos < p->len && p->pattern[p->pos] == '?' && c != '?') {
+            p->pos++;
+        }
+    }
+
+    return f;
+}
+
+// Parse a sequence of atoms up to '|' or ')'
+static frag_t parse_concat(parser_t *p) {
+    frag_t f = frag_state(p, NFA_EPS);
+
+    while (!p->error && p->pos < p->len) {
+        char c = p->pattern[p->pos];
+        if (c == '|' || c == ')') {
+            break;
+        }
+        f = frag_concat(p, f, parse_repeat(p));
+    }
+
+    return f;
+}
+
+static frag_t parse_alt(parser_t *p) {
+    frag_t f = parse_concat(p);
+
+    while (!p->error && p->pos < p->len && p->pattern[p->pos] == '|') {
+        p->pos++;
+        frag_t rhs = parse_concat(p);
+        if (p->error) {
+            break;
+        }
+        f = frag_alt(p, f, rhs);
+    }
+
+    return f;
+}
+
+// Compile a rule and add it to the combined automaton
+int regex_add(filter_regex_t *re, const char *pattern, size_t len, uint8_t actions) {
+    parser_t p = { re, pattern, len, 0, re->num_states, 0, 0 };
+    uint32_t saved_sets = re->num_sets;
+
+    if (len == 0) {
+        return -1;
+    }
+
+    frag_t f = parse_alt(&p);
+    if (!p.error && p.pos != len) {
+        p.error = 1; // Unbalanced ')'
+    }
+
+    uint32_t match = NFA_NONE;
+    if (!p.error) {
+        match = new_state(&p, NFA_MATCH);
+    }
+
+    uint32_t split = NFA_NONE;
+    if (!p.error && re->root != NFA_NONE) {
+        split = new_state(&p, NFA_SPLIT);
+    }
+
+    if (p.error) {
+        // Roll back whatever this rule allocated
+        re->num_states = p.first_state;
+        re->num_sets = saved_sets;
+        LOGE("Unsupported regex rule: %.*s", (int)len, pattern);
+        return -1;
+    }
+
+    re->states[match].actions = actions;
+    re->states[f.end].out = match;
+
+    // Hang the rule off the root split chain
+    if (split != NFA_NONE) {
+        re->states[split].out = f.start;
+        re->states[split].out1 = re->root;
+        re->root = split;
+    } else {
+        re->root = f.start;
+    }
+
+    re->num_rules++;
+    re->dirty = 1;
+    flush_cache(re);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Lazy DFA
+// ---------------------------------------------------------------------------
+
+// Partition bytes into classes that no character set distinguishes
+static void compute_byte_classes(filter_regex_t *re) {
+    int remap[512];
+
+    memset(re->byte_class, 0, sizeof(re->byte_class));
+    re->num_classes = 1;
+
+    for (uint32_t s = 0; s < re->num_sets; s++) {
+        uint32_t classes = 0;
+        memset(remap, -1, sizeof(remap));
+
+        for (int b = 0; b < 256; b++) {
+            int key = re->byte_class[b] * 2 + set_has(re->sets[s], b);
+            if (remap[key] < 0) {
+                remap[key] = classes++;
+            }
+            re->byte_class[b] = (uint8_t)remap[key];
+        }
+        re->num_classes = classes;
+    }
+
+    for (int b = 255; b >= 0; b--) {
+        re->class_rep[re->byte_class[b]] = (uint8_t)b;
+    }
+}
+
+// Size scratch buffers to the NFA and recompute byte classes after rule changes
+static int prepare(filter_regex_t *re) {
+    if (!re->dirty) {
+        return 0;
+    }
+
+    flush_cache(re);
+    compute_byte_classes(re);
+
+    size_t bytes = re->num_states * sizeof(uint32_t);
+    uint32_t *mark = realloc(re->mark, bytes);
+    if (mark != NULL) re->mark = mark;
+    uint32_t *stack = realloc(re->stack, bytes);
+    if (stack != NULL) re->stack = stack;
+    uint32_t *set_a = realloc(re->set_a, bytes);
+    if (set_a != NULL) re->set_a = set_a;
+    uint32_t *set_b = realloc(re->set_b, bytes);
+    if (set_b != NULL) re->set_b = set_b;
+    uint32_t *set_c = realloc(re->set_c, bytes);
+    if (set_c != NULL) re->set_c = set_c;
+
+    if (mark == NULL || stack == NULL || set_a == NULL || set_b == NULL || set_c == NULL) {
+        return -1;
+    }
+    memset(re->mark, 0, bytes);
+    re->mark_gen = 0;
+
+    if (re->dfa_buckets == NULL) {
+        re->dfa_buckets = calloc(DFA_BUCKETS, sizeof(*re->dfa_buckets));
+        if (re->dfa_buckets == NULL) {
+            return -1;
+        }
+        re->num_dfa_buckets = DFA_BUCKETS;
+    }
+
+    re->dirty = 0;
+    return 0;
+}
+
+static uint32_t next_mark(filter_regex_t *re) {
+    if (++re->mark_gen == 0) {
+        memset(re->mark, 0, re->num_states * sizeof(uint32_t));
+        re->mark_gen = 1;
+    }
+    return re->mark_gen;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Follow epsilon edges from the seeds. Consuming, MATCH and EOL states end
+// up in out. BOL edges are only followed at the start of the text and EOL
+// edges only at its end.
+static uint32_t closure(filter_regex_t *re, const uint32_t *seeds, uint32_t num_seeds,
+                        uint32_t extra, int at_start, int at_end, uint32_t *out) {
+    uint32_t gen = next_mark(re);
+    uint32_t sp = 0;
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < num_seeds; i++) {
+        if (re->mark[seeds[i]] != gen) {
+            re->mark[seeds[i]] = gen;
+            re->stack[sp++] = seeds[i];
+        }
+    }
+    if (extra != NFA_NONE && re->mark[extra] != gen) {
+        re->mark[extra] = gen;
+        re->stack[sp++] = extra;
+    }
+
+    while (sp > 0) {
+        uint32_t index = re->stack[--sp];
+        const struct regex_nfa_state *s = &re->states[index];
+        uint32_t follow[2] = { NFA_NONE, NFA_NONE };
+
+        switch (s->op) {
+            case NFA_EOL:
+                if (at_end) {
+                    follow[0] = s->out;
+                    break;
+                }
+                out[n++] = index;
+                break;
+            case NFA_CHAR:
+            case NFA_MATCH:
+                out[n++] = index;
+                break;
+            case NFA_EPS:
+                follow[0] = s->out;
+                break;
+            case NFA_SPLIT:
+                follow[0] = s->out;
+                follow[1] = s->out1;
+                break;
+            case NFA_BOL:
+                if (at_start) {
+                    follow[0] = s->out;
+                }
+                break;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (follow[i] != NFA_NONE && re->mark[follow[i]] != gen) {
+                re->mark[follow[i]] = gen;
+                re->stack[sp++] = follow[i];
+            }
+        }
+    }
+
+    qsort(out, n, sizeof(uint32_t), compare_u32);
+    return n;
+}
+
+// Actions matched if the text ends in this state: pass the EOL anchors
+static uint8_t eol_actions(filter_regex_t *re, const uint32_t *set, uint32_t n) {
+    uint8_t actions = 0;
+    uint32_t seeds = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        const struct regex_nfa_state *s = &re->states[set[i]];
+        if (s->op == NFA_EOL) {
+            re->set_a[seeds++] = s->out;
+        }
+    }
+    if (seeds == 0) {
+        return 0;
+    }
+
+    uint32_t count = closure(re, re->set_a, seeds, NFA_NONE, 0, 1, re->set_b);
+    for (uint32_t i = 0; i < count; i++) {
+        const struct regex_nfa_state *s = &re->states[re->set_b[i]];
+        if (s->op == NFA_MATCH) {
+            actions |= s->actions;
+        }
+    }
+
+    return actions;
+}
+
+static uint32_t hash_set(const uint32_t *set, uint32_t n) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < n; i++) {
+        h = (h ^ set[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Find or create the DFA state for a sorted NFA set. set must not alias
+// set_a/set_b, which the EOL computation uses as scratch.
+static regex_dfa_state_t *intern_state(filter_regex_t *re, const uint32_t *set, uint32_t n) {
+    uint32_t hash = hash_set(set, n);
+    uint32_t bucket = hash & (re->num_dfa_buckets - 1);
+
+    for (regex_dfa_state_t *d = re->dfa_buckets[bucket]; d != NULL; d = d->hash_next) {
+        if (d->hash == hash && d->num_nfa == n && memcmp(d->nfa, set, n * sizeof(uint32_t)) == 0) {
+            return d;
+        }
+    }
+
+    size_t bytes = sizeof(regex_dfa_state_t) + n * sizeof(uint32_t) +
+                   re->num_classes * sizeof(int32_t);
+
+    // Over budget: start over with an empty cache
+    if (re->cache_bytes + bytes > re->cache_limit && re->num_dfa_states > 0) {
+        flush_cache(re);
+        re->cache_flushes++;
+    }
+
+    if (re->num_dfa_states == re->max_dfa_states) {
+        uint32_t new_max = re->max_dfa_states ? re->max_dfa_states * 2 : 64;
+        regex_dfa_state_t **states = realloc(re->dfa_states, new_max * sizeof(*states));
+        if (states == NULL) {
+            return NULL;
+        }
+        re->dfa_states = states;
+        re->max_dfa_states = new_max;
+    }
+
+    regex_dfa_state_t *d = malloc(bytes);
+    if (d == NULL) {
+        return NULL;
+    }
+
+    d->hash = hash;
+    d->index = re->num_dfa_states;
+    d->num_nfa = n;
+    d->actions = 0;
+    memcpy(d->nfa, set, n * sizeof(uint32_t));
+    d->next = (int32_t *)(d->nfa + n);
+    for (uint32_t c = 0; c < re->num_classes; c++) {
+        d->next[c] = DFA_UNKNOWN;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        const struct regex_nfa_state *s = &re->states[set[i]];
+        if (s->op == NFA_MATCH) {
+            d->actions |= s->actions;
+        }
+    }
+    d->eol_actions = eol_actions(re, d->nfa, n);
+
+    d->hash_next = re->dfa_buckets[bucket];
+    re->dfa_buckets[bucket] = d;
+    re->dfa_states[re->num_dfa_states++] = d;
+    re->cache_bytes += bytes;
+    return d;
+}
+
+// Compute the successor of a state on a byte class
+static regex_dfa_state_t *step(filter_regex_t *re, regex_dfa_state_t *d, uint32_t cls) {
+    uint8_t byte = re->class_rep[cls];
+    uint32_t seeds = 0;
+
+    for (uint32_t i = 0; i < d->num_nfa; i++) {
+        const struct regex_nfa_state *s = &re->states[d->nfa[i]];
+        if (s->op == NFA_CHAR && set_has(re->sets[s->set], byte)) {
+            re->set_a[seeds++] = s->out;
+        }
+    }
+
+    // Re-entering the root at every position makes the search unanchored
+    uint32_t n = closure(re, re->set_a, seeds, re->root, 0, 0, re->set_c);
+
+    uint64_t flushes = re->cache_flushes;
+    regex_dfa_state_t *next = intern_state(re, re->set_c, n);
+
+    // Link the transition unless the cache was flushed under d
+    if (next != NULL && flushes == re->cache_flushes) {
+        d->next[cls] = (int32_t)next->index;
+    }
+    return next;
+}
+
+// Match text against every rule, returns the union of matched actions
+uint8_t regex_match(filter_regex_t *re, const char *text, size_t len) {
+    if (re->root == NFA_NONE || prepare(re) < 0) {
+        return 0;
+    }
+
+    regex_dfa_state_t *d = re->dfa_start;
+    if (d == NULL) {
+        uint32_t n = closure(re, NULL, 0, re->root, 1, 0, re->set_c);
+        d = re->dfa_start = intern_state(re, re->set_c, n);
+        if (d == NULL) {
+            LOGE("Out of memory building regex DFA");
+            return 0;
+        }
+    }
+
+    uint8_t actions = 0;
+    for (size_t i = 0; i < len; i++) {
+        actions |= d->actions;
+
+        uint32_t cls = re->byte_class[(uint8_t)text[i]];
+        int32_t next = d->next[cls];
+        if (next != DFA_UNKNOWN) {
+            d = re->dfa_states[next];
+            continue;
+        }
+
+        d = step(re, d, cls);
+        if (d == NULL) {
+            LOGE("Out of memory building regex DFA");
+            return actions;
+        }
+    }
+
+    return actions | d->actions | d->eol_actions;
+}
@@ -0,0 +1,190 @@
+// filter_rules.c
+#include <string.h>
+#include <ctype.h>
+#include "include/filter_rules.h"
+
+// Does the slice start with the given literal?
+static int starts_with(const char *s, size_t len, const char *prefix) {
+    size_t prefix_len = strlen(prefix);
+    return len >= prefix_len && memcmp(s, prefix, prefix_len) == 0;
+}
+
+// Find the first occurrence of needle in the slice
+static const char *find(const char *s, size_t len, const char *needle) {
+    size_t needle_len = strlen(needle);
+    for (size_t i = 0; i + needle_len <= len; i++) {
+        if (memcmp(s + i, needle, needle_len) == 0) {
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+// Hostname characters accepted in domain rules
+static int is_domain_char(char c) {
+    return isalnum((unsigned char)c) || c == '-' || c == '.' || c == '_';
+}
+
+// Parse a $modifier list. Returns -1 if any modifier cannot be honoured at
+// the DNS level (content types, third-party, ...), since applying the rule
+// unconditionally would block more than the list author intended.
+static int parse_modifiers(const char *s, size_t len, uint8_t *important) {
+    *important = 0;
+
+    while (len > 0) {
+        const char *comma = memchr(s, ',', len);
+        size_t item_len = comma ? (size_t)(comma - s) : len;
+
+        if (item_len == 9 && memcmp(s, "important", 9) == 0) {
+            *important = 1;
+        } else if (!(item_len == 3 && memcmp(s, "all", 3) == 0) &&
+                   !(item_len == 8 && memcmp(s, "document", 8) == 0) &&
+                   !(item_len == 3 && memcmp(s, "doc", 3) == 0)) {
+            return -1;
+        }
+
+        if (comma == NULL) {
+            break;
+        }
+        s = comma + 1;
+        len -= item_len + 1;
+    }
+
+    return 0;
+}
+
+// Parse one list line in plain, hosts or adblock syntax
+int filter_parse_rule(const char *line, size_t len, filter_rule_t *rule) {
+    memset(rule, 0, sizeof(*rule));
+
+    // Trim whitespace
+    while (len > 0 && isspace((unsigned char)line[0])) {
+        line++;
+        len--;
+    }
+    while (len > 0 && isspace((unsigned char)line[len - 1])) {
+        len--;
+    }
+
+    // Skip empty lines, comments and list headers
+    if (len == 0 || line[0] == '#' || line[0] == '!' || line[0] == '[') {
+        return 0;
+    }
+
+    // Cosmetic rules only apply to page content
+    if (find(line, len, "##") || find(line, len, "#@#") || find(line, len, "#?#") ||
+        find(line, len, "#$#")) {
+        return 0;
+    }
+
+    uint8_t action = FILTER_ACTION_BLOCK;
+    if (starts_with(line, len, "@@")) {
+        action = FILTER_ACTION_ALLOW;
+        line += 2;
+        len -= 2;
+    }
+
+    // Regex rule: /pattern/ with optional $modifiers
+    if (len >= 2 && line[0] == '/') {
+        const char *end = line + len - 1;
+        while (end > line && *end != '/') {
+            end--;
+        }
+        if (end == line) {
+            return -1;
+        }
+
+        uint8_t important = 0;
+        size_t tail = line + len - (end + 1);
+        if (tail > 0 && (end[1] != '$' || parse_modifiers(end + 2, tail - 1, &important) < 0)) {
+            return -1;
+        }
+        if (important && action == FILTER_ACTION_BLOCK) {
+            action = FILTER_ACTION_IMPORTANT;
+        }
+
+        rule->type = FILTER_RULE_REGEX;
+        rule->flags = action;
+        rule->pattern = line + 1;
+        rule->pattern_len = end - line - 1;
+        return rule->pattern_len > 0 ? 1 : -1;
+    }
+
+    // Split off $modifiers
+    const char *dollar = memchr(line, '$', len);
+    uint8_t important = 0;
+    if (dollar != NULL) {
+        if (parse_modifiers(dollar + 1, line + len - dollar - 1, &important) < 0) {
+            return -1;
+        }
+        len = dollar - line;
+    }
+    if (important && action == FILTER_ACTION_BLOCK) {
+        action = FILTER_ACTION_IMPORTANT;
+    }
+
+    const char *domain = line;
+    size_t domain_len = len;
+    int subdomains_only = 0;
+
+    if (starts_with(domain, domain_len, "||")) {
+        // ||example.com^ covers the domain and all of its subdomains
+        domain += 2;
+        domain_len -= 2;
+
+        const char *caret = memchr(domain, '^', domain_len);
+        if (caret != NULL) {
+            // Nothing but an optional '|' may follow the separator
+            size_t rest = domain + domain_len - caret - 1;
+            if (rest > 1 || (rest == 1 && caret[1] != '|')) {
+                return -1;
+            }
+            domain_len = caret - domain;
+        }
+    } else if (action == FILTER_ACTION_BLOCK &&
+               (isdigit((unsigned char)domain[0]) || domain[0] == ':')) {
+        // Hosts file format: "0.0.0.0 example.com # comment"
+        const char *p = domain;
+        const char *end = domain + domain_len;
+        while (p < end && !isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (p < end) {
+            while (p < end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            const char *name_end = p;
+            while (name_end < end && !isspace((unsigned char)*name_end) && *name_end != '#') {
+                name_end++;
+            }
+            domain = p;
+            domain_len = name_end - p;
+        }
+    }
+
+    if (starts_with(domain, domain_len, "*.")) {
+        subdomains_only = 1;
+        domain += 2;
+        domain_len -= 2;
+    }
+
+    // Strip a trailing dot from fully qualified names
+    if (domain_len > 0 && domain[domain_len - 1] == '.') {
+        domain_len--;
+    }
+
+    if (domain_len == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < domain_len; i++) {
+        if (!is_domain_char(domain[i])) {
+            return -1;
+        }
+    }
+
+    rule->type = FILTER_RULE_DOMAIN;
+    rule->flags = subdomains_only ? FILTER_NODE_SUBDOMAINS(action) : action;
+    rule->pattern = domain;
+    rule->pattern_len = domain_len;
+    return 1;
+}
@@ -0,0 +1,402 @@
+// filter_trie.c
+#include <stdio.h>
+#include <string.h>
+#include "include/filter_arena.h"
+#include "include/filter_backend.h"
+#include "include/filter_rules.h"
+
+#define TAG "FilterTrie"
+#include "include/native_log.h"
+
+// Trie nodes live in a chunked arena and link to each other by index.
+// The root is always node 0.
+static filter_arena_t trie_arena;
+
+// Per-category flags of nodes whose lists disagree
+static filter_splits_t trie_splits;
+
+// Find the child of a node reached by character c
+static uint32_t find_child(uint32_t parent, unsigned char c) {
+    uint32_t child = arena_node(&trie_arena, parent)->first_child;
+    while (child != ARENA_NODE_NONE) {
+        const filter_node_t *node = arena_node(&trie_arena, child);
+        if (node->ch == c) {
+            return child;
+        }
+        child = node->next_sibling;
+    }
+    return ARENA_NODE_NONE;
+}
+
+// Find or create the child of a node reached by character c
+static uint32_t get_or_create_child(uint32_t parent, unsigned char c) {
+    uint32_t child = find_child(parent, c);
+    if (child != ARENA_NODE_NONE) {
+        return child;
+    }
+
+    child = arena_alloc(&trie_arena);
+    if (child == ARENA_NODE_INVALID) {
+        return ARENA_NODE_INVALID;
+    }
+
+    // Arena memory is zeroed, only the links need setting
+    filter_node_t *parent_node = arena_node(&trie_arena, parent);
+    filter_node_t *node = arena_node(&trie_arena, child);
+    node->ch = c;
+    node->next_sibling = parent_node->first_child;
+    parent_node->first_child = child;
+    return child;
+}
+
+// Create the root node
+static int trie_init() {
+    arena_init(&trie_arena);
+    if (arena_alloc(&trie_arena) != ARENA_NODE_NONE) {
+        arena_destroy(&trie_arena);
+        return -1;
+    }
+    return 0;
+}
+
+// Releasing the arena unmaps whole chunks, so teardown cost does not
+// depend on the number of nodes
+static void trie_destroy() {
+    arena_destroy(&trie_arena);
+    splits_destroy(&trie_splits);
+}
+
+static int trie_prepare() {
+    if (arena_make_writable(&trie_arena) < 0) {
+        return -1;
+    }
+    return splits_make_writable(&trie_splits);
+}
+
+// Flags of the rules at a node from the enabled categories
+static inline uint8_t node_flags(const filter_node_t *node, uint32_t index, uint8_t categories) {
+    if (!(node->flags & FILTER_NODE_SPLIT)) {
+        return (node->categories & categories) ? node->flags : 0;
+    }
+    return filter_category_flags(splits_find(&trie_splits, index), categories);
+}
+
+// Add per-category flags to a node. While every list naming the node has
+// the same rules, they stay in the node; once lists disagree the node moves
+// to the split table, and stays there.
+static int node_merge_flags(uint32_t index, const uint8_t *add) {
+    filter_node_t *node = arena_node(&trie_arena, index);
+    uint8_t flags[FILTER_CATEGORY_BITS];
+    splits_node_flags(&trie_splits, node, index, flags);
+
+    uint8_t merged = 0;
+    uint8_t categories = 0;
+    int uniform = 1;
+    for (int i = 0; i < FILTER_CATEGORY_BITS; i++) {
+        flags[i] |= add[i];
+        if (flags[i] == 0) {
+            continue;
+        }
+        if (categories != 0 && flags[i] != merged) {
+            uniform = 0;
+        }
+        merged |= flags[i];
+        categories |= (uint8_t)(1u << i);
+    }
+
+    if (uniform && !(node->flags & FILTER_NODE_SPLIT)) {
+        node->flags = merged;
+        node->categories = categories;
+        return 0;
+    }
+
+    if (splits_set(&trie_splits, index, flags) < 0) {
+        return -1;
+    }
+    node->flags = merged | FILTER_NODE_SPLIT;
+    node->categories = categories;
+    return 0;
+}
+
+// Insert a reversed domain one character per level
+static int trie_add(const char *reversed, size_t len, uint8_t flags, uint8_t category) {
+    uint32_t node = ARENA_NODE_NONE;
+
+    for (size_t i = 0; i < len; i++) {
+        node = get_or_create_child(node, (unsigned char)reversed[i]);
+        if (node == ARENA_NODE_INVALID) {
+            return -1;
+        }
+    }
+
+    // Rules for the same domain accumulate per list, the lookup merges the
+    // enabled lists and picks by priority
+    uint8_t add[FILTER_CATEGORY_BITS];
+    for (int i = 0; i < FILTER_CATEGORY_BITS; i++) {
+        add[i] = (category & (1u << i)) ? flags : 0;
+    }
+    return node_merge_flags(node, add);
+}
+
+// Walk the reversed domain once, collecting the actions of rules on the
+// path. Rules only apply where a label ends: at each '.' the name read so
+// far is a parent domain, so its rules and its subdomain-only rules apply,
+// and at the end the name itself matches. A node in the middle of a label
+// is a longer name sharing a prefix (com.example vs com.examples).
+static uint8_t trie_lookup(const char *reversed, size_t len, uint8_t categories) {
+    uint8_t actions = 0;
+    uint32_t node = ARENA_NODE_NONE;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = reversed[i];
+
+        if (c == '.') {
+            uint8_t flags = node_flags(arena_node(&trie_arena, node), node, categories);
+            actions |= (flags | (flags >> FILTER_NODE_SUBDOMAIN_SHIFT)) & FILTER_ACTION_MASK;
+        }
+
+        node = find_child(node, c);
+        if (node == ARENA_NODE_NONE) {
+            return actions;
+        }
+    }
+
+    // Rules for the full name
+    return actions | (node_flags(arena_node(&trie_arena, node), node, categories) & FILTER_ACTION_MASK);
+}
+
+// Lookups in flight at once in trie_lookup_batch
+#define TRIE_LOOKUP_WIDTH 8
+
+// trie_lookup as a resumable walk: cursor is the child of the node matched
+// so far that is compared with reversed[pos] next
+typedef struct {
+    const char *reversed;
+    size_t len;
+    size_t pos;
+    uint32_t cursor;
+    uint8_t actions;
+    size_t index;           // Position in the batch
+} trie_walk_t;
+
+// Go below the node that matched reversed[0..pos), applying its rules if a
+// label ends there, and prefetch the first child. Returns 0 when the walk
+// is over.
+static int walk_descend(trie_walk_t *walk, const filter_node_t *matched, uint32_t index, uint8_t categories) {
+    if (walk->pos == walk->len) {
+        walk->actions |= node_flags(matched, index, categories) & FILTER_ACTION_MASK;
+        return 0;
+    }
+
+    if (walk->reversed[walk->pos] == '.') {
+        uint8_t flags = node_flags(matched, index, categories);
+        walk->actions |= (flags | (flags >> FILTER_NODE_SUBDOMAIN_SHIFT)) & FILTER_ACTION_MASK;
+    }
+
+    walk->cursor = matched->first_child;
+    if (walk->cursor == ARENA_NODE_NONE) {
+        return 0;
+    }
+    __builtin_prefetch(arena_node(&trie_arena, walk->cursor));
+    return 1;
+}
+
+// Compare the cursor node, which was prefetched a round earlier, and move
+// to its first child or next sibling. Returns 0 when the walk is over.
+static int walk_step(trie_walk_t *walk, uint8_t categories) {
+    const filter_node_t *node = arena_node(&trie_arena, walk->cursor);
+    if (node->ch == (unsigned char)walk->reversed[walk->pos]) {
+        walk->pos++;
+        return walk_descend(walk, node, walk->cursor, categories);
+    }
+
+    walk->cursor = node->next_sibling;
+    if (walk->cursor == ARENA_NODE_NONE) {
+        return 0;
+    }
+    __builtin_prefetch(arena_node(&trie_arena, walk->cursor));
+    return 1;
+}
+
+// Every node visit of a lookup depends on the one before, so a single
+// lookup waits out each cache miss. Here several walks take turns, one
+// node each per round, and the node a walk needs next is prefetched while
+// the others run; a finished walk makes room for the next name.
+static void trie_lookup_batch(const char *const *reversed, const size_t *lens, size_t n, uint8_t categories,
+                              uint8_t *actions) {
+    trie_walk_t walks[TRIE_LOOKUP_WIDTH];
+    const filter_node_t *root = arena_node(&trie_arena, ARENA_NODE_NONE);
+    size_t active = 0;
+    size_t next = 0;
+
+    while (active > 0 || next < n) {
+        while (active < TRIE_LOOKUP_WIDTH && next < n) {
+            trie_walk_t *walk = &walks[active];
+            walk->reversed = reversed[next];
+            walk->len = lens[next];
+            walk->pos = 0;
+            walk->actions = 0;
+            walk->index = next++;
+            if (walk_descend(walk, root, ARENA_NODE_NONE, categories)) {
+                active++;
+            } else {
+                actions[walk->index] = walk->actions;
+            }
+        }
+
+        for (size_t i = 0; i < active;) {
+            if (walk_step(&walks[i], categories)) {
+                i++;
+                continue;
+            }
+            actions[walks[i].index] = walks[i].actions;
+            walks[i] = walks[--active];
+        }
+    }
+}
+
+static int trie_is_empty() {
+    return trie_arena.used <= 1;
+}
+
+static void trie_get_stats(filter_backend_stats_t *stats) {
+    filter_arena_stats_t arena_stats;
+    arena_get_stats(&trie_arena, &arena_stats);
+
+    stats->entries = arena_stats.nodes_used;
+    stats->capacity = arena_stats.nodes_capacity;
+    stats->bytes_used = arena_stats.bytes_used;
+    stats->bytes_reserved = arena_stats.bytes_reserved;
+    stats->bytes_shared = arena_stats.bytes_shared;
+
+    uint64_t split_bytes = (uint64_t)trie_splits.capacity * sizeof(filter_split_t);
+    stats->bytes_used += (uint64_t)trie_splits.used * sizeof(filter_split_t);
+    if (trie_splits.readonly) {
+        stats->bytes_shared += split_bytes;
+    } else {
+        stats->bytes_reserved += split_bytes;
+    }
+    stats->chunks = arena_stats.chunks;
+    stats->fragmentation = arena_stats.fragmentation;
+}
+
+// Copy the subtree below src of a prebuilt image into the arena below dst
+static int merge_builtin_node(const filter_builtin_t *builtin, const filter_splits_t *splits, uint32_t src,
+                              uint32_t dst) {
+    const filter_node_t *const *chunks = builtin->chunks;
+    uint32_t child = chunks[src >> ARENA_CHUNK_SHIFT][src & ARENA_CHUNK_MASK].first_child;
+
+    while (child != ARENA_NODE_NONE) {
+        const filter_node_t *node = &chunks[child >> ARENA_CHUNK_SHIFT][child & ARENA_CHUNK_MASK];
+        uint32_t copy = get_or_create_child(dst, node->ch);
+        if (copy == ARENA_NODE_INVALID) {
+            return -1;
+        }
+
+        if (node->flags != 0) {
+            uint8_t flags[FILTER_CATEGORY_BITS];
+            splits_node_flags(splits, node, child, flags);
+            if (node_merge_flags(copy, flags) < 0) {
+                return -1;
+            }
+        }
+
+        if (merge_builtin_node(builtin, splits, child, copy) < 0) {
+            return -1;
+        }
+        child = node->next_sibling;
+    }
+
+    return 0;
+}
+
+// The prebuilt image is a trie in this very layout. Replacing the matcher
+// is just a pointer assignment; otherwise the image is merged in.
+static int trie_attach(const filter_builtin_t *builtin, int replace) {
+    if (replace) {
+        arena_destroy(&trie_arena);
+        splits_destroy(&trie_splits);
+        arena_attach_readonly(&trie_arena, builtin->chunks, builtin->num_chunks, builtin->num_nodes);
+        splits_attach_readonly(&trie_splits, builtin->splits, builtin->split_capacity);
+        return 0;
+    }
+
+    filter_splits_t splits;
+    splits_attach_readonly(&splits, builtin->splits, builtin->split_capacity);
+    if (trie_prepare() < 0 || merge_builtin_node(builtin, &splits, ARENA_NODE_NONE, ARENA_NODE_NONE) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Write the trie as C source for a prebuilt image. Node indices are kept,
+// so the image is the arena chunks verbatim.
+static int trie_serialize(FILE *out) {
+    uint32_t rules = 0;
+    uint8_t categories = 0;
+
+    fprintf(out, "// Generated by filter_compile. Do not edit.\n");
+    fprintf(out, "#include \"filter_builtin.h\"\n");
+
+    for (uint32_t c = 0; c < trie_arena.num_chunks; c++) {
+        uint32_t first = c << ARENA_CHUNK_SHIFT;
+        uint32_t end = first + ARENA_CHUNK_NODES;
+        if (end > trie_arena.used) {
+            end = trie_arena.used;
+        }
+
+        fprintf(out, "\nstatic const filter_node_t builtin_chunk_%u[] = {\n", c);
+        for (uint32_t i = first; i < end; i++) {
+            const filter_node_t *node = arena_node(&trie_arena, i);
+            fprintf(out, "    {%u, %u, %u, %u, %u, 0},\n", node->first_child,
+                    node->next_sibling, node->ch, node->flags, node->categories);
+            if (node->flags != 0) {
+                rules++;
+                categories |= node->categories;
+            }
+        }
+        fprintf(out, "};\n");
+    }
+
+    fprintf(out, "\nstatic const filter_node_t *const builtin_chunks[] = {\n");
+    for (uint32_t c = 0; c < trie_arena.num_chunks; c++) {
+        fprintf(out, "    builtin_chunk_%u,\n", c);
+    }
+    fprintf(out, "};\n");
+
+    // The split table is written slot for slot, so it is used in place too
+    if (trie_splits.used > 0) {
+        fprintf(out, "\nstatic const filter_split_t builtin_splits[] = {\n");
+        for (uint32_t i = 0; i < trie_splits.capacity; i++) {
+            const filter_split_t *split = &trie_splits.entries[i];
+            fprintf(out, "    {%u, {", split->node);
+            for (int c = 0; c < FILTER_CATEGORY_BITS; c++) {
+                fprintf(out, c == 0 ? "%u" : ", %u", split->flags[c]);
+            }
+            fprintf(out, "}},\n");
+        }
+        fprintf(out, "};\n");
+    }
+
+    fprintf(out, "\nconst filter_builtin_t filter_builtin = {\n");
+    fprintf(out, "    builtin_chunks, %u, %u, %u, 0x%02x, %s, %u\n", trie_arena.num_chunks,
+            trie_arena.used, rules, categories, trie_splits.used > 0 ? "builtin_splits" : "NULL",
+            trie_splits.used > 0 ? trie_splits.capacity : 0);
+    fprintf(out, "};\n");
+
+    return ferror(out) ? -1 : 0;
+}
+
+const filter_backend_t filter_backend_trie = {
+        .name = "trie",
+        .init = trie_init,
+        .destroy = trie_destroy,
+        .prepare = trie_prepare,
+        .add = trie_add,
+        .lookup = trie_lookup,
+        .lookup_batch = trie_lookup_batch,
+        .is_empty = trie_is_empty,
+        .get_stats = trie_get_stats,
+        .attach = trie_attach,
+        .serialize = trie_serialize,
+};
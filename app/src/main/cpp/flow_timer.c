@@ -0,0 +1,105 @@
+// flow_timer.c
+#include "include/flow_timer.h"
+
+#define MAX_DELTA ((1ull << (FLOW_WHEEL_BITS * FLOW_WHEEL_LEVELS)) - 1)
+
+static void list_init(flow_timer_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_add(flow_timer_t *head, flow_timer_t *timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+// Put a timer in the slot matching its distance from the current tick
+static void enqueue(flow_wheel_t *wheel, flow_timer_t *timer) {
+    uint64_t delta = timer->expires - wheel->tick;
+    int level = 0;
+
+    while (level < FLOW_WHEEL_LEVELS - 1 && delta >= (1ull << (FLOW_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    uint64_t slot = (timer->expires >> (FLOW_WHEEL_BITS * level)) & FLOW_WHEEL_MASK;
+    list_add(&wheel->slots[level][slot], timer);
+}
+
+void flow_wheel_init(flow_wheel_t *wheel, uint64_t now_ms) {
+    for (int level = 0; level < FLOW_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < FLOW_WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->tick = now_ms / FLOW_WHEEL_TICK_MS;
+}
+
+void flow_timer_init(flow_timer_t *timer) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+}
+
+void flow_timer_cancel(flow_timer_t *timer) {
+    if (timer->next != NULL) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->next = NULL;
+        timer->prev = NULL;
+    }
+}
+
+// Arm or re-arm. Fires on the first tick at least delay_ms from now.
+void flow_timer_arm(flow_wheel_t *wheel, flow_timer_t *timer, uint64_t delay_ms) {
+    uint64_t ticks = (delay_ms + FLOW_WHEEL_TICK_MS - 1) / FLOW_WHEEL_TICK_MS;
+    if (ticks == 0) {
+        ticks = 1;
+    } else if (ticks > MAX_DELTA) {
+        ticks = MAX_DELTA;
+    }
+
+    flow_timer_cancel(timer);
+    timer->expires = wheel->tick + ticks;
+    enqueue(wheel, timer);
+}
+
+// Move the timers of one upper-level slot down now that its turn has come
+static void cascade(flow_wheel_t *wheel, int level) {
+    uint64_t slot = (wheel->tick >> (FLOW_WHEEL_BITS * level)) & FLOW_WHEEL_MASK;
+    flow_timer_t *head = &wheel->slots[level][slot];
+    flow_timer_t *timer = head->next;
+
+    list_init(head);
+    while (timer != head) {
+        flow_timer_t *next = timer->next;
+        enqueue(wheel, timer);
+        timer = next;
+    }
+}
+
+// Run every timer due up to now_ms. The callback may re-arm or cancel the
+// fired timer and arm others, but must not cancel other pending timers.
+void flow_wheel_advance(flow_wheel_t *wheel, uint64_t now_ms, flow_timer_fn fn, void *ctx) {
+    uint64_t target = now_ms / FLOW_WHEEL_TICK_MS;
+
+    while (wheel->tick < target) {
+        wheel->tick++;
+
+        // At a level boundary, redistribute the next upper-level slot
+        for (int level = FLOW_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((wheel->tick & ((1ull << (FLOW_WHEEL_BITS * level)) - 1)) == 0) {
+                cascade(wheel, level);
+            }
+        }
+
+        flow_timer_t *head = &wheel->slots[0][wheel->tick & FLOW_WHEEL_MASK];
+        while (head->next != head) {
+            flow_timer_t *timer = head->next;
+            flow_timer_cancel(timer);
+            fn(timer, ctx);
+        }
+    }
+}
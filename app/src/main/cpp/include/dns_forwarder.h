@@ -0,0 +1,65 @@
+// dns_forwarder.h
+#ifndef DNS_FORWARDER_H
+#define DNS_FORWARDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Forwards all port-53 queries over a few shared upstream sockets. Each query
+// gets a fully random transaction ID, looked up in a table to find the
+// pending query, and the answer is routed back to the client's original
+// addresses and ID. The sockets are replaced one at a time every
+// DNS_FORWARD_ROTATE_MS, so their source ports do not stay fixed for the
+// session. Used from the packet thread only.
+#define DNS_FORWARD_SOCKETS     4
+#define DNS_FORWARD_PENDING     1024
+#define DNS_FORWARD_TIMEOUT_MS  5000
+#define DNS_FORWARD_ROTATE_MS   30000
+
+typedef struct {
+    uint64_t queries;
+    uint64_t answers;
+    uint64_t timeouts;
+    uint64_t dropped;       // Table full, send errors or unmatched answers
+    uint64_t rotations;     // Upstream sockets replaced
+} dns_forwarder_stats_t;
+
+// Take ownership of already protected UDP sockets
+int dns_forwarder_start(const int *fds, int count, uint64_t now_ms);
+void dns_forwarder_stop();
+
+// Upstream sockets to poll for answers. Returns the number written to fds.
+int dns_forwarder_fds(int *fds, int max);
+
+// Forward an IPv4/UDP query packet. Returns 0 if sent, -1 if dropped.
+int dns_forwarder_query(const void *packet, size_t len);
+
+// Read one answer from fd and build the IPv4/UDP packet for the client into
+// out. Returns the packet length, 0 if the datagram was dropped, or -1 once
+// the socket has nothing more to read.
+int dns_forwarder_receive(int fd, void *out, size_t size);
+
+// Drop queries that have not been answered in time
+void dns_forwarder_expire(uint64_t now_ms);
+
+// A socket due for replacement takes no new queries. Once its queries are
+// answered or expired, this returns its index in dns_forwarder_fds();
+// otherwise -1.
+int dns_forwarder_retiring(uint64_t now_ms);
+
+// Replace the upstream socket at index with the protected socket fd and
+// close the old one. With fd < 0, or if fd cannot be bound, the old socket
+// stays in use until the next rotation. Returns -1 in that case.
+int dns_forwarder_replace(int index, int fd, uint64_t now_ms);
+
+void dns_forwarder_get_stats(dns_forwarder_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DNS_FORWARDER_H
@@ -2,8 +2,11 @@
 #ifndef DOMAINFILTER_H
 #define DOMAINFILTER_H
 
+#ifndef DOMAINFILTER_NO_JNI
 #include <jni.h>
+#endif
 #include <stddef.h> // for size_t
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,20 +14,75 @@ extern "C" {
 
 // Domain extraction
 int extract_domain_from_packet(const void *packet, size_t len, char *domain, size_t domain_size);
+// The same for the first bytes of a TCP stream to dst_port, reassembled
+// from several segments. Returns 0 while the request or ClientHello is
+// still incomplete, and -1 once it is complete without a name.
+int extract_domain_from_stream(const void *data, size_t len, uint16_t dst_port, char *domain, size_t domain_size);
+
+// Matcher memory statistics
+typedef struct {
+    uint64_t nodes;          // Trie nodes in use
+    uint64_t node_capacity;  // Node slots mapped by the arena
+    uint64_t bytes_used;
+    uint64_t bytes_reserved;
+    uint64_t bytes_shared;   // Prebuilt lists used in place from the library
+    uint64_t chunks;         // Arena chunks mapped
+    uint32_t fragmentation;  // Reserved-but-unused share, in per mille
+    uint64_t regex_rules;
+    uint64_t regex_cache_bytes;    // Memory held by the lazily built regex DFA
+    uint64_t regex_cache_flushes;  // Times the DFA hit its memory cap
+    uint32_t backend;        // FILTER_BACKEND_* in use
+} filter_stats_t;
+
+// What the loads of one list contributed. Rules covered by a parent domain
+// rule of the same list, or repeated within a load, never reach the matcher.
+typedef struct {
+    uint64_t rules;          // Supported rules read
+    uint64_t added;          // Rules that reached the matcher
+    uint64_t duplicates;     // Merged with a rule for the same name
+    uint64_t redundant;      // Covered by a parent domain rule
+    uint64_t unsupported;
+} filter_list_stats_t;
+
+// Domain rule matchers, see filter_backend.h
+#define FILTER_BACKEND_TRIE 0   // Character trie, smallest for large lists
+#define FILTER_BACKEND_HASH 1   // Hashed label suffixes, one probe per label
+
+// Rule categories, one per list. Bits 0-2 match FilterManager's default lists.
+#define FILTER_CATEGORY_ADVERTISING 0x01
+#define FILTER_CATEGORY_TRACKING    0x02
+#define FILTER_CATEGORY_MALWARE     0x04
+#define FILTER_CATEGORY_CUSTOM      0x80
 
 // Domain filtering
 void filter_init();
+int filter_init_backend(int backend);
 void filter_cleanup();
 void filter_add_domain(const char *domain);
+int filter_add_rule(const char *rule);
+int filter_add_domains(const char *const *domains, const size_t *lengths, size_t n);
+int filter_add_domains_packed(const char *data, size_t len);
 int filter_load_file(const char *filename);
+int filter_load_list(const char *filename, uint8_t category);
+int filter_load_buffer(const char *data, size_t len);
+int filter_load_list_buffer(const char *data, size_t len, uint8_t category);
+int filter_reload_lists(const char *const *filenames, const uint8_t *categories, size_t n);
+int filter_use_builtin(uint8_t categories);
+void filter_set_categories(uint8_t categories);
 int filter_check_domain(const char *domain);
+int filter_check_domain_categories(const char *domain, uint8_t *categories);
+void filter_check_domains(const char **domains, size_t n, uint8_t *out);
+void filter_get_stats(filter_stats_t *stats);
+int filter_get_list_stats(uint8_t category, filter_list_stats_t *stats);
+void filter_set_regex_cache_limit(size_t bytes);
 
+#ifndef DOMAINFILTER_NO_JNI
 // JNI functions for VPN service
 JNIEXPORT void JNICALL
 Java_com_example_domainfilter_FilterVpnService_jniInit(JNIEnv *env, jobject thiz);
 
 JNIEXPORT void JNICALL
-Java_com_example_domainfilter_FilterVpnService_jniStart(JNIEnv *env, jobject thiz, jint fd);
+Java_com_example_domainfilter_FilterVpnService_jniStart(JNIEnv *env, jobject thiz, jint fd, jint mtu);
 
 JNIEXPORT void JNICALL
 Java_com_example_domainfilter_FilterVpnService_jniStop(JNIEnv *env, jobject thiz);
@@ -32,10 +90,46 @@ Java_com_example_domainfilter_FilterVpnService_jniStop(JNIEnv *env, jobject thiz
 JNIEXPORT jint JNICALL
 Java_com_example_domainfilter_FilterVpnService_jniGetFilteredCount(JNIEnv *env, jobject thiz);
 
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetConnectStats(JNIEnv *env, jobject thiz);
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetTunStats(JNIEnv *env, jobject thiz);
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetSocketPoolStats(JNIEnv *env, jobject thiz);
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetDnsStats(JNIEnv *env, jobject thiz);
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetUringStats(JNIEnv *env, jobject thiz);
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniGetPacketPoolStats(JNIEnv *env, jobject thiz);
+
+JNIEXPORT void JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniSetSocketPool(JNIEnv *env, jobject thiz, jint low, jint high);
+
+JNIEXPORT void JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniSetRejectCategories(JNIEnv *env, jobject thiz, jint categories);
+
+JNIEXPORT void JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniSetLazyConnect(JNIEnv *env, jobject thiz, jboolean enabled);
+
+JNIEXPORT void JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniSetTracing(JNIEnv *env, jobject thiz, jint sampleRate);
+
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_FilterVpnService_jniDumpTrace(JNIEnv *env, jobject thiz, jstring filePath);
+
 // JNI functions for filter manager
 JNIEXPORT void JNICALL
 Java_com_example_domainfilter_util_FilterManager_jniInitFilter(JNIEnv *env, jobject thiz);
 
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniInitFilterBackend(JNIEnv *env, jobject thiz, jint backend);
+
 JNIEXPORT void JNICALL
 Java_com_example_domainfilter_util_FilterManager_jniAddDomain(JNIEnv *env, jobject thiz, jstring domain);
 
@@ -45,6 +139,31 @@ Java_com_example_domainfilter_util_FilterManager_jniLoadFilterFile(JNIEnv *env,
 JNIEXPORT jboolean JNICALL
 Java_com_example_domainfilter_util_FilterManager_jniCheckDomain(JNIEnv *env, jobject thiz, jstring domain);
 
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniGetFilterStats(JNIEnv *env, jobject thiz);
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniGetListStats(JNIEnv *env, jobject thiz, jint category);
+
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniUseBuiltinFilters(JNIEnv *env, jobject thiz, jint categories);
+
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniLoadFilterBuffer(JNIEnv *env, jobject thiz, jobject buffer, jint length);
+
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniLoadFilterAsset(JNIEnv *env, jobject thiz, jobject assetManager, jstring path, jint category);
+
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniAddDomains(JNIEnv *env, jobject thiz, jobjectArray domains);
+
+JNIEXPORT jint JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniAddDomainsBuffer(JNIEnv *env, jobject thiz, jobject buffer, jint length);
+
+JNIEXPORT jbyteArray JNICALL
+Java_com_example_domainfilter_util_FilterManager_jniCheckDomains(JNIEnv *env, jobject thiz, jobjectArray domains);
+#endif // DOMAINFILTER_NO_JNI
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,104 @@
+// filter_arena.h
+#ifndef FILTER_ARENA_H
+#define FILTER_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "filter_rules.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Nodes are allocated in fixed-size chunks and addressed by a 32-bit index:
+// the upper bits select the chunk, the lower ARENA_CHUNK_SHIFT bits the slot.
+#define ARENA_CHUNK_SHIFT 14
+#define ARENA_CHUNK_NODES (1u << ARENA_CHUNK_SHIFT)
+#define ARENA_CHUNK_MASK  (ARENA_CHUNK_NODES - 1)
+
+// Index 0 is always the root, so it doubles as the "no node" value for links
+#define ARENA_NODE_NONE    0u
+#define ARENA_NODE_INVALID UINT32_MAX
+
+// Matcher trie node (12 bytes). Children form a singly linked sibling list.
+typedef struct {
+    uint32_t first_child;   // Index of the first child, ARENA_NODE_NONE if leaf
+    uint32_t next_sibling;  // Index of the next sibling, ARENA_NODE_NONE if last
+    uint8_t ch;             // Character on the edge leading to this node
+    uint8_t flags;          // FILTER_NODE_* actions of rules ending here
+    uint8_t categories;     // FILTER_CATEGORY_* lists the rules came from
+    uint8_t reserved;
+} filter_node_t;
+
+// Set in the flags of a node whose lists disagree. Its flags and categories
+// then only summarize the rules; the per-category flags are in the split
+// table. Nodes where every list has the same rules need no entry.
+#define FILTER_NODE_SPLIT 0x80
+
+// Split table entry, open addressing by node index. The root never holds
+// rules, so node 0 marks a free slot.
+typedef struct {
+    uint32_t node;
+    uint8_t flags[FILTER_CATEGORY_BITS];  // FILTER_NODE_* actions per category bit
+} filter_split_t;
+
+typedef struct {
+    filter_split_t *entries;
+    uint32_t capacity;      // Power of two, 0 while empty
+    uint32_t used;
+    uint8_t readonly;       // Entries belong to a prebuilt image
+} filter_splits_t;
+
+typedef struct {
+    filter_node_t **chunks; // Chunk table, each entry maps ARENA_CHUNK_NODES nodes
+    uint32_t num_chunks;    // Chunks currently mapped
+    uint32_t max_chunks;    // Capacity of the chunk table
+    uint32_t used;          // Next free node index (bump pointer)
+    uint8_t readonly;       // Chunks belong to a prebuilt image, not to the arena
+} filter_arena_t;
+
+typedef struct {
+    uint64_t nodes_used;
+    uint64_t nodes_capacity;
+    uint64_t bytes_used;      // Bytes occupied by live nodes
+    uint64_t bytes_reserved;  // Bytes mapped for chunks plus the chunk table
+    uint64_t bytes_shared;    // Bytes of a prebuilt read-only image in use
+    uint64_t chunks;
+    uint32_t fragmentation;   // Reserved-but-unused share, in per mille
+} filter_arena_stats_t;
+
+int arena_init(filter_arena_t *arena);
+void arena_destroy(filter_arena_t *arena);
+uint32_t arena_alloc(filter_arena_t *arena);
+void arena_get_stats(const filter_arena_t *arena, filter_arena_stats_t *stats);
+
+// Point the arena at prebuilt read-only nodes. No memory is allocated; the
+// first write copies the nodes into arena chunks (arena_make_writable).
+void arena_attach_readonly(filter_arena_t *arena, const filter_node_t *const *chunks,
+                           uint32_t num_chunks, uint32_t num_nodes);
+int arena_make_writable(filter_arena_t *arena);
+
+void splits_destroy(filter_splits_t *splits);
+void splits_attach_readonly(filter_splits_t *splits, const filter_split_t *entries, uint32_t capacity);
+int splits_make_writable(filter_splits_t *splits);
+
+// Per-category flags of a split node, NULL if the node has none
+const uint8_t *splits_find(const filter_splits_t *splits, uint32_t node);
+
+// Store the per-category flags of a node. Returns -1 if memory runs out.
+int splits_set(filter_splits_t *splits, uint32_t node, const uint8_t *flags);
+
+// Expand the flags of a node, split or not, to one byte per category bit
+void splits_node_flags(const filter_splits_t *splits, const filter_node_t *node, uint32_t index,
+                       uint8_t *flags);
+
+// Resolve a node index to its storage
+static inline filter_node_t *arena_node(const filter_arena_t *arena, uint32_t index) {
+    return &arena->chunks[index >> ARENA_CHUNK_SHIFT][index & ARENA_CHUNK_MASK];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILTER_ARENA_H
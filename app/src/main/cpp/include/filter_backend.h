@@ -0,0 +1,59 @@
+// filter_backend.h
+#ifndef FILTER_BACKEND_H
+#define FILTER_BACKEND_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "filter_builtin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Memory usage of a matcher backend
+typedef struct {
+    uint64_t entries;         // Nodes or rule slots in use
+    uint64_t capacity;        // Slots allocated
+    uint64_t bytes_used;
+    uint64_t bytes_reserved;
+    uint64_t bytes_shared;    // Prebuilt data used in place
+    uint64_t chunks;
+    uint32_t fragmentation;   // Reserved-but-unused share, in per mille
+} filter_backend_stats_t;
+
+// A domain rule matcher. Rules and queries are given as reversed domains
+// (com.example.ads); lookups return the FILTER_ACTION_* bits of every rule
+// that applies in one of the enabled categories. A rule applies to its own
+// name and to names below it at a label boundary: example.com covers
+// ads.example.com but not examples.com, and com covers example.com but
+// not example.community. Backends keep their state
+// in file statics and are driven by domain_filter.c under filter_mutex.
+typedef struct {
+    const char *name;
+    int (*init)();
+    void (*destroy)();
+    int (*prepare)();           // Make the matcher writable before adds
+    int (*add)(const char *reversed, size_t len, uint8_t flags, uint8_t category);
+    uint8_t (*lookup)(const char *reversed, size_t len, uint8_t categories);
+    // Optional: lookup() for n names at once, actions[i] for reversed[i].
+    // Without it each name is looked up in turn.
+    void (*lookup_batch)(const char *const *reversed, const size_t *lens, size_t n, uint8_t categories,
+                         uint8_t *actions);
+    int (*is_empty)();
+    void (*get_stats)(filter_backend_stats_t *stats);
+    // Optional: use or merge a prebuilt image directly. Without it the
+    // image's rules are added one by one.
+    int (*attach)(const filter_builtin_t *builtin, int replace);
+    // Optional: write the matcher as C source defining filter_builtin
+    int (*serialize)(FILE *out);
+} filter_backend_t;
+
+extern const filter_backend_t filter_backend_trie;
+extern const filter_backend_t filter_backend_hash;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILTER_BACKEND_H
@@ -0,0 +1,52 @@
+// filter_batch.h
+#ifndef FILTER_BATCH_H
+#define FILTER_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Domain rules of one bulk load, collected before any reaches the matcher.
+// Sorting by reversed name puts every parent domain ahead of its
+// subdomains and repeated names next to each other, so duplicates can be
+// merged and covered rules dropped in one pass.
+typedef struct {
+    const char *reversed;   // Into the batch's name buffer
+    uint32_t offset;
+    uint16_t len;
+    uint8_t flags;          // FILTER_NODE_* actions
+} filter_batch_rule_t;
+
+typedef struct {
+    char *names;
+    size_t names_len;
+    size_t names_capacity;
+    filter_batch_rule_t *rules;
+    size_t count;
+    size_t capacity;
+} filter_batch_t;
+
+void filter_batch_init(filter_batch_t *batch);
+void filter_batch_destroy(filter_batch_t *batch);
+
+// Append a rule for a reversed domain name. Returns -1 if out of memory.
+int filter_batch_add(filter_batch_t *batch, const char *reversed, size_t len, uint8_t flags);
+
+// Sort the rules and merge those for the same name, dropping subdomain-only
+// actions the name's own rule already covers. Returns the number of rules
+// merged away.
+size_t filter_batch_sort(filter_batch_t *batch);
+
+// Nonzero if a rule with these actions can change no verdict where actions
+// covered already apply: an action only matters if nothing of equal or
+// higher priority is present (block < exception < $important)
+int filter_actions_covered(uint8_t covered, uint8_t actions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILTER_BATCH_H
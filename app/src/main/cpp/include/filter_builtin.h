@@ -0,0 +1,41 @@
+// filter_builtin.h
+#ifndef FILTER_BUILTIN_H
+#define FILTER_BUILTIN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "filter_arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A matcher trie prebuilt from the default lists at build time. The nodes
+// are const data in the library, so activating it costs no parsing and no
+// heap, and its pages are shared with every process mapping the library.
+typedef struct {
+    const filter_node_t *const *chunks;
+    uint32_t num_chunks;
+    uint32_t num_nodes;
+    uint32_t num_rules;
+    uint8_t categories;     // FILTER_CATEGORY_* present in the image
+    const filter_split_t *splits;   // Split table of the image, NULL if none
+    uint32_t split_capacity;
+} filter_builtin_t;
+
+// Generated by tools/filter_compile from src/main/assets/filters
+extern const filter_builtin_t filter_builtin;
+
+// Make a prebuilt image the active matcher, or merge it into the rules
+// already loaded. Returns the number of rules in the image.
+int filter_attach_builtin(const filter_builtin_t *builtin);
+
+// Write the current matcher as C source defining filter_builtin.
+// Returns -1 if it holds rules that cannot be prebuilt (regex rules).
+int filter_write_builtin_source(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILTER_BUILTIN_H
@@ -0,0 +1,42 @@
+// filter_ipset.h
+#ifndef FILTER_IPSET_H
+#define FILTER_IPSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Addresses learned from DNS answers for blocked names, with the lists
+// (FILTER_CATEGORY_*) that blocked them. Lookups are lock-free and touch a
+// single cache line; entries expire with the record TTL, capped at
+// IPSET_MAX_TTL because an address is often shared (CDNs, hosting) and
+// every other name on it is blocked while the entry lives.
+#define IPSET_BUCKETS   1024    // Power of two, one cache line each
+#define IPSET_WAYS      2       // Entries per bucket
+#define IPSET_MIN_TTL   30      // Seconds, short TTLs would let a flow slip through
+#define IPSET_MAX_TTL   300
+
+// Addresses are 16 bytes; IPv4 is stored IPv4-mapped (::ffff:a.b.c.d)
+void ipset_clear();
+void ipset_add(const uint8_t addr[16], uint32_t ttl, uint8_t categories);
+void ipset_remove(const uint8_t addr[16]);
+
+// The lists that blocked a learned address, 0 if it is not in the set
+uint8_t ipset_contains(const uint8_t addr[16]);
+uint8_t ipset_contains_v4(uint32_t addr);   // Network byte order
+uint32_t ipset_count();
+
+// Parse an upstream DNS response. If the query name or a CNAME in the
+// answer chain is blocked its A/AAAA records are learned; otherwise they
+// serve an allowed name and are forgotten if they were learned before.
+// Returns addresses learned.
+int ipset_learn_dns_response(const uint8_t *dns, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILTER_IPSET_H
@@ -0,0 +1,72 @@
+// filter_regex.h
+#ifndef FILTER_REGEX_H
+#define FILTER_REGEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Default memory budget for cached DFA states
+#define REGEX_DEFAULT_CACHE_LIMIT (512 * 1024)
+
+typedef struct regex_dfa_state regex_dfa_state_t;
+
+// All regex rules compiled into one NFA. A DFA over it is built lazily
+// while matching and flushed whenever it outgrows cache_limit.
+typedef struct {
+    // NFA
+    struct regex_nfa_state *states;
+    uint32_t num_states;
+    uint32_t max_states;
+    uint32_t root;            // Split over every rule, entered at each position
+    uint32_t num_rules;
+
+    // Character sets used by NFA_CHAR states, and the byte classes they induce
+    uint32_t (*sets)[8];
+    uint32_t num_sets;
+    uint32_t max_sets;
+    uint8_t byte_class[256];
+    uint8_t class_rep[256];   // One representative byte per class
+    uint32_t num_classes;
+    uint8_t dirty;            // Rules changed since classes/scratch were sized
+
+    // Lazy DFA cache
+    regex_dfa_state_t **dfa_states;
+    uint32_t num_dfa_states;
+    uint32_t max_dfa_states;
+    regex_dfa_state_t **dfa_buckets;
+    uint32_t num_dfa_buckets;
+    regex_dfa_state_t *dfa_start;
+    size_t cache_bytes;
+    size_t cache_limit;
+    uint64_t cache_flushes;
+
+    // Scratch space for closures
+    uint32_t *mark;
+    uint32_t mark_gen;
+    uint32_t *stack;
+    uint32_t *set_a;
+    uint32_t *set_b;
+    uint32_t *set_c;
+} filter_regex_t;
+
+void regex_init(filter_regex_t *re);
+void regex_destroy(filter_regex_t *re);
+
+// Compile a rule and add it to the combined automaton. Returns 0 or -1.
+int regex_add(filter_regex_t *re, const char *pattern, size_t len, uint8_t actions);
+
+// Match text against every rule, returns the union of matched actions
+uint8_t regex_match(filter_regex_t *re, const char *text, size_t len);
+
+// Cap the lazy DFA cache. The cache is flushed when it outgrows the limit.
+void regex_set_cache_limit(filter_regex_t *re, size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILTER_REGEX_H
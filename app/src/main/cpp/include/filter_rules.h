@@ -0,0 +1,69 @@
+// filter_rules.h
+#ifndef FILTER_RULES_H
+#define FILTER_RULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Rule actions, in increasing priority: an exception overrides a block,
+// an $important block overrides an exception.
+#define FILTER_ACTION_BLOCK     0x01
+#define FILTER_ACTION_ALLOW     0x02
+#define FILTER_ACTION_IMPORTANT 0x04
+#define FILTER_ACTION_MASK      0x07
+
+// Trie node flags: the low bits hold actions for the domain and its
+// subdomains, the high bits actions for subdomains only (*.example.com).
+#define FILTER_NODE_SUBDOMAIN_SHIFT 3
+#define FILTER_NODE_SUBDOMAINS(actions) ((uint8_t)((actions) << FILTER_NODE_SUBDOMAIN_SHIFT))
+
+// Lists can disagree about a name, so backends keep node flags per
+// category: byte i holds the flags of rules from category bit i.
+#define FILTER_CATEGORY_BITS 8
+
+// Parsed rule types
+#define FILTER_RULE_DOMAIN 1
+#define FILTER_RULE_REGEX  2
+
+typedef struct {
+    int type;             // FILTER_RULE_DOMAIN or FILTER_RULE_REGEX
+    uint8_t flags;        // Node flags for domain rules, actions for regex rules
+    const char *pattern;  // Domain or regex body, points into the parsed line
+    size_t pattern_len;
+} filter_rule_t;
+
+// Parse one list line in plain, hosts or adblock syntax.
+// Returns 1 for a rule, 0 for blank lines and comments, -1 if unsupported.
+int filter_parse_rule(const char *line, size_t len, filter_rule_t *rule);
+
+// Merge the node flags of the enabled categories
+static inline uint8_t filter_category_flags(const uint8_t *flags, uint8_t categories) {
+    uint8_t result = 0;
+    for (int i = 0; i < FILTER_CATEGORY_BITS; i++) {
+        if (categories & (1u << i)) {
+            result |= flags[i];
+        }
+    }
+    return result;
+}
+
+// Pick the winning action from a set of matched actions
+static inline int filter_resolve_actions(uint8_t actions) {
+    if (actions & FILTER_ACTION_IMPORTANT) {
+        return 1;
+    }
+    if (actions & FILTER_ACTION_ALLOW) {
+        return 0;
+    }
+    return (actions & FILTER_ACTION_BLOCK) != 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILTER_RULES_H
@@ -0,0 +1,54 @@
+// flow_timer.h
+#ifndef FLOW_TIMER_H
+#define FLOW_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hierarchical timer wheel. Each level has FLOW_WHEEL_SLOTS slots and each
+// slot of a level spans a whole turn of the level below, so arming, re-arming
+// and cancelling are O(1) and expiry only touches timers that are due.
+#define FLOW_WHEEL_TICK_MS  100
+#define FLOW_WHEEL_BITS     6
+#define FLOW_WHEEL_SLOTS    (1 << FLOW_WHEEL_BITS)
+#define FLOW_WHEEL_MASK     (FLOW_WHEEL_SLOTS - 1)
+#define FLOW_WHEEL_LEVELS   4   // 6.4 s, 6.8 min, 7.3 h, 19 days at 100 ms ticks
+
+// Embedded in the object being timed, see flow_timer_entry()
+typedef struct flow_timer {
+    struct flow_timer *next;
+    struct flow_timer *prev;
+    uint64_t expires;           // Tick at which the timer fires
+} flow_timer_t;
+
+typedef struct {
+    flow_timer_t slots[FLOW_WHEEL_LEVELS][FLOW_WHEEL_SLOTS];   // List heads
+    uint64_t tick;              // Last tick processed
+} flow_wheel_t;
+
+typedef void (*flow_timer_fn)(flow_timer_t *timer, void *ctx);
+
+// Get the structure a timer is embedded in
+#define flow_timer_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void flow_wheel_init(flow_wheel_t *wheel, uint64_t now_ms);
+void flow_wheel_advance(flow_wheel_t *wheel, uint64_t now_ms, flow_timer_fn fn, void *ctx);
+
+void flow_timer_init(flow_timer_t *timer);
+void flow_timer_arm(flow_wheel_t *wheel, flow_timer_t *timer, uint64_t delay_ms);
+void flow_timer_cancel(flow_timer_t *timer);
+
+static inline int flow_timer_pending(const flow_timer_t *timer) {
+    return timer->next != NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FLOW_TIMER_H
@@ -0,0 +1,17 @@
+// native_log.h
+#ifndef NATIVE_LOG_H
+#define NATIVE_LOG_H
+
+// Logging for the native code. Each file defines TAG before including this.
+// Goes to logcat on Android and to stderr when built for the host.
+#ifdef __ANDROID__
+#include <android/log.h>
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#else
+#include <stdio.h>
+#define LOGI(fmt, ...) fprintf(stderr, "I/%s: " fmt "\n", TAG, ##__VA_ARGS__)
+#define LOGE(fmt, ...) fprintf(stderr, "E/%s: " fmt "\n", TAG, ##__VA_ARGS__)
+#endif
+
+#endif // NATIVE_LOG_H
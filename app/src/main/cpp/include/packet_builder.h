@@ -0,0 +1,53 @@
+// packet_builder.h
+#ifndef PACKET_BUILDER_H
+#define PACKET_BUILDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PACKET_IPV4_HEADER  20
+#define PACKET_UDP_HEADER   8
+#define PACKET_TCP_HEADER   20
+#define PACKET_ICMP_HEADER  8
+
+// Largest packet_build_icmp_unreach4() writes: an options-laden header and
+// 8 bytes of payload quoted
+#define PACKET_ICMP_UNREACH_MAX (PACKET_IPV4_HEADER + PACKET_ICMP_HEADER + 60 + 8)
+
+// Internet checksum over data, continuing from a partial sum
+uint32_t packet_checksum_add(uint32_t sum, const void *data, size_t len);
+uint16_t packet_checksum_fold(uint32_t sum);
+
+// Build an IPv4/UDP packet with valid checksums into out. Addresses are in
+// network byte order, ports in host order. Returns the packet length, or -1
+// if it does not fit.
+int packet_build_udp4(void *out, size_t size, uint32_t src_ip, uint16_t src_port,
+                      uint32_t dst_ip, uint16_t dst_port, const void *payload, size_t payload_len);
+
+// Build an IPv4/TCP segment without payload. flags are TH_* bits, and a
+// nonzero mss adds an MSS option for a SYN. Addresses are in network byte
+// order, ports and sequence numbers in host order. Returns the packet
+// length, or -1 if it does not fit.
+int packet_build_tcp4(void *out, size_t size, uint32_t src_ip, uint16_t src_port, uint32_t dst_ip,
+                      uint16_t dst_port, uint32_t seq, uint32_t ack, uint8_t flags, uint16_t mss);
+
+// Build the TCP reset that the destination of an IPv4/TCP segment would send
+// back if nothing listened there. Returns the packet length, or -1 if the
+// segment is not IPv4/TCP, is itself a reset, or the answer does not fit.
+int packet_build_tcp_reset4(void *out, size_t size, const void *segment, size_t len);
+
+// Build an ICMP destination unreachable with the given code (ICMP_PORT_UNREACH,
+// ...) answering an IPv4 packet, sent from the packet's destination. Returns
+// the packet length, or -1 if the packet is not IPv4, is ICMP, or the answer
+// does not fit.
+int packet_build_icmp_unreach4(void *out, size_t size, const void *packet, size_t len, uint8_t code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PACKET_BUILDER_H
@@ -0,0 +1,76 @@
+// packet_pool.h
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Packet buffers shared by the pipeline stages. All buffers live in one
+// arena sized for the interface MTU, and descriptors are reference counted,
+// so a packet can wait in a flow queue or in flight to the kernel while the
+// stage that read it moves on. Each thread caches a few free buffers and
+// only takes the pool lock to refill or flush its cache in batches.
+#define PACKET_POOL_BUFFERS     1024
+#define PACKET_POOL_HEADROOM    64      // Room to prepend IP and TCP/UDP headers
+#define PACKET_POOL_CACHE       32      // Free buffers kept per thread
+#define PACKET_POOL_DEFAULT_MTU 1500
+
+typedef struct packet_buf {
+    struct packet_buf *next;    // Queue link, owned by whoever queued the packet
+    unsigned char *data;        // Start of the packet
+    uint32_t len;
+    uint32_t capacity;          // Bytes usable from data on
+    uint32_t refs;
+    uint32_t index;             // Position in the arena
+    uint32_t trace;             // Trace id from packet_trace_sample(), 0 if not sampled
+
+    // Set by packet_parse()
+    uint8_t version;            // 4 or 6, 0 if not an IP packet
+    uint8_t protocol;           // IPPROTO_TCP or IPPROTO_UDP, 0 if neither or truncated
+    uint16_t l4_offset;         // Transport header
+    uint16_t payload_offset;    // Transport payload
+    uint16_t payload_len;
+    uint16_t src_port;          // Host byte order
+    uint16_t dst_port;
+} packet_buf_t;
+
+typedef struct {
+    uint32_t buffers;
+    uint32_t buffer_size;       // Headroom included
+    uint32_t in_use;
+    uint32_t in_use_max;
+    uint64_t allocs;
+    uint64_t exhausted;         // Allocations that found the pool empty
+    uint64_t refills;           // Thread cache refills from the shared pool
+} packet_pool_stats_t;
+
+// Create the pool for an interface MTU. The pool lives for the rest of the
+// process; later calls keep the existing buffers.
+int packet_pool_init(int mtu);
+
+// A buffer with one reference and room for capacity bytes, or NULL
+packet_buf_t *packet_alloc();
+void packet_retain(packet_buf_t *packet);
+void packet_release(packet_buf_t *packet);
+
+// Move the start of the packet back by len bytes of headroom
+unsigned char *packet_push(packet_buf_t *packet, size_t len);
+
+// Locate the IP and TCP/UDP headers. Returns -1 if the packet is not IP.
+int packet_parse(packet_buf_t *packet);
+
+// Arena bounds, for registering the buffers with the kernel
+void packet_pool_arena(void **base, size_t *size);
+packet_buf_t *packet_from_index(uint32_t index);
+
+void packet_pool_get_stats(packet_pool_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PACKET_POOL_H
@@ -0,0 +1,95 @@
+// packet_trace.h
+#ifndef PACKET_TRACE_H
+#define PACKET_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sampled per-packet stage timing. One packet in every sample_rate gets a
+// trace id, and each stage it passes through records a start time and a
+// duration into a ring owned by the recording thread, so writers never
+// share a lock or a cache line. When tracing is off a stage costs one load
+// and a branch. packet_trace_dump() writes what the rings hold as Chrome
+// trace event JSON, which Perfetto and chrome://tracing open.
+#define PACKET_TRACE_EVENTS     8192    // Events kept per thread, power of two
+#define PACKET_TRACE_THREADS    8       // Threads that can record at once
+
+// Sample rate from the environment, or on Android from the system property
+// set with: adb shell setprop debug.domainfilter.trace <rate>
+#define PACKET_TRACE_ENV        "DOMAINFILTER_TRACE"
+#define PACKET_TRACE_PROPERTY   "debug.domainfilter.trace"
+
+// Pipeline stages
+enum {
+    PACKET_TRACE_PACKET = 0,    // Whole of process_packet
+    PACKET_TRACE_EXTRACT,       // extract_domain_from_packet
+    PACKET_TRACE_FILTER,        // filter_check_domain
+    PACKET_TRACE_DNS,           // Handing a query to the DNS forwarder
+    PACKET_TRACE_CONNECTION,    // find_or_create_connection
+    PACKET_TRACE_SEND,          // Upstream send, or queueing it on the ring
+    PACKET_TRACE_UPSTREAM,      // Handling data read from an upstream socket
+    PACKET_TRACE_STAGES
+};
+
+typedef struct {
+    uint32_t sample_rate;       // 0 when off
+    uint32_t threads;           // Threads that own a ring
+    uint64_t sampled;           // Packets given a trace id
+    uint64_t events;            // Stage events recorded
+    uint64_t dropped;           // Events lost for want of a ring
+} packet_trace_stats_t;
+
+// Nonzero while tracing. Read through packet_trace_sample() only.
+extern uint32_t packet_trace_rate;
+
+// Trace one packet in every sample_rate, 0 turns tracing off. Rings keep
+// their events until the next dump or until overwritten.
+void packet_trace_enable(uint32_t sample_rate);
+
+// Apply the environment variable or system property, if set
+void packet_trace_init_from_env();
+
+uint32_t packet_trace_sample_slow();
+void packet_trace_record(uint32_t id, int stage, uint64_t start_ns, uint64_t end_ns);
+
+static inline uint64_t packet_trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Trace id for a new packet, 0 if it is not sampled
+static inline uint32_t packet_trace_sample() {
+    if (__builtin_expect(__atomic_load_n(&packet_trace_rate, __ATOMIC_RELAXED) == 0, 1)) {
+        return 0;
+    }
+    return packet_trace_sample_slow();
+}
+
+// Start and end of a stage for a packet with trace id id
+static inline uint64_t packet_trace_begin(uint32_t id) {
+    return id != 0 ? packet_trace_clock() : 0;
+}
+
+static inline void packet_trace_end(uint32_t id, int stage, uint64_t start_ns) {
+    if (id != 0) {
+        packet_trace_record(id, stage, start_ns, packet_trace_clock());
+    }
+}
+
+// Write the events recorded since the last dump to path. Returns the
+// number written, 0 without touching the file if there are none, or -1.
+int packet_trace_dump(const char *path);
+
+void packet_trace_get_stats(packet_trace_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PACKET_TRACE_H
@@ -0,0 +1,46 @@
+// socket_pool.h
+#ifndef SOCKET_POOL_H
+#define SOCKET_POOL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Upstream sockets created and protected ahead of time by a background
+// thread, so setting up a flow needs no JNI transition.
+#define SOCKET_POOL_LOW_DEFAULT   8     // Refill when fewer sockets are ready
+#define SOCKET_POOL_HIGH_DEFAULT  32    // Refill up to this many per type
+#define SOCKET_POOL_MAX           256
+
+typedef struct {
+    // Protect a batch of sockets from VPN routing. Entries that could not be
+    // protected are set to -1. Returns -1 if the batch could not be handled.
+    int (*protect)(int *fds, int count, void *ctx);
+    // Called on the pool thread right before it exits
+    void (*thread_exit)(void *ctx);
+    void *ctx;
+} socket_pool_config_t;
+
+typedef struct {
+    uint32_t ready_tcp;
+    uint32_t ready_udp;
+    uint32_t low_watermark;
+    uint32_t high_watermark;
+    uint64_t taken;             // Sockets handed out from the pool
+    uint64_t misses;            // Takes that found the pool empty
+    uint64_t protect_failures;
+} socket_pool_stats_t;
+
+int socket_pool_start(const socket_pool_config_t *config);
+void socket_pool_stop();
+int socket_pool_take(int type);     // SOCK_STREAM or SOCK_DGRAM, -1 if empty
+void socket_pool_set_watermarks(int low, int high);
+void socket_pool_get_stats(socket_pool_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SOCKET_POOL_H
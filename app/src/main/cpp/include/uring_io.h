@@ -0,0 +1,85 @@
+// uring_io.h
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "packet_pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Packet I/O through io_uring: multishot receives into packet pool buffers
+// handed to the kernel through a buffer ring, fixed files for the tun fd and
+// upstream sockets, and all sends, writes and re-arms submitted in one
+// io_uring_enter per loop iteration. Needs the provided buffer rings of
+// Linux 5.19, and uses multishot receives where the kernel has them (6.0);
+// uring_io_init() fails where io_uring is missing or blocked (as it is for
+// Android apps) and callers keep using plain read/send/recv. Used from the
+// packet thread only.
+#define URING_IO_BATCH        64        // Events returned per wait
+
+// What to watch on a socket slot
+#define URING_IO_RECV         1         // Multishot recv into the buffer ring
+#define URING_IO_WRITABLE     2         // One-shot POLLOUT, for connects
+#define URING_IO_READABLE     3         // Multishot POLLIN, reads done by the caller
+
+// Event slot for packets read from the tun fd
+#define URING_IO_TUN          (-1)
+
+typedef struct {
+    int slot;               // Socket slot, or URING_IO_TUN
+    int type;               // URING_IO_* watch that fired
+    int fd;
+    int result;             // Bytes received, 0 at EOF or -errno
+    packet_buf_t *packet;   // Received bytes, held until uring_io_release()
+    uint32_t generation;
+} uring_io_event_t;
+
+typedef struct {
+    uint64_t enters;        // io_uring_enter calls
+    uint64_t received;      // Packets and payloads read
+    uint64_t sent;          // Packets and payloads written
+    uint64_t fallbacks;     // Writes done synchronously for want of a queue entry
+    uint64_t no_buffers;    // Receives that found the buffer ring empty
+    uint64_t errors;        // Failed sends and writes
+} uring_io_stats_t;
+
+// Set up a ring for the tun fd and num_slots socket slots. The packet pool
+// must exist. Returns -1 if io_uring cannot be used.
+int uring_io_init(int tun_fd, int num_slots);
+void uring_io_exit();
+
+// Install a socket in a slot and start watching it
+int uring_io_add(int slot, int fd, int watch);
+int uring_io_watch(int slot, int watch);
+
+// Cancel what is pending on a slot and drop it from the fixed file table.
+// Sends not yet issued are discarded. The caller still closes its fd.
+void uring_io_remove(int slot);
+
+// Queue len bytes at data, which lie inside packet, for a socket slot, or a
+// whole packet for the tun fd. The packet is held until the write is done.
+// Writes on one slot go out in order. Returns -1 if dropped.
+int uring_io_send(int slot, packet_buf_t *packet, const void *data, size_t len);
+int uring_io_write_tun(packet_buf_t *packet);
+
+// Submit everything queued and wait up to timeout_ms for events. A tun
+// read that failed for good comes back as a URING_IO_TUN event with a
+// negative result and no packet; the tun is no longer read after it.
+int uring_io_wait(uring_io_event_t *events, int max, int timeout_ms);
+
+// Nonzero if the event's slot was removed after the event was reaped
+int uring_io_stale(const uring_io_event_t *event);
+
+// Drop the event's reference to its packet
+void uring_io_release(const uring_io_event_t *event);
+
+void uring_io_get_stats(uring_io_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // URING_IO_H
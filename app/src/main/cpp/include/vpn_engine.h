@@ -0,0 +1,71 @@
+// vpn_engine.h
+#ifndef VPN_ENGINE_H
+#define VPN_ENGINE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The packet engine: reads packets from a tun descriptor, filters them and
+// relays allowed flows over upstream sockets. It has no JNI in it; the
+// Android service and the Linux daemon each drive it and supply the hooks
+// that keep upstream sockets out of the tunnel.
+typedef struct {
+    // Exempt a socket the engine created from the tunnel's routes. Returns
+    // -1 if it could not be, and the socket is not used. May be NULL.
+    int (*protect)(int fd, void *ctx);
+    // The same for a batch from the socket pool thread, see socket_pool.h
+    int (*protect_batch)(int *fds, int count, void *ctx);
+    // Called on the socket pool thread right before it exits. May be NULL.
+    void (*thread_exit)(void *ctx);
+    void *ctx;
+} vpn_engine_config_t;
+
+typedef struct {
+    uint64_t connects_started;
+    uint64_t connects_completed;
+    uint64_t connects_failed;
+    uint64_t connect_latency_avg_ms;
+    uint64_t connect_latency_max_ms;
+    uint64_t queued;            // Payloads held until their connect completed
+    uint64_t queue_drops;
+    uint64_t resets;            // Blocked TCP flows answered with a reset
+    uint64_t unreachables;      // Blocked UDP flows answered with ICMP
+    uint64_t deferred;          // Handshakes answered locally
+    uint64_t unconnected;       // Deferred flows closed without an upstream connect
+    uint64_t packets_in;        // Read from the tun device
+    uint64_t bytes_in;
+    uint64_t packets_out;       // Written to the tun device
+    uint64_t bytes_out;
+    uint32_t flows;             // Connection tracking entries in use
+    uint32_t filtered;          // Packets blocked
+} vpn_engine_stats_t;
+
+// Run the packet loop on the calling thread until vpn_engine_stop().
+// Flows, upstream sockets and the socket pool thread are all gone by the
+// time it returns, so the protect hooks are no longer called.
+// Returns -1 if it could not start.
+int vpn_engine_run(int tun_fd, int mtu, const vpn_engine_config_t *config);
+
+// Ask the loop to stop, from any thread. Returns at once; the loop closes
+// every flow on its own thread before vpn_engine_run() returns.
+void vpn_engine_stop();
+
+int vpn_engine_filtered_count();
+
+// Lists (FILTER_CATEGORY_*) whose blocked flows get a TCP reset or an ICMP
+// port unreachable instead of a silent drop
+void vpn_engine_set_reject_categories(uint8_t categories);
+
+// Answer HTTP and HTTPS handshakes locally until the request is filtered
+void vpn_engine_set_lazy_connect(int enabled);
+
+void vpn_engine_get_stats(vpn_engine_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VPN_ENGINE_H
@@ -0,0 +1,266 @@
+// packet_pool.c
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "include/packet_pool.h"
+
+#define TAG "PacketPool"
+#include "include/native_log.h"
+
+// Buffers moved between a thread cache and the shared pool at a time
+#define CACHE_BATCH (PACKET_POOL_CACHE / 2)
+
+typedef struct {
+    packet_buf_t *buffers[PACKET_POOL_CACHE];
+    int count;
+} packet_cache_t;
+
+static unsigned char *pool_arena = NULL;
+static size_t pool_arena_size = 0;
+static uint32_t pool_buffer_size = 0;
+static packet_buf_t pool_descriptors[PACKET_POOL_BUFFERS];
+static packet_buf_t *pool_free[PACKET_POOL_BUFFERS];
+static int pool_num_free = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters are updated with relaxed atomics from any thread
+static packet_pool_stats_t pool_stats;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread packet_cache_t thread_cache;
+static __thread int thread_cache_registered = 0;
+
+// Give count buffers of a thread cache back to the shared pool
+static void flush(packet_cache_t *cache, int count) {
+    pthread_mutex_lock(&pool_mutex);
+    while (count-- > 0 && cache->count > 0) {
+        pool_free[pool_num_free++] = cache->buffers[--cache->count];
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Take a batch from the shared pool. Returns the number taken.
+static int refill(packet_cache_t *cache) {
+    pthread_mutex_lock(&pool_mutex);
+    int count = 0;
+    while (count < CACHE_BATCH && pool_num_free > 0) {
+        cache->buffers[cache->count++] = pool_free[--pool_num_free];
+        count++;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (count > 0) {
+        __atomic_add_fetch(&pool_stats.refills, 1, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+// Return a thread's cached buffers when it exits
+static void cache_exit(void *value) {
+    packet_cache_t *cache = value;
+    flush(cache, cache->count);
+}
+
+static void create_cache_key() {
+    pthread_key_create(&cache_key, cache_exit);
+}
+
+static packet_cache_t *get_cache() {
+    if (!thread_cache_registered) {
+        pthread_once(&cache_once, create_cache_key);
+        pthread_setspecific(cache_key, &thread_cache);
+        thread_cache_registered = 1;
+    }
+    return &thread_cache;
+}
+
+int packet_pool_init(int mtu) {
+    if (mtu <= 0) {
+        mtu = PACKET_POOL_DEFAULT_MTU;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_arena != NULL) {
+        if ((uint32_t)mtu + PACKET_POOL_HEADROOM > pool_buffer_size) {
+            LOGE("Packet pool already sized for a smaller MTU");
+        }
+        pthread_mutex_unlock(&pool_mutex);
+        return 0;
+    }
+
+    // Cache-line sized buffers
+    uint32_t buffer_size = ((uint32_t)mtu + PACKET_POOL_HEADROOM + 63) & ~63u;
+    size_t arena_size = (size_t)PACKET_POOL_BUFFERS * buffer_size;
+    void *arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        pthread_mutex_unlock(&pool_mutex);
+        LOGE("Failed to allocate packet pool");
+        return -1;
+    }
+
+    for (int i = 0; i < PACKET_POOL_BUFFERS; i++) {
+        pool_descriptors[i].index = (uint32_t)i;
+        pool_free[i] = &pool_descriptors[PACKET_POOL_BUFFERS - 1 - i];
+    }
+    pool_num_free = PACKET_POOL_BUFFERS;
+    pool_buffer_size = buffer_size;
+    pool_arena_size = arena_size;
+    pool_arena = arena;
+    pthread_mutex_unlock(&pool_mutex);
+
+    LOGI("Packet pool: %d buffers of %u bytes", PACKET_POOL_BUFFERS, buffer_size);
+    return 0;
+}
+
+packet_buf_t *packet_alloc() {
+    packet_cache_t *cache = get_cache();
+    if (cache->count == 0 && refill(cache) == 0) {
+        __atomic_add_fetch(&pool_stats.exhausted, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    packet_buf_t *packet = cache->buffers[--cache->count];
+    packet->next = NULL;
+    packet->data = pool_arena + (size_t)packet->index * pool_buffer_size + PACKET_POOL_HEADROOM;
+    packet->len = 0;
+    packet->capacity = pool_buffer_size - PACKET_POOL_HEADROOM;
+    packet->refs = 1;
+    packet->trace = 0;
+    packet->version = 0;
+    packet->protocol = 0;
+    packet->l4_offset = 0;
+    packet->payload_offset = 0;
+    packet->payload_len = 0;
+    packet->src_port = 0;
+    packet->dst_port = 0;
+
+    __atomic_add_fetch(&pool_stats.allocs, 1, __ATOMIC_RELAXED);
+    uint32_t in_use = __atomic_add_fetch(&pool_stats.in_use, 1, __ATOMIC_RELAXED);
+    uint32_t in_use_max = __atomic_load_n(&pool_stats.in_use_max, __ATOMIC_RELAXED);
+    while (in_use > in_use_max &&
+           !__atomic_compare_exchange_n(&pool_stats.in_use_max, &in_use_max, in_use, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return packet;
+}
+
+void packet_retain(packet_buf_t *packet) {
+    __atomic_add_fetch(&packet->refs, 1, __ATOMIC_RELAXED);
+}
+
+void packet_release(packet_buf_t *packet) {
+    if (__atomic_sub_fetch(&packet->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    __atomic_sub_fetch(&pool_stats.in_use, 1, __ATOMIC_RELAXED);
+
+    packet_cache_t *cache = get_cache();
+    if (cache->count == PACKET_POOL_CACHE) {
+        flush(cache, CACHE_BATCH);
+    }
+    cache->buffers[cache->count++] = packet;
+}
+
+unsigned char *packet_push(packet_buf_t *packet, size_t len) {
+    unsigned char *start = pool_arena + (size_t)packet->index * pool_buffer_size;
+    if ((size_t)(packet->data - start) < len) {
+        return NULL;
+    }
+    packet->data -= len;
+    packet->len += (uint32_t)len;
+    packet->capacity += (uint32_t)len;
+    return packet->data;
+}
+
+int packet_parse(packet_buf_t *packet) {
+    const unsigned char *data = packet->data;
+    size_t l4_offset;
+    size_t total_len;
+    uint8_t protocol;
+
+    packet->version = 0;
+    packet->protocol = 0;
+    packet->payload_offset = 0;
+    packet->payload_len = 0;
+    packet->src_port = 0;
+    packet->dst_port = 0;
+
+    if (packet->len >= sizeof(struct iphdr) && data[0] >> 4 == 4) {
+        const struct iphdr *ip = (const struct iphdr *)data;
+        l4_offset = ip->ihl * 4;
+        total_len = ntohs(ip->tot_len);
+        if (l4_offset < sizeof(struct iphdr) || total_len < l4_offset || total_len > packet->len) {
+            return -1;
+        }
+        protocol = ip->protocol;
+    } else if (packet->len >= sizeof(struct ip6_hdr) && data[0] >> 4 == 6) {
+        // Extension headers are not followed
+        const struct ip6_hdr *ip6 = (const struct ip6_hdr *)data;
+        l4_offset = sizeof(struct ip6_hdr);
+        total_len = l4_offset + ntohs(ip6->ip6_plen);
+        if (total_len > packet->len) {
+            return -1;
+        }
+        protocol = ip6->ip6_nxt;
+    } else {
+        return -1;
+    }
+
+    packet->version = data[0] >> 4;
+    packet->l4_offset = (uint16_t)l4_offset;
+
+    // A truncated transport header leaves protocol at 0
+    if (protocol == IPPROTO_TCP && total_len >= l4_offset + sizeof(struct tcphdr)) {
+        const struct tcphdr *tcp = (const struct tcphdr *)(data + l4_offset);
+        size_t header_len = tcp->doff * 4;
+        if (header_len < sizeof(struct tcphdr) || l4_offset + header_len > total_len) {
+            return 0;
+        }
+        packet->payload_offset = (uint16_t)(l4_offset + header_len);
+        packet->src_port = ntohs(tcp->source);
+        packet->dst_port = ntohs(tcp->dest);
+    } else if (protocol == IPPROTO_UDP && total_len >= l4_offset + sizeof(struct udphdr)) {
+        const struct udphdr *udp = (const struct udphdr *)(data + l4_offset);
+        size_t udp_len = ntohs(udp->len);
+        if (udp_len < sizeof(struct udphdr) || l4_offset + udp_len > total_len) {
+            return 0;
+        }
+        total_len = l4_offset + udp_len;
+        packet->payload_offset = (uint16_t)(l4_offset + sizeof(struct udphdr));
+        packet->src_port = ntohs(udp->source);
+        packet->dst_port = ntohs(udp->dest);
+    } else {
+        return 0;
+    }
+
+    packet->protocol = protocol;
+    packet->payload_len = (uint16_t)(total_len - packet->payload_offset);
+    return 0;
+}
+
+void packet_pool_arena(void **base, size_t *size) {
+    *base = pool_arena;
+    *size = pool_arena_size;
+}
+
+packet_buf_t *packet_from_index(uint32_t index) {
+    return index < PACKET_POOL_BUFFERS ? &pool_descriptors[index] : NULL;
+}
+
+void packet_pool_get_stats(packet_pool_stats_t *stats) {
+    stats->buffers = PACKET_POOL_BUFFERS;
+    stats->buffer_size = pool_buffer_size;
+    stats->in_use = __atomic_load_n(&pool_stats.in_use, __ATOMIC_RELAXED);
+    stats->in_use_max = __atomic_load_n(&pool_stats.in_use_max, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&pool_stats.allocs, __ATOMIC_RELAXED);
+    stats->exhausted = __atomic_load_n(&pool_stats.exhausted, __ATOMIC_RELAXED);
+    stats->refills = __atomic_load_n(&pool_stats.refills, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,265 @@
+// packet_trace.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+#include "include/packet_trace.h"
+
+#define TAG "PacketTrace"
+#include "include/native_log.h"
+
+#define TRACE_MASK (PACKET_TRACE_EVENTS - 1)
+
+typedef struct {
+    uint64_t start_ns;
+    uint32_t duration_ns;       // Saturates at about 4 s
+    uint32_t id;
+    int32_t tid;
+    uint16_t stage;
+} trace_event_t;
+
+// Written by its owning thread only. head is published with a release
+// store after the event is in place; a dump reads events up to head and
+// discards any the owner may have overwritten meanwhile.
+typedef struct {
+    uint64_t head;              // Events recorded
+    uint64_t tail;              // Events already dumped, dump side only
+    int owned;                  // A live thread records into this ring
+    trace_event_t events[PACKET_TRACE_EVENTS];
+} trace_ring_t;
+
+static const char *stage_names[PACKET_TRACE_STAGES] = {
+        "process_packet",
+        "extract_domain",
+        "filter_check_domain",
+        "dns_forwarder_query",
+        "find_or_create_connection",
+        "send_upstream",
+        "handle_upstream_data",
+};
+
+uint32_t packet_trace_rate = 0;
+
+static trace_ring_t *trace_rings[PACKET_TRACE_THREADS];
+static uint32_t trace_num_rings = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t trace_next_id = 0;
+
+// Counters are updated with relaxed atomics from any thread
+static uint64_t trace_sampled = 0;
+static uint64_t trace_events = 0;
+static uint64_t trace_dropped = 0;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t *thread_ring = NULL;
+static __thread int32_t thread_tid = 0;
+static __thread uint32_t thread_skipped = 0;
+
+// Hand the ring of an exiting thread to the next thread that records
+static void ring_exit(void *value) {
+    trace_ring_t *ring = value;
+    pthread_mutex_lock(&trace_mutex);
+    ring->owned = 0;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static void create_ring_key() {
+    pthread_key_create(&ring_key, ring_exit);
+}
+
+// Find or create a ring for the calling thread. NULL once all are taken.
+static trace_ring_t *get_ring() {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+
+    pthread_once(&ring_once, create_ring_key);
+    pthread_mutex_lock(&trace_mutex);
+    trace_ring_t *ring = NULL;
+    for (uint32_t i = 0; i < trace_num_rings && ring == NULL; i++) {
+        if (!trace_rings[i]->owned) {
+            ring = trace_rings[i];
+        }
+    }
+    if (ring == NULL && trace_num_rings < PACKET_TRACE_THREADS) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        if (ring != NULL) {
+            trace_rings[trace_num_rings++] = ring;
+        }
+    }
+    if (ring != NULL) {
+        ring->owned = 1;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (ring != NULL) {
+        pthread_setspecific(ring_key, ring);
+        thread_ring = ring;
+        thread_tid = (int32_t)syscall(SYS_gettid);
+    }
+    return ring;
+}
+
+void packet_trace_enable(uint32_t sample_rate) {
+    __atomic_store_n(&packet_trace_rate, sample_rate, __ATOMIC_RELAXED);
+    if (sample_rate > 0) {
+        LOGI("Tracing 1 in %u packets", sample_rate);
+    } else {
+        LOGI("Tracing off");
+    }
+}
+
+void packet_trace_init_from_env() {
+    const char *value = getenv(PACKET_TRACE_ENV);
+#ifdef __ANDROID__
+    char property[PROP_VALUE_MAX];
+    if (value == NULL && __system_property_get(PACKET_TRACE_PROPERTY, property) > 0) {
+        value = property;
+    }
+#endif
+    if (value != NULL && *value != '\0') {
+        packet_trace_enable((uint32_t)strtoul(value, NULL, 10));
+    }
+}
+
+uint32_t packet_trace_sample_slow() {
+    uint32_t rate = __atomic_load_n(&packet_trace_rate, __ATOMIC_RELAXED);
+    if (rate == 0 || ++thread_skipped < rate) {
+        return 0;
+    }
+    thread_skipped = 0;
+
+    __atomic_add_fetch(&trace_sampled, 1, __ATOMIC_RELAXED);
+    uint32_t id = __atomic_add_fetch(&trace_next_id, 1, __ATOMIC_RELAXED);
+    return id != 0 ? id : 1;
+}
+
+void packet_trace_record(uint32_t id, int stage, uint64_t start_ns, uint64_t end_ns) {
+    trace_ring_t *ring = get_ring();
+    if (ring == NULL) {
+        __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t duration = end_ns - start_ns;
+    trace_event_t *event = &ring->events[ring->head & TRACE_MASK];
+    event->start_ns = start_ns;
+    event->duration_ns = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+    event->id = id;
+    event->tid = thread_tid;
+    event->stage = (uint16_t)stage;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&trace_events, 1, __ATOMIC_RELAXED);
+}
+
+// Copy the events of a ring not yet dumped. Returns the number copied.
+static size_t collect(trace_ring_t *ring, trace_event_t *out) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t from = head > PACKET_TRACE_EVENTS ? head - PACKET_TRACE_EVENTS : 0;
+    if (from < ring->tail) {
+        from = ring->tail;
+    }
+
+    for (uint64_t i = from; i < head; i++) {
+        out[i - from] = ring->events[i & TRACE_MASK];
+    }
+
+    // The owner kept recording: anything at or below the slot it may be
+    // writing now is suspect
+    uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t valid = after >= PACKET_TRACE_EVENTS ? after - PACKET_TRACE_EVENTS + 1 : 0;
+    size_t skip = valid > from ? (size_t)(valid - from) : 0;
+    size_t count = (size_t)(head - from);
+    if (skip >= count) {
+        ring->tail = head;
+        return 0;
+    }
+
+    memmove(out, out + skip, (count - skip) * sizeof(trace_event_t));
+    ring->tail = head;
+    return count - skip;
+}
+
+// Nonzero if any ring has events not yet dumped. Caller holds trace_mutex.
+static int have_events() {
+    for (uint32_t r = 0; r < trace_num_rings; r++) {
+        if (__atomic_load_n(&trace_rings[r]->head, __ATOMIC_ACQUIRE) > trace_rings[r]->tail) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int packet_trace_dump(const char *path) {
+    pthread_mutex_lock(&trace_mutex);
+    int empty = !have_events();
+    pthread_mutex_unlock(&trace_mutex);
+    if (empty) {
+        return 0;
+    }
+
+    trace_event_t *events = malloc(PACKET_TRACE_EVENTS * sizeof(trace_event_t));
+    if (events == NULL) {
+        return -1;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        LOGE("Failed to open trace file %s", path);
+        free(events);
+        return -1;
+    }
+
+    // Chrome trace event format: complete events with microsecond times
+    int pid = (int)getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"domainfilter\"}}", pid);
+
+    int written = 0;
+    pthread_mutex_lock(&trace_mutex);
+    for (uint32_t r = 0; r < trace_num_rings; r++) {
+        size_t count = collect(trace_rings[r], events);
+        for (size_t i = 0; i < count; i++) {
+            const trace_event_t *event = &events[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"packet\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                          "\"ts\":%llu.%03u,\"dur\":%u.%03u,\"args\":{\"packet\":%u}}",
+                    stage_names[event->stage], pid, event->tid,
+                    (unsigned long long)(event->start_ns / 1000), (unsigned)(event->start_ns % 1000),
+                    event->duration_ns / 1000, event->duration_ns % 1000, event->id);
+        }
+        written += (int)count;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+
+    fprintf(file, "\n]}\n");
+    int failed = ferror(file);
+    if (fclose(file) != 0 || failed) {
+        LOGE("Failed to write trace file %s", path);
+        free(events);
+        return -1;
+    }
+
+    free(events);
+    LOGI("Wrote %d trace events to %s", written, path);
+    return written;
+}
+
+void packet_trace_get_stats(packet_trace_stats_t *stats) {
+    stats->sample_rate = __atomic_load_n(&packet_trace_rate, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&trace_mutex);
+    stats->threads = 0;
+    for (uint32_t i = 0; i < trace_num_rings; i++) {
+        stats->threads += trace_rings[i]->owned != 0;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    stats->sampled = __atomic_load_n(&trace_sampled, __ATOMIC_RELAXED);
+    stats->events = __atomic_load_n(&trace_events, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+}
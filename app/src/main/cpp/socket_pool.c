@@ -0,0 +1,209 @@
+// socket_pool.c
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "include/socket_pool.h"
+
+#define TAG "SocketPool"
+#include "include/native_log.h"
+
+// One stack of ready sockets per type
+typedef struct {
+    int fds[SOCKET_POOL_MAX];
+    int count;
+    int type;
+} pool_stack_t;
+
+static pool_stack_t pool_tcp = { .type = SOCK_STREAM };
+static pool_stack_t pool_udp = { .type = SOCK_DGRAM };
+static int pool_low = SOCKET_POOL_LOW_DEFAULT;
+static int pool_high = SOCKET_POOL_HIGH_DEFAULT;
+static socket_pool_stats_t pool_stats;
+static socket_pool_config_t pool_config;
+
+static int pool_running = 0;
+static pthread_t pool_thread;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+// Does either stack need a refill? Caller holds pool_mutex.
+static int needs_refill() {
+    return pool_tcp.count < pool_low || pool_udp.count < pool_low;
+}
+
+// Create sockets for one stack and protect them with a single upcall
+static void refill(pool_stack_t *stack) {
+    int fds[SOCKET_POOL_MAX];
+
+    pthread_mutex_lock(&pool_mutex);
+    int wanted = pool_high - stack->count;
+    pthread_mutex_unlock(&pool_mutex);
+
+    int count = 0;
+    while (count < wanted) {
+        int fd = socket(AF_INET, stack->type, 0);
+        if (fd < 0) {
+            LOGE("Failed to create pooled socket: %s", strerror(errno));
+            break;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fds[count++] = fd;
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    int created[SOCKET_POOL_MAX];
+    memcpy(created, fds, count * sizeof(int));
+    if (pool_config.protect(fds, count, pool_config.ctx) < 0) {
+        for (int i = 0; i < count; i++) {
+            fds[i] = -1;
+        }
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    for (int i = 0; i < count; i++) {
+        if (fds[i] < 0) {
+            close(created[i]);
+            pool_stats.protect_failures++;
+        } else if (stack->count < SOCKET_POOL_MAX) {
+            stack->fds[stack->count++] = fds[i];
+        } else {
+            close(fds[i]);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+static void *pool_main(void *arg) {
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_running) {
+        if (!needs_refill()) {
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        refill(&pool_tcp);
+        refill(&pool_udp);
+
+        pthread_mutex_lock(&pool_mutex);
+
+        // Protection keeps failing (VPN going down?), back off instead of spinning
+        if (needs_refill() && pool_running) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&pool_cond, &pool_mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (pool_config.thread_exit != NULL) {
+        pool_config.thread_exit(pool_config.ctx);
+    }
+    return NULL;
+}
+
+// Start the refill thread and fill the pool to the high watermark
+int socket_pool_start(const socket_pool_config_t *config) {
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_running) {
+        pthread_mutex_unlock(&pool_mutex);
+        return 0;
+    }
+    pool_config = *config;
+    pool_running = 1;
+    memset(&pool_stats, 0, sizeof(pool_stats));
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (pthread_create(&pool_thread, NULL, pool_main, NULL) != 0) {
+        LOGE("Failed to start socket pool thread");
+        pool_running = 0;
+        return -1;
+    }
+
+    LOGI("Socket pool started (low %d, high %d)", pool_low, pool_high);
+    return 0;
+}
+
+// Stop the refill thread and close every pooled socket
+void socket_pool_stop() {
+    pthread_mutex_lock(&pool_mutex);
+    if (!pool_running) {
+        pthread_mutex_unlock(&pool_mutex);
+        return;
+    }
+    pool_running = 0;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_join(pool_thread, NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    for (int i = 0; i < pool_tcp.count; i++) {
+        close(pool_tcp.fds[i]);
+    }
+    for (int i = 0; i < pool_udp.count; i++) {
+        close(pool_udp.fds[i]);
+    }
+    pool_tcp.count = 0;
+    pool_udp.count = 0;
+    pthread_mutex_unlock(&pool_mutex);
+
+    LOGI("Socket pool stopped");
+}
+
+// Take a ready, protected socket. Never blocks on the refill thread.
+int socket_pool_take(int type) {
+    pool_stack_t *stack = type == SOCK_STREAM ? &pool_tcp : &pool_udp;
+    int fd = -1;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (stack->count > 0) {
+        fd = stack->fds[--stack->count];
+        pool_stats.taken++;
+    } else {
+        pool_stats.misses++;
+    }
+    if (pool_running && stack->count < pool_low) {
+        pthread_cond_signal(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    return fd;
+}
+
+void socket_pool_set_watermarks(int low, int high) {
+    if (high > SOCKET_POOL_MAX) {
+        high = SOCKET_POOL_MAX;
+    }
+    if (low < 0) {
+        low = 0;
+    }
+    if (low > high) {
+        low = high;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_low = low;
+    pool_high = high;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void socket_pool_get_stats(socket_pool_stats_t *stats) {
+    pthread_mutex_lock(&pool_mutex);
+    *stats = pool_stats;
+    stats->ready_tcp = pool_tcp.count;
+    stats->ready_udp = pool_udp.count;
+    stats->low_watermark = pool_low;
+    stats->high_watermark = pool_high;
+    pthread_mutex_unlock(&pool_mutex);
+}
@@ -0,0 +1,77 @@
+// filter_compile.c
+// Build-time compiler for the default filter lists. Loads each list with the
+// regular parser and writes the resulting trie as C source, so the library
+// ships it as const data instead of parsing it on every launch.
+//
+// Usage: filter_compile -o filter_builtin_data.c advertising=advertising.txt ...
+#include <stdio.h>
+#include <string.h>
+#include "domainfilter.h"
+#include "filter_builtin.h"
+
+static const struct {
+    const char *name;
+    uint8_t category;
+} categories[] = {
+        {"advertising", FILTER_CATEGORY_ADVERTISING},
+        {"tracking",    FILTER_CATEGORY_TRACKING},
+        {"malware",     FILTER_CATEGORY_MALWARE},
+};
+
+static int category_for(const char *name, size_t len, uint8_t *category) {
+    for (size_t i = 0; i < sizeof(categories) / sizeof(categories[0]); i++) {
+        if (strlen(categories[i].name) == len && memcmp(categories[i].name, name, len) == 0) {
+            *category = categories[i].category;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+
+    filter_init();
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+            continue;
+        }
+
+        const char *eq = strchr(argv[i], '=');
+        uint8_t category;
+        if (eq == NULL || category_for(argv[i], eq - argv[i], &category) < 0) {
+            fprintf(stderr, "filter_compile: expected <list>=<file>, got %s\n", argv[i]);
+            return 1;
+        }
+
+        // Empty lists are fine, missing ones are not
+        if (filter_load_list(eq + 1, category) < 0) {
+            return 1;
+        }
+    }
+
+    if (output == NULL) {
+        fprintf(stderr, "usage: filter_compile -o <output.c> <list>=<file>...\n");
+        return 1;
+    }
+
+    FILE *out = fopen(output, "w");
+    if (out == NULL) {
+        perror(output);
+        return 1;
+    }
+
+    int result = filter_write_builtin_source(out);
+    if (fclose(out) != 0) {
+        result = -1;
+    }
+    if (result < 0) {
+        remove(output);
+        return 1;
+    }
+
+    filter_cleanup();
+    return 0;
+}
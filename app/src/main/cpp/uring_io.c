@@ -0,0 +1,851 @@
+// uring_io.c
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include "include/uring_io.h"
+
+#define TAG "UringIo"
+#include "include/native_log.h"
+
+#define RING_ENTRIES    256
+#define RX_BUFFERS      256     // Power of two, pool buffers posted for receives
+#define TX_ENTRIES      512     // Writes queued or in flight
+#define BUFFER_GROUP    0
+
+// Opcodes newer than some uapi headers
+#define URING_OP_READ_MULTISHOT 49
+
+// Watch used for the tun slot
+#define WATCH_TUN       4
+
+// user_data layout: operation in the top byte, slot generation in the next
+// 24 bits and the slot or tx entry in the low 32 bits
+#define OP_TUN_READ     1
+#define OP_RECV         2
+#define OP_POLL_OUT     3
+#define OP_POLL_IN      4
+#define OP_TX           5
+#define OP_INTERNAL     6       // Files updates and cancels
+#define OP_PROBE        7       // Receive armed by probe_recv_multishot()
+
+#define GENERATION_MASK 0xffffffu
+#define USER_DATA(op, generation, index) \
+        ((uint64_t)(op) << 56 | (uint64_t)((generation) & GENERATION_MASK) << 32 | (uint32_t)(index))
+#define USER_DATA_OP(data)          ((int)((data) >> 56))
+#define USER_DATA_GENERATION(data)  ((uint32_t)((data) >> 32) & GENERATION_MASK)
+#define USER_DATA_INDEX(data)       ((uint32_t)(data))
+
+typedef struct {
+    int fd;                 // -1 if free
+    int watch;              // URING_IO_* or WATCH_TUN
+    uint32_t generation;    // Bumped on removal, stale completions are ignored
+    int32_t tx_head;        // Queued writes not issued yet, -1 if none
+    int32_t tx_tail;
+    int tx_inflight;        // Writes of the chain in flight
+    int starved;            // Receive stopped for want of buffers
+    int dirty;              // On the list of slots with work to issue
+} ring_slot_t;
+
+// A queued write: a range inside a pool packet
+typedef struct {
+    int32_t next;
+    int slot;
+    packet_buf_t *packet;   // Held until the write completes, NULL if free
+    const unsigned char *data;
+    uint32_t len;
+} tx_entry_t;
+
+static struct {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // Prepared entries, published on enter
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    int read_multishot;         // Kernel has multishot read for the tun fd
+    int recv_multishot;         // Kernel takes IORING_RECV_MULTISHOT
+    int fixed_tx;               // The pool arena is registered
+
+    struct io_uring_buf_ring *buf_ring;
+    uint16_t buf_tail;
+    int rx_posted;              // Pool buffers owned by the buffer ring
+    uint8_t rx_owned[PACKET_POOL_BUFFERS];
+    tx_entry_t tx_entries[TX_ENTRIES];
+    int32_t tx_free;
+
+    ring_slot_t *slots;         // num_slots sockets, then the tun fd
+    int num_slots;
+    int *dirty;
+    int num_dirty;
+} ring = { .fd = -1 };
+
+static uring_io_stats_t uring_stats;
+static int sparse_fd = -1;
+
+static int ring_register(unsigned opcode, const void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, count);
+}
+
+// Post fresh pool buffers to the buffer ring until it is full. Buffer IDs
+// are pool indices, so a completion leads straight to its packet.
+static void post_buffers() {
+    int posted = 0;
+    while (ring.rx_posted < RX_BUFFERS) {
+        packet_buf_t *packet = packet_alloc();
+        if (packet == NULL) {
+            break;
+        }
+
+        struct io_uring_buf *entry = &ring.buf_ring->bufs[ring.buf_tail & (RX_BUFFERS - 1)];
+        entry->addr = (uint64_t)(uintptr_t)packet->data;
+        entry->len = packet->capacity;
+        entry->bid = (uint16_t)packet->index;
+        ring.buf_tail++;
+        ring.rx_owned[packet->index] = 1;
+        ring.rx_posted++;
+        posted++;
+    }
+
+    if (posted > 0) {
+        __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+    }
+}
+
+// Take back a buffer the kernel filled
+static packet_buf_t *take_buffer(int buffer) {
+    packet_buf_t *packet = packet_from_index((uint32_t)buffer);
+    if (packet == NULL || !ring.rx_owned[buffer]) {
+        return NULL;
+    }
+    ring.rx_owned[buffer] = 0;
+    ring.rx_posted--;
+    return packet;
+}
+
+static int32_t tx_alloc() {
+    int32_t tx = ring.tx_free;
+    if (tx >= 0) {
+        ring.tx_free = ring.tx_entries[tx].next;
+        ring.tx_entries[tx].next = -1;
+    }
+    return tx;
+}
+
+static void tx_release(int32_t tx) {
+    tx_entry_t *entry = &ring.tx_entries[tx];
+    if (entry->packet != NULL) {
+        packet_release(entry->packet);
+        entry->packet = NULL;
+    }
+    entry->next = ring.tx_free;
+    ring.tx_free = tx;
+}
+
+// Publish prepared entries, submit them and optionally wait for completions
+static int enter(unsigned min_complete, int timeout_ms) {
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    unsigned submit = ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec timeout = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&timeout;
+
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    uring_stats.enters++;
+    if (syscall(__NR_io_uring_enter, ring.fd, submit, min_complete, flags, &arg, sizeof(arg)) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        LOGE("io_uring_enter failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Next free submission entry, submitting what is queued if the ring is full
+static struct io_uring_sqe *get_sqe() {
+    if (ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        enter(0, 0);
+        if (ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = ring.sq_local_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    ring.sq_array[index] = index;
+    ring.sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static unsigned sq_space() {
+    return ring.sq_entries - (ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Start the receive or poll a slot is watching
+static int arm(int index) {
+    ring_slot_t *slot = &ring.slots[index];
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->fd = index;
+    sqe->flags = IOSQE_FIXED_FILE;
+
+    switch (slot->watch) {
+        case WATCH_TUN:
+            sqe->opcode = ring.read_multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = BUFFER_GROUP;
+            sqe->off = (uint64_t)-1;
+            sqe->user_data = USER_DATA(OP_TUN_READ, slot->generation, index);
+            break;
+        case URING_IO_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = ring.recv_multishot ? IORING_RECV_MULTISHOT : 0;
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = BUFFER_GROUP;
+            sqe->user_data = USER_DATA(OP_RECV, slot->generation, index);
+            break;
+        case URING_IO_WRITABLE:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLOUT;
+            sqe->user_data = USER_DATA(OP_POLL_OUT, slot->generation, index);
+            break;
+        case URING_IO_READABLE:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = USER_DATA(OP_POLL_IN, slot->generation, index);
+            break;
+    }
+    return 0;
+}
+
+// Issue a slot's queued writes as one linked chain, so they reach the
+// socket in order however the kernel schedules them
+static void issue_writes(int index) {
+    ring_slot_t *slot = &ring.slots[index];
+    unsigned space = sq_space();
+
+    while (slot->tx_head >= 0 && space > 0) {
+        int32_t tx = slot->tx_head;
+        const tx_entry_t *entry = &ring.tx_entries[tx];
+        slot->tx_head = entry->next;
+        if (slot->tx_head < 0) {
+            slot->tx_tail = -1;
+        }
+        space--;
+
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->fd = index;
+        sqe->flags = IOSQE_FIXED_FILE;
+        if (slot->tx_head >= 0 && space > 0) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        sqe->addr = (uint64_t)(uintptr_t)entry->data;
+        sqe->len = entry->len;
+        sqe->user_data = USER_DATA(OP_TX, slot->generation, tx);
+
+        if (slot->watch == WATCH_TUN) {
+            // The whole pool arena is registered buffer 0
+            sqe->opcode = ring.fixed_tx ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            sqe->buf_index = 0;
+            sqe->off = (uint64_t)-1;
+        } else {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        }
+        slot->tx_inflight++;
+    }
+}
+
+static void mark_dirty(int index) {
+    if (!ring.slots[index].dirty) {
+        ring.slots[index].dirty = 1;
+        ring.dirty[ring.num_dirty++] = index;
+    }
+}
+
+// Queue a write on a slot. Without a free entry the write is done inline,
+// unless that would overtake writes still queued.
+static int queue_write(int index, packet_buf_t *packet, const void *data, size_t len) {
+    ring_slot_t *slot = &ring.slots[index];
+    if (slot->fd < 0) {
+        return -1;
+    }
+
+    int32_t tx = tx_alloc();
+    if (tx < 0) {
+        if (slot->tx_head >= 0 || slot->tx_inflight > 0) {
+            uring_stats.errors++;
+            return -1;
+        }
+        uring_stats.fallbacks++;
+        ssize_t written = slot->watch == WATCH_TUN ? write(slot->fd, data, len)
+                                                   : send(slot->fd, data, len, MSG_NOSIGNAL);
+        return written < 0 ? -1 : 0;
+    }
+
+    tx_entry_t *entry = &ring.tx_entries[tx];
+    packet_retain(packet);
+    entry->packet = packet;
+    entry->data = data;
+    entry->len = (uint32_t)len;
+    entry->slot = index;
+    if (slot->tx_tail >= 0) {
+        ring.tx_entries[slot->tx_tail].next = tx;
+    } else {
+        slot->tx_head = tx;
+    }
+    slot->tx_tail = tx;
+
+    if (slot->tx_inflight == 0) {
+        mark_dirty(index);
+    }
+    return 0;
+}
+
+// A write finished. The next chain of a slot goes out once the last one is done.
+static void finish_write(uint64_t user_data, int result) {
+    int32_t tx = (int32_t)USER_DATA_INDEX(user_data);
+    const tx_entry_t *entry = &ring.tx_entries[tx];
+    ring_slot_t *slot = &ring.slots[entry->slot];
+
+    if (result < 0 || (uint32_t)result < entry->len) {
+        uring_stats.errors++;
+    } else {
+        uring_stats.sent++;
+    }
+
+    // Removing the slot already dropped its queue and reset the count
+    if ((slot->generation & GENERATION_MASK) == USER_DATA_GENERATION(user_data) &&
+        --slot->tx_inflight == 0 && slot->tx_head >= 0) {
+        mark_dirty(entry->slot);
+    }
+    tx_release(tx);
+}
+
+// Turn a completion into an event. Returns 0 if there is nothing to report.
+static int complete(const struct io_uring_cqe *cqe, uring_io_event_t *event) {
+    uint64_t user_data = cqe->user_data;
+    int op = USER_DATA_OP(user_data);
+    int index = (int)USER_DATA_INDEX(user_data);
+    packet_buf_t *packet = (cqe->flags & IORING_CQE_F_BUFFER)
+                           ? take_buffer((int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT)) : NULL;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    if (op == OP_INTERNAL) {
+        return 0;
+    }
+    if (op == OP_TX) {
+        finish_write(user_data, cqe->res);
+        return 0;
+    }
+
+    ring_slot_t *slot = &ring.slots[index];
+    if (slot->fd < 0 || (slot->generation & GENERATION_MASK) != USER_DATA_GENERATION(user_data)) {
+        if (packet != NULL) {
+            packet_release(packet);
+        }
+        return 0;
+    }
+
+    // The buffer ring ran dry, which also ends a multishot receive. It is
+    // re-armed once buffers have been posted again.
+    if (cqe->res == -ENOBUFS) {
+        uring_stats.no_buffers++;
+        if (!more) {
+            slot->starved = 1;
+            mark_dirty(index);
+        }
+        return 0;
+    }
+    if (cqe->res == -ECANCELED) {
+        return 0;
+    }
+
+    event->slot = index;
+    event->fd = slot->fd;
+    event->result = cqe->res;
+    event->packet = packet;
+    event->generation = slot->generation;
+    if (packet != NULL && cqe->res > 0) {
+        packet->len = (uint32_t)cqe->res;
+    }
+
+    switch (op) {
+        case OP_TUN_READ:
+            event->slot = URING_IO_TUN;
+            event->type = URING_IO_RECV;
+            if (cqe->res <= 0 && packet != NULL) {
+                packet_release(packet);
+                event->packet = NULL;
+            }
+
+            // Any other error ends tun reads on the ring and goes to the
+            // caller, which has to stop or read the tun some other way
+            if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+                LOGE("Error reading from VPN interface: %s", strerror(-cqe->res));
+                return 1;
+            }
+            if (!more) {
+                arm(index);
+            }
+            if (cqe->res <= 0) {
+                return 0;
+            }
+            break;
+        case OP_RECV:
+            // A multishot receive can stop while the flow is still open
+            event->type = URING_IO_RECV;
+            if (!more && cqe->res > 0) {
+                arm(index);
+            }
+            break;
+        case OP_POLL_OUT:
+            event->type = URING_IO_WRITABLE;
+            break;
+        case OP_POLL_IN:
+            event->type = URING_IO_READABLE;
+            if (!more && cqe->res >= 0) {
+                arm(index);
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    if (cqe->res > 0 && packet != NULL) {
+        uring_stats.received++;
+    }
+    return 1;
+}
+
+static int map_rings(const struct io_uring_params *params) {
+    ring.sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_size > ring.sq_ring_size) {
+            ring.sq_ring_size = ring.cq_ring_size;
+        }
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) {
+        ring.sq_ring = NULL;
+        return -1;
+    }
+
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+    } else {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED) {
+            ring.cq_ring = NULL;
+            return -1;
+        }
+    }
+
+    ring.sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        return -1;
+    }
+
+    unsigned char *sq = ring.sq_ring;
+    unsigned char *cq = ring.cq_ring;
+    ring.sq_head = (unsigned *)(sq + params->sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + params->sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params->sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params->sq_off.array);
+    ring.sq_entries = params->sq_entries;
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(cq + params->cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params->cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params->cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+    return 0;
+}
+
+// Check for the operations used here. Multishot receive has no opcode of
+// its own, see probe_recv_multishot().
+static int probe_ops() {
+    static const int required[] = {
+            IORING_OP_READ, IORING_OP_WRITE, IORING_OP_WRITE_FIXED, IORING_OP_SEND, IORING_OP_RECV,
+            IORING_OP_POLL_ADD, IORING_OP_FILES_UPDATE, IORING_OP_ASYNC_CANCEL,
+    };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL || ring_register(IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return -1;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+        if (required[i] > probe->last_op || !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+            result = -1;
+        }
+    }
+    ring.read_multishot = URING_OP_READ_MULTISHOT <= probe->last_op &&
+                          (probe->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return result;
+}
+
+// Multishot receive has no opcode to probe for. Arm one on a spare socket
+// and cancel it: kernels before 6.0 refuse it with -EINVAL, and single
+// receives, re-armed after each completion, are used there instead. Runs
+// before anything else is queued, with the buffer ring set up.
+static void probe_recv_multishot() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = USER_DATA(OP_PROBE, 0, 0);
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = USER_DATA(OP_PROBE, 0, 0);
+    sqe->user_data = USER_DATA(OP_INTERNAL, 0, 0);
+
+    // The receive completes either way, refused or cancelled
+    int refused = 1;
+    unsigned head = *ring.cq_head;
+    if (enter(2, 1000) == 0) {
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            if (USER_DATA_OP(cqe->user_data) == OP_PROBE) {
+                refused = cqe->res == -EINVAL;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(fd);
+
+    ring.recv_multishot = !refused;
+}
+
+// Receives pick pool buffers from a ring the kernel reads; the pool arena
+// is registered so tun writes need no page lookups
+static int setup_buffers() {
+    ring.buf_ring = mmap(NULL, RX_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.buf_ring == MAP_FAILED) {
+        ring.buf_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring.buf_ring;
+    reg.ring_entries = RX_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+    if (ring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+
+    // Pinning counts against RLIMIT_MEMLOCK, plain writes work without it
+    struct iovec iov;
+    packet_pool_arena(&iov.iov_base, &iov.iov_len);
+    if (iov.iov_base == NULL) {
+        return -1;
+    }
+    ring.fixed_tx = ring_register(IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+    ring.tx_free = -1;
+    for (int32_t i = TX_ENTRIES - 1; i >= 0; i--) {
+        tx_release(i);
+    }
+
+    ring.buf_tail = 0;
+    ring.rx_posted = 0;
+    post_buffers();
+    return 0;
+}
+
+static int setup_files(int count) {
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = (unsigned)count;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (ring_register(IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0) {
+        return -1;
+    }
+
+    ring.slots = calloc((size_t)count, sizeof(ring_slot_t));
+    ring.dirty = calloc((size_t)count, sizeof(int));
+    if (ring.slots == NULL || ring.dirty == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        ring.slots[i].fd = -1;
+        ring.slots[i].tx_head = -1;
+        ring.slots[i].tx_tail = -1;
+    }
+    ring.num_dirty = 0;
+    return 0;
+}
+
+int uring_io_init(int tun_fd, int num_slots) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = RING_ENTRIES * 4;
+
+    memset(&uring_stats, 0, sizeof(uring_stats));
+    ring.fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring.fd < 0) {
+        LOGI("io_uring not available: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+        map_rings(&params) < 0 || probe_ops() < 0 || setup_buffers() < 0 ||
+        setup_files(num_slots + 1) < 0) {
+        LOGI("io_uring lacks required features");
+        uring_io_exit();
+        return -1;
+    }
+    probe_recv_multishot();
+    ring.num_slots = num_slots;
+
+    // The tun fd lives in the last slot
+    if (uring_io_add(num_slots, tun_fd, WATCH_TUN) < 0) {
+        uring_io_exit();
+        return -1;
+    }
+
+    LOGI("Using io_uring for packet I/O%s%s", ring.read_multishot ? " with multishot tun reads" : "",
+         ring.recv_multishot ? "" : ", single socket receives");
+    return 0;
+}
+
+void uring_io_exit() {
+    // Closing the ring cancels everything still pending
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring) {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+    if (ring.sq_ring != NULL) {
+        munmap(ring.sq_ring, ring.sq_ring_size);
+    }
+    if (ring.buf_ring != NULL) {
+        munmap(ring.buf_ring, RX_BUFFERS * sizeof(struct io_uring_buf));
+    }
+
+    // Packets the ring still held go back to the pool
+    for (uint32_t i = 0; i < PACKET_POOL_BUFFERS; i++) {
+        if (ring.rx_owned[i]) {
+            packet_release(packet_from_index(i));
+        }
+    }
+    for (int32_t i = 0; i < TX_ENTRIES; i++) {
+        if (ring.tx_entries[i].packet != NULL) {
+            packet_release(ring.tx_entries[i].packet);
+        }
+    }
+    free(ring.slots);
+    free(ring.dirty);
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+int uring_io_add(int index, int fd, int watch) {
+    if (index < 0 || index > ring.num_slots) {
+        return -1;
+    }
+
+    ring_slot_t *slot = &ring.slots[index];
+    slot->fd = fd;
+    slot->watch = watch;
+    slot->tx_head = -1;
+    slot->tx_tail = -1;
+    slot->tx_inflight = 0;
+
+    // The watch is linked to the table update, so it sees the new file
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL) {
+        slot->fd = -1;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->fd;
+    sqe->len = 1;
+    sqe->off = (uint64_t)index;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = USER_DATA(OP_INTERNAL, 0, index);
+
+    return arm(index);
+}
+
+int uring_io_watch(int index, int watch) {
+    if (index < 0 || index >= ring.num_slots || ring.slots[index].fd < 0) {
+        return -1;
+    }
+    ring.slots[index].watch = watch;
+    return arm(index);
+}
+
+void uring_io_remove(int index) {
+    if (index < 0 || index >= ring.num_slots || ring.slots[index].fd < 0) {
+        return;
+    }
+
+    ring_slot_t *slot = &ring.slots[index];
+    slot->fd = -1;
+    slot->watch = 0;
+    slot->generation++;
+    slot->tx_inflight = 0;
+    slot->starved = 0;
+    while (slot->tx_head >= 0) {
+        int32_t tx = slot->tx_head;
+        slot->tx_head = ring.tx_entries[tx].next;
+        tx_release(tx);
+    }
+    slot->tx_tail = -1;
+
+    // Cancel by file, then empty the table entry. The entry holds its own
+    // reference, so the caller may close its fd right away.
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = index;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED | IORING_ASYNC_CANCEL_ALL;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = USER_DATA(OP_INTERNAL, 0, index);
+    }
+
+    sqe = get_sqe();
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)&sparse_fd;
+        sqe->len = 1;
+        sqe->off = (uint64_t)index;
+        sqe->user_data = USER_DATA(OP_INTERNAL, 0, index);
+    }
+}
+
+int uring_io_send(int index, packet_buf_t *packet, const void *data, size_t len) {
+    if (index < 0 || index >= ring.num_slots) {
+        return -1;
+    }
+    return queue_write(index, packet, data, len);
+}
+
+int uring_io_write_tun(packet_buf_t *packet) {
+    return queue_write(ring.num_slots, packet, packet->data, packet->len);
+}
+
+int uring_io_wait(uring_io_event_t *events, int max, int timeout_ms) {
+    post_buffers();
+
+    // Writes queued since the last call go out as one chain per slot.
+    // Receives that ran out of buffers restart once there are some.
+    int num_dirty = ring.num_dirty;
+    ring.num_dirty = 0;
+    for (int i = 0; i < num_dirty; i++) {
+        int index = ring.dirty[i];
+        ring_slot_t *slot = &ring.slots[index];
+        slot->dirty = 0;
+        if (slot->tx_inflight == 0) {
+            issue_writes(index);
+        }
+        if (slot->starved) {
+            if (ring.rx_posted > 0 && arm(index) == 0) {
+                slot->starved = 0;
+            } else {
+                mark_dirty(index);
+            }
+        }
+    }
+
+    // Only block if nothing has completed yet
+    unsigned head = *ring.cq_head;
+    unsigned ready = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) - head;
+    unsigned queued = ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if ((ready == 0 || queued > 0) && enter(ready == 0 ? 1 : 0, timeout_ms) < 0) {
+        return -1;
+    }
+
+    int count = 0;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && count < max) {
+        const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        head++;
+        if (complete(cqe, &events[count])) {
+            count++;
+        }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+int uring_io_stale(const uring_io_event_t *event) {
+    if (event->slot == URING_IO_TUN) {
+        return 0;
+    }
+    const ring_slot_t *slot = &ring.slots[event->slot];
+    return slot->fd < 0 || slot->generation != event->generation;
+}
+
+void uring_io_release(const uring_io_event_t *event) {
+    if (event->packet != NULL) {
+        packet_release(event->packet);
+    }
+}
+
+void uring_io_get_stats(uring_io_stats_t *stats) {
+    *stats = uring_stats;
+}
@@ -0,0 +1,1348 @@
+// vpn_engine.c
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "include/vpn_engine.h"
+#include "include/domainfilter.h"
+#include "include/filter_ipset.h"
+#include "include/flow_timer.h"
+#include "include/socket_pool.h"
+#include "include/dns_forwarder.h"
+#include "include/packet_builder.h"
+#include "include/packet_pool.h"
+#include "include/packet_trace.h"
+#include "include/uring_io.h"
+
+#define TAG "DomainFilter"
+#include "include/native_log.h"
+
+// Global variables
+static int vpn_fd = -1;
+static int running = 0;             // Cleared by vpn_engine_stop() from any thread
+static vpn_engine_config_t engine_config;
+static int filtered_count = 0;
+static int uring_active = 0;        // Packet I/O goes through uring_io
+static int tun_mtu = PACKET_POOL_DEFAULT_MTU;
+
+// Written by vpn_engine_stop() so the loop sees the stop without waiting
+// out its poll timeout. The mutex keeps a stop racing the end of the loop
+// from writing to a closed descriptor.
+static int wake_fd = -1;
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define WAKE_SLOT (MAX_CONNECTIONS + DNS_FORWARD_SOCKETS)
+
+// Lists (FILTER_CATEGORY_*) whose blocked flows are answered with a TCP
+// reset or an ICMP port unreachable instead of being dropped silently
+static uint8_t reject_categories = 0;
+
+// Answer HTTP and HTTPS handshakes locally and connect upstream only once
+// the first payload has passed the filter
+static int lazy_connect = 1;
+static uint32_t isn_secret = 0;     // Keys initial sequence numbers per start
+
+// Packets through the tun device
+static struct {
+    uint64_t packets_in;
+    uint64_t bytes_in;
+    uint64_t packets_out;
+    uint64_t bytes_out;
+} tun_stats;
+
+// Connection tracking structure
+typedef struct {
+    int protocol;           // IPPROTO_TCP or IPPROTO_UDP
+    uint32_t src_ip;
+    uint16_t src_port;
+    uint32_t dst_ip;
+    uint16_t dst_port;
+    int socket_fd;          // Socket for forwarding traffic
+    uint64_t last_active;   // Timestamp for timeout
+
+    // TCP state tracking. A handshake answered locally makes the engine the
+    // app's TCP peer: tcp_seq_in is the next sequence number toward the app,
+    // counted from the local ISN, and tcp_seq_out the next one expected from
+    // it, acknowledged by ack_payload(). The upstream socket is a connection of
+    // its own, so the server's ISN never reaches the app and there is no
+    // offset to translate; data written back continues from tcp_seq_in.
+    uint32_t tcp_seq_in;    // Sequence number for incoming data
+    uint32_t tcp_seq_out;   // Sequence number for outgoing data
+    uint32_t tcp_ack_in;    // Acknowledgment for incoming data
+    uint32_t tcp_ack_out;   // Acknowledgment for outgoing data
+    int tcp_state;          // TCP connection state
+    uint64_t connect_start; // When the upstream connect was issued, or the handshake answered
+    int answered_locally;   // Handshake answered by accept_locally()
+
+    // Packets whose payload arrived before the upstream connect completed,
+    // or while the flow waits in CONN_STATE_CLASSIFYING for its name
+    packet_buf_t *pending;
+    packet_buf_t *pending_tail;
+    size_t pending_len;     // Payload bytes held
+    int pending_count;
+
+    flow_timer_t idle_timer; // Idle expiry, see expire_connection()
+} connection_t;
+
+// Upstream socket states
+#define CONN_STATE_CONNECTING   1
+#define CONN_STATE_ESTABLISHED  2
+#define CONN_STATE_CLASSIFYING  3   // Handshake answered locally, no upstream socket yet
+
+// Per-flow pending queue bounds
+#define FLOW_PENDING_BYTES  16384
+#define FLOW_PENDING_MAX    32
+
+// Simple connection tracker (in production, use a hash table)
+// Slots never move while in use, so connection pointers stay valid until the
+// connection is closed. Closed slots go on a free list for reuse.
+#define MAX_CONNECTIONS 1024
+static connection_t connections[MAX_CONNECTIONS];
+static int num_connections = 0;     // Slots handed out so far (high-water mark)
+static int free_slots[MAX_CONNECTIONS];
+static int num_free_slots = 0;
+static flow_wheel_t flow_timers;
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Idle timeouts. DNS flows are one request and one answer.
+#define FLOW_TIMEOUT_DNS_MS 5000
+#define FLOW_TIMEOUT_UDP_MS 30000
+#define FLOW_TIMEOUT_TCP_MS 300000
+#define FLOW_TIMEOUT_CONNECT_MS 10000
+
+// Upstream connect metrics
+static struct {
+    uint64_t started;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t latency_total_ms;
+    uint64_t latency_max_ms;
+    uint64_t queued;        // Payloads held until their connect completed
+    uint64_t queue_drops;   // Payloads dropped because the queue was full
+    uint64_t deferred;      // Handshakes answered locally
+    uint64_t unconnected;   // Deferred flows closed without an upstream connect
+} connect_stats;
+
+// Blocked flows answered instead of dropped
+static struct {
+    uint64_t resets;        // TCP resets written to the tun device
+    uint64_t unreachables;  // ICMP port unreachables for UDP
+} reject_stats;
+
+// Forward declarations
+static int process_packet(packet_buf_t *packet);
+static int filter_packet(packet_buf_t *packet);
+static int handle_outgoing_packet(packet_buf_t *packet, int named);
+static void reject_packet(const packet_buf_t *packet);
+static void close_flow(const packet_buf_t *packet);
+static int handle_incoming_data();
+static void handle_upstream_data(connection_t *conn, packet_buf_t *packet, ssize_t received);
+static void drain_dns_answers(int fd);
+static void drain_wake();
+static int send_upstream(connection_t *conn, packet_buf_t *packet);
+static void write_tun(const void *data, size_t len);
+static void write_tun_packet(packet_buf_t *packet);
+static void run_select_loop();
+static int run_uring_loop();
+static void complete_connect(connection_t *conn);
+static int open_protected_socket(int type);
+static connection_t *find_connection_locked(const packet_buf_t *packet);
+static connection_t *find_or_create_connection(const packet_buf_t *packet);
+static int opens_flow(const packet_buf_t *packet);
+static int should_defer_connect(const packet_buf_t *packet);
+static void accept_locally(connection_t *conn, const packet_buf_t *packet);
+static void send_syn_ack(const connection_t *conn);
+static int in_sequence(const connection_t *conn, const packet_buf_t *packet);
+static void ack_payload(connection_t *conn, const packet_buf_t *packet);
+static void send_segment(const connection_t *conn, uint8_t flags);
+static void fail_connection(connection_t *conn);
+static int advance_deferred(connection_t *conn, packet_buf_t *packet, int named, uint8_t *categories);
+static int classify_pending(const connection_t *conn, char *domain, size_t domain_size);
+static int connect_upstream(connection_t *conn);
+static void close_connection(connection_t *conn);
+static int queue_pending(connection_t *conn, packet_buf_t *packet);
+static void flush_pending(connection_t *conn);
+static void release_pending(connection_t *conn);
+static uint64_t connection_timeout(const connection_t *conn);
+static void expire_connections();
+static void close_all_connections();
+static void rotate_dns_socket(uint64_t now);
+static uint64_t get_time_ms();
+
+// Run the packet loop on the calling thread until vpn_engine_stop()
+int vpn_engine_run(int fd, int mtu, const vpn_engine_config_t *config) {
+    if (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        LOGI("Already running, ignoring start request");
+        return -1;
+    }
+
+    // Packets are read into pool buffers sized for the interface
+    if (packet_pool_init(mtu) < 0) {
+        return -1;
+    }
+
+    LOGI("Starting native packet processing with fd: %d", fd);
+    vpn_fd = fd;
+    tun_mtu = mtu;
+    engine_config = *config;
+    __atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+    filtered_count = 0;
+    isn_secret = (uint32_t)get_time_ms() * 2654435761u ^ (uint32_t)getpid();
+
+    // Make socket non-blocking
+    int flags = fcntl(vpn_fd, F_GETFL, 0);
+    fcntl(vpn_fd, F_SETFL, flags | O_NONBLOCK);
+
+    // Start creating protected upstream sockets ahead of time
+    socket_pool_config_t pool_config = {
+            .protect = engine_config.protect_batch,
+            .thread_exit = engine_config.thread_exit,
+            .ctx = engine_config.ctx,
+    };
+    socket_pool_start(&pool_config);
+
+    // All DNS queries share a few upstream sockets
+    int dns_fds[DNS_FORWARD_SOCKETS];
+    int num_dns_fds = 0;
+    while (num_dns_fds < DNS_FORWARD_SOCKETS &&
+           (dns_fds[num_dns_fds] = open_protected_socket(SOCK_DGRAM)) >= 0) {
+        num_dns_fds++;
+    }
+    if (dns_forwarder_start(dns_fds, num_dns_fds, get_time_ms()) < 0) {
+        LOGE("DNS forwarder unavailable, queries use per-flow sockets");
+    }
+
+    // Initialize connection tracking
+    memset(connections, 0, sizeof(connections));
+    num_connections = 0;
+    num_free_slots = 0;
+    flow_wheel_init(&flow_timers, get_time_ms());
+    memset(&connect_stats, 0, sizeof(connect_stats));
+    memset(&reject_stats, 0, sizeof(reject_stats));
+    memset(&tun_stats, 0, sizeof(tun_stats));
+
+    pthread_mutex_lock(&wake_mutex);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_unlock(&wake_mutex);
+
+    // Main processing loop (on this thread). io_uring where the kernel
+    // allows it, read/select otherwise. Connection slots double as ring
+    // slots, the DNS sockets and the wake eventfd follow them.
+    uring_active = uring_io_init(vpn_fd, WAKE_SLOT + 1) == 0;
+    if (uring_active) {
+        // Slots follow the forwarder's socket indices, which rotation keeps
+        num_dns_fds = dns_forwarder_fds(dns_fds, DNS_FORWARD_SOCKETS);
+        for (int i = 0; i < num_dns_fds; i++) {
+            uring_io_add(MAX_CONNECTIONS + i, dns_fds[i], URING_IO_READABLE);
+        }
+        if (wake_fd >= 0) {
+            uring_io_add(WAKE_SLOT, wake_fd, URING_IO_READABLE);
+        }
+        int failed = run_uring_loop() < 0;
+        uring_io_exit();
+        uring_active = 0;
+
+        // The flows and sockets carry over; the select loop finds them
+        // without the ring
+        if (failed && __atomic_load_n(&running, __ATOMIC_RELAXED)) {
+            LOGE("io_uring stopped working, falling back to select");
+            run_select_loop();
+        }
+    } else {
+        run_select_loop();
+    }
+
+    // Everything the loop used is torn down here, on its own thread, so
+    // nothing is closed under a packet still being handled. The pool thread
+    // calls the protect hooks, so it is gone before vpn_engine_run returns
+    // and the caller can release their owner.
+    close_all_connections();
+    socket_pool_stop();
+    dns_forwarder_stop();
+
+    pthread_mutex_lock(&wake_mutex);
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    pthread_mutex_unlock(&wake_mutex);
+
+    LOGI("Packet processing loop ended");
+    return 0;
+}
+
+// Ask the packet loop to stop. It closes every flow before
+// vpn_engine_run() returns.
+void vpn_engine_stop() {
+    LOGI("Stopping native packet processing");
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&wake_mutex);
+    if (wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            LOGE("Failed to wake the packet loop: %s", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&wake_mutex);
+}
+
+// Close every flow. Runs on the loop thread once the loop is over.
+static void close_all_connections() {
+    pthread_mutex_lock(&conn_mutex);
+    for (int i = 0; i < num_connections; i++) {
+        if (connections[i].socket_fd > 0) {
+            close(connections[i].socket_fd);
+            connections[i].socket_fd = -1;
+        }
+        release_pending(&connections[i]);
+    }
+    num_connections = 0;
+    num_free_slots = 0;
+    pthread_mutex_unlock(&conn_mutex);
+
+    LOGI("Native packet processing stopped");
+}
+
+int vpn_engine_filtered_count() {
+    return filtered_count;
+}
+
+void vpn_engine_set_reject_categories(uint8_t categories) {
+    __atomic_store_n(&reject_categories, categories, __ATOMIC_RELAXED);
+}
+
+void vpn_engine_set_lazy_connect(int enabled) {
+    __atomic_store_n(&lazy_connect, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+void vpn_engine_get_stats(vpn_engine_stats_t *stats) {
+    pthread_mutex_lock(&conn_mutex);
+    stats->connects_started = connect_stats.started;
+    stats->connects_completed = connect_stats.completed;
+    stats->connects_failed = connect_stats.failed;
+    stats->connect_latency_avg_ms = connect_stats.completed ? connect_stats.latency_total_ms / connect_stats.completed : 0;
+    stats->connect_latency_max_ms = connect_stats.latency_max_ms;
+    stats->queued = connect_stats.queued;
+    stats->queue_drops = connect_stats.queue_drops;
+    stats->resets = reject_stats.resets;
+    stats->unreachables = reject_stats.unreachables;
+    stats->deferred = connect_stats.deferred;
+    stats->unconnected = connect_stats.unconnected;
+    stats->packets_in = tun_stats.packets_in;
+    stats->bytes_in = tun_stats.bytes_in;
+    stats->packets_out = tun_stats.packets_out;
+    stats->bytes_out = tun_stats.bytes_out;
+    stats->flows = (uint32_t)(num_connections - num_free_slots);
+    stats->filtered = (uint32_t)filtered_count;
+    pthread_mutex_unlock(&conn_mutex);
+}
+
+// Main packet processing function
+static int process_packet(packet_buf_t *packet) {
+    tun_stats.packets_in++;
+    tun_stats.bytes_in += packet->len;
+    packet->trace = packet_trace_sample();
+    uint64_t trace_start = packet_trace_begin(packet->trace);
+    int result = filter_packet(packet);
+    packet_trace_end(packet->trace, PACKET_TRACE_PACKET, trace_start);
+    return result;
+}
+
+// Drop a packet from the tun interface if it is blocked, forward it if not
+static int filter_packet(packet_buf_t *packet) {
+    if (packet->len < sizeof(struct iphdr)) {
+        LOGE("Packet too small");
+        return -1;
+    }
+
+    // Header offsets travel with the buffer to the later stages
+    packet_parse(packet);
+    const struct iphdr *ip = (const struct iphdr *)packet->data;
+
+    // Destinations learned from blocked DNS answers are dropped before any
+    // payload parsing, so flows without a visible name are caught as well.
+    // The entry keeps the lists that blocked the name, for reject mode.
+    uint8_t learned = 0;
+    if (ip->version == 4) {
+        learned = ipset_contains_v4(ip->daddr);
+    } else if (ip->version == 6 && packet->len >= 40) {
+        learned = ipset_contains(packet->data + 24);
+    }
+    if (learned) {
+        filtered_count++;
+        if (packet->version == 4 && (learned & __atomic_load_n(&reject_categories, __ATOMIC_RELAXED))) {
+            reject_packet(packet);
+        }
+        return 0;
+    }
+
+    // Handle only IPv4 packets for simplicity
+    if (packet->version != 4) {
+        return -1;
+    }
+
+    // Extract domain for DNS or HTTP/HTTPS traffic
+    char domain[256];
+    uint64_t trace_start = packet_trace_begin(packet->trace);
+    int domain_len = extract_domain_from_packet(packet->data, packet->len, domain, sizeof(domain));
+    packet_trace_end(packet->trace, PACKET_TRACE_EXTRACT, trace_start);
+
+    if (domain_len > 0) {
+        // Check if domain is blocked
+        trace_start = packet_trace_begin(packet->trace);
+        uint8_t categories;
+        int blocked = filter_check_domain_categories(domain, &categories);
+        packet_trace_end(packet->trace, PACKET_TRACE_FILTER, trace_start);
+
+        if (blocked) {
+            LOGI("Blocking domain: %s", domain);
+            filtered_count++;
+            // A TCP flow is only blocked once its Host or SNI shows up. Its
+            // connection, deferred or not, goes now instead of at idle expiry.
+            if (packet->protocol == IPPROTO_TCP) {
+                close_flow(packet);
+            }
+            // Return without forwarding (block). A dropped request is
+            // retried with backoff for tens of seconds; a rejected one fails
+            // within a round trip.
+            if (categories & __atomic_load_n(&reject_categories, __ATOMIC_RELAXED)) {
+                reject_packet(packet);
+            }
+            return 0;
+        }
+    }
+
+    // DNS goes through the shared forwarder sockets
+    if (packet->protocol == IPPROTO_UDP && packet->dst_port == 53) {
+        trace_start = packet_trace_begin(packet->trace);
+        int forwarded = dns_forwarder_query(packet->data, packet->len) == 0;
+        packet_trace_end(packet->trace, PACKET_TRACE_DNS, trace_start);
+        if (forwarded) {
+            return 0;
+        }
+    }
+
+    // Forward packet to real network
+    return handle_outgoing_packet(packet, domain_len > 0);
+}
+
+// Handle outgoing packet (from app to network). named is set if the packet
+// itself carried a name that passed the filter.
+static int handle_outgoing_packet(packet_buf_t *packet, int named) {
+    // Unsupported protocol or truncated headers
+    if (packet->protocol != IPPROTO_TCP && packet->protocol != IPPROTO_UDP) {
+        return -1;
+    }
+
+    // Find or create connection tracking entry
+    uint64_t trace_start = packet_trace_begin(packet->trace);
+    connection_t *conn = find_or_create_connection(packet);
+    packet_trace_end(packet->trace, PACKET_TRACE_CONNECTION, trace_start);
+    if (conn == NULL) {
+        if (opens_flow(packet)) {
+            LOGE("Failed to create connection");
+        }
+        return -1;
+    }
+
+    // Handle TCP state tracking here (simplified)
+    // In reality, you'd need full TCP state machine
+    if (conn->tcp_state == CONN_STATE_CLASSIFYING) {
+        uint8_t categories = 0;
+        pthread_mutex_lock(&conn_mutex);
+        int advanced = advance_deferred(conn, packet, named, &categories);
+        pthread_mutex_unlock(&conn_mutex);
+
+        // A name that only showed up once several segments were put together
+        if (advanced > 0) {
+            filtered_count++;
+            if (categories & __atomic_load_n(&reject_categories, __ATOMIC_RELAXED)) {
+                reject_packet(packet);
+            }
+            return 0;
+        }
+        return advanced;
+    }
+
+    // The engine is the app's TCP peer once it answered the handshake, and
+    // takes its data in order only
+    if (conn->answered_locally && packet->payload_len > 0 && !in_sequence(conn, packet)) {
+        return 0;
+    }
+
+    // Hold the packet until the upstream connect completes
+    if (packet->payload_len > 0 && conn->tcp_state == CONN_STATE_CONNECTING) {
+        if (queue_pending(conn, packet) < 0) {
+            return -1;
+        }
+        if (conn->answered_locally) {
+            ack_payload(conn, packet);
+        }
+        return 0;
+    }
+
+    // Forward payload to real network if there's data to send
+    if (packet->payload_len > 0 && send_upstream(conn, packet) < 0) {
+        return -1;
+    }
+    if (conn->answered_locally && packet->payload_len > 0) {
+        ack_payload(conn, packet);
+    }
+
+    // Update last active time
+    conn->last_active = get_time_ms();
+
+    return 0;
+}
+
+// Answer a blocked packet as its destination would if nothing listened
+// there: a reset for TCP, a port unreachable for UDP
+static void reject_packet(const packet_buf_t *packet) {
+    unsigned char reply[PACKET_ICMP_UNREACH_MAX];
+    int reply_len = -1;
+
+    if (packet->protocol == IPPROTO_TCP) {
+        reply_len = packet_build_tcp_reset4(reply, sizeof(reply), packet->data, packet->len);
+    } else if (packet->protocol == IPPROTO_UDP) {
+        reply_len = packet_build_icmp_unreach4(reply, sizeof(reply), packet->data, packet->len, ICMP_PORT_UNREACH);
+    }
+    if (reply_len <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+    if (packet->protocol == IPPROTO_TCP) {
+        reject_stats.resets++;
+    } else {
+        reject_stats.unreachables++;
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    write_tun(reply, (size_t)reply_len);
+}
+
+// Close the connection tracking entry of a packet's flow, if there is one
+static void close_flow(const packet_buf_t *packet) {
+    pthread_mutex_lock(&conn_mutex);
+    connection_t *conn = find_connection_locked(packet);
+    if (conn != NULL) {
+        close_connection(conn);
+    }
+    pthread_mutex_unlock(&conn_mutex);
+}
+
+// Handle incoming data (from network to app)
+static int handle_incoming_data() {
+    fd_set readfds;
+    fd_set writefds;
+    struct timeval tv;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    int max_fd = -1;
+
+    // Add all connection sockets to select set. Sockets still connecting
+    // are watched for writability, which signals connect completion.
+    pthread_mutex_lock(&conn_mutex);
+    for (int i = 0; i < num_connections; i++) {
+        if (connections[i].socket_fd > 0) {
+            if (connections[i].tcp_state == CONN_STATE_CONNECTING) {
+                FD_SET(connections[i].socket_fd, &writefds);
+            } else {
+                FD_SET(connections[i].socket_fd, &readfds);
+            }
+            if (connections[i].socket_fd > max_fd) {
+                max_fd = connections[i].socket_fd;
+            }
+        }
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    // Shared DNS sockets
+    int dns_fds[DNS_FORWARD_SOCKETS];
+    int num_dns_fds = dns_forwarder_fds(dns_fds, DNS_FORWARD_SOCKETS);
+    for (int i = 0; i < num_dns_fds; i++) {
+        FD_SET(dns_fds[i], &readfds);
+        if (dns_fds[i] > max_fd) {
+            max_fd = dns_fds[i];
+        }
+    }
+
+    // A stop request ends the wait early
+    if (wake_fd >= 0) {
+        FD_SET(wake_fd, &readfds);
+        if (wake_fd > max_fd) {
+            max_fd = wake_fd;
+        }
+    }
+
+    if (max_fd < 0) {
+        return 0; // No connections
+    }
+
+    // Set timeout to 10ms
+    tv.tv_sec = 0;
+    tv.tv_usec = 10000;
+
+    int ready = select(max_fd + 1, &readfds, &writefds, NULL, &tv);
+    if (ready <= 0) {
+        return 0; // No data or error
+    }
+
+    if (wake_fd >= 0 && FD_ISSET(wake_fd, &readfds)) {
+        drain_wake();
+    }
+
+    // Deliver DNS answers straight to the client
+    for (int i = 0; i < num_dns_fds; i++) {
+        if (FD_ISSET(dns_fds[i], &readfds)) {
+            drain_dns_answers(dns_fds[i]);
+        }
+    }
+
+    // Process readable sockets
+    pthread_mutex_lock(&conn_mutex);
+    for (int i = 0; i < num_connections; i++) {
+        if (connections[i].socket_fd > 0 && FD_ISSET(connections[i].socket_fd, &writefds)) {
+            complete_connect(&connections[i]);
+            continue;
+        }
+
+        if (connections[i].socket_fd > 0 && FD_ISSET(connections[i].socket_fd, &readfds)) {
+            packet_buf_t *packet = packet_alloc();
+            if (packet == NULL) {
+                continue; // Pool exhausted, the socket stays readable
+            }
+            ssize_t received = recv(connections[i].socket_fd, packet->data, packet->capacity, 0);
+            packet->len = received > 0 ? (uint32_t)received : 0;
+            handle_upstream_data(&connections[i], packet, received < 0 ? -errno : received);
+            packet_release(packet);
+        }
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    return 0;
+}
+
+// Handle what a recv on an upstream socket returned: data in packet, 0 at
+// EOF or -errno. Caller holds conn_mutex and keeps its packet reference.
+static void handle_upstream_data(connection_t *conn, packet_buf_t *packet, ssize_t received) {
+    if (received > 0) {
+        packet->trace = packet_trace_sample();
+        uint64_t trace_start = packet_trace_begin(packet->trace);
+
+        // Update last active time
+        conn->last_active = get_time_ms();
+
+        // Remember where blocked names resolve to
+        if (conn->protocol == IPPROTO_UDP && conn->dst_port == 53) {
+            ipset_learn_dns_response(packet->data, (size_t)received);
+        }
+
+        // Create a response packet. The payload already sits in a pool
+        // buffer; headers go in front of it with packet_push().
+        size_t packet_len = 0;
+
+        // Craft IP and TCP/UDP headers (this is complex!)
+        // In reality, you need to build proper headers with checksums
+
+        // This is where you'd create a proper response packet
+        // with correct IP, TCP/UDP headers for writing to the VPN interface
+
+        // For TCP, you'd also need to update sequence numbers, etc.
+
+        // Write response packet to VPN interface
+        if (packet_len > 0) {
+            write_tun_packet(packet);
+        }
+
+        packet_trace_end(packet->trace, PACKET_TRACE_UPSTREAM, trace_start);
+    } else if (received == 0) {
+        // Connection closed
+        close_connection(conn);
+    } else if (received != -EAGAIN && received != -EWOULDBLOCK) {
+        LOGE("Recv error: %s", strerror((int)-received));
+        close_connection(conn);
+    }
+}
+
+// Reset the wake eventfd. The stop itself is seen through running.
+static void drain_wake() {
+    uint64_t count;
+    while (read(wake_fd, &count, sizeof(count)) > 0) {
+    }
+}
+
+// Deliver DNS answers waiting on a forwarder socket straight to the client
+static void drain_dns_answers(int fd) {
+    unsigned char packet[4096 + PACKET_IPV4_HEADER + PACKET_UDP_HEADER];
+    int packet_len;
+    while ((packet_len = dns_forwarder_receive(fd, packet, sizeof(packet))) >= 0) {
+        if (packet_len > 0) {
+            write_tun(packet, (size_t)packet_len);
+        }
+    }
+}
+
+// Send a packet's payload on a connection's upstream socket
+static int send_upstream(connection_t *conn, packet_buf_t *packet) {
+    const unsigned char *data = packet->data + packet->payload_offset;
+    size_t len = packet->payload_len;
+    uint64_t trace_start = packet_trace_begin(packet->trace);
+    int result = 0;
+
+    if (uring_active) {
+        result = uring_io_send((int)(conn - connections), packet, data, len);
+    } else if (send(conn->socket_fd, data, len, MSG_NOSIGNAL) < 0) {
+        LOGE("Failed to send data: %s", strerror(errno));
+        result = -1;
+    }
+
+    packet_trace_end(packet->trace, PACKET_TRACE_SEND, trace_start);
+    return result;
+}
+
+// Write a pool packet to the VPN interface
+static void write_tun_packet(packet_buf_t *packet) {
+    tun_stats.packets_out++;
+    tun_stats.bytes_out += packet->len;
+    if (!uring_active || uring_io_write_tun(packet) < 0) {
+        write(vpn_fd, packet->data, packet->len);
+    }
+}
+
+// Write a packet built outside the pool to the VPN interface. The ring
+// only takes pool buffers, so it is copied into one first.
+static void write_tun(const void *data, size_t len) {
+    packet_buf_t *packet = uring_active ? packet_alloc() : NULL;
+    if (packet == NULL || len > packet->capacity) {
+        write(vpn_fd, data, len);
+    } else {
+        memcpy(packet->data, data, len);
+        packet->len = (uint32_t)len;
+        write_tun_packet(packet);
+    }
+
+    if (packet != NULL) {
+        packet_release(packet);
+    }
+}
+
+// Packet loop on plain read/select, with a syscall or more per packet
+static void run_select_loop() {
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        // Process outgoing packets (from apps to VPN). Stages that need the
+        // packet later take their own reference.
+        packet_buf_t *packet = packet_alloc();
+        if (packet != NULL) {
+            ssize_t length = read(vpn_fd, packet->data, packet->capacity);
+            if (length > 0) {
+                packet->len = (uint32_t)length;
+                process_packet(packet);
+            } else if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGE("Error reading from VPN interface: %s", strerror(errno));
+            }
+            packet_release(packet);
+        }
+
+        // Process incoming packets (from network to apps)
+        handle_incoming_data();
+
+        // Close connections whose idle timers are due
+        expire_connections();
+
+        // Small sleep to prevent CPU thrashing
+        usleep(10000); // 10ms
+    }
+}
+
+// Packet loop on io_uring. Everything queued while handling a batch of
+// events is submitted with the wait for the next batch. Returns -1 if the
+// ring stopped working before vpn_engine_stop().
+static int run_uring_loop() {
+    uring_io_event_t events[URING_IO_BATCH];
+    int failed = 0;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED) && !failed) {
+        int count = uring_io_wait(events, URING_IO_BATCH, 10);
+        if (count < 0) {
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const uring_io_event_t *event = &events[i];
+
+            // The slot may have been closed by an earlier event of the batch
+            if (uring_io_stale(event)) {
+                uring_io_release(event);
+                continue;
+            }
+
+            if (event->slot == URING_IO_TUN && event->result < 0) {
+                // The ring no longer reads the tun. The rest of the batch
+                // is still handled, so no packet is left referenced.
+                failed = 1;
+            } else if (event->slot == URING_IO_TUN) {
+                // Outgoing packets (from apps to VPN)
+                process_packet(event->packet);
+            } else if (event->slot == WAKE_SLOT) {
+                drain_wake();
+            } else if (event->slot >= MAX_CONNECTIONS) {
+                drain_dns_answers(event->fd);
+            } else {
+                // Incoming data or connect completion on an upstream socket
+                pthread_mutex_lock(&conn_mutex);
+                connection_t *conn = &connections[event->slot];
+                if (event->type == URING_IO_WRITABLE) {
+                    complete_connect(conn);
+                } else {
+                    handle_upstream_data(conn, event->packet, event->result);
+                }
+                pthread_mutex_unlock(&conn_mutex);
+            }
+            uring_io_release(event);
+        }
+
+        // Close connections whose idle timers are due
+        expire_connections();
+    }
+    return failed ? -1 : 0;
+}
+
+// Find the connection tracking entry of a packet's flow, or NULL.
+// Caller holds conn_mutex.
+static connection_t *find_connection_locked(const packet_buf_t *packet) {
+    const struct iphdr *ip = (const struct iphdr *)packet->data;
+    uint32_t src_ip = ntohl(ip->saddr);
+    uint32_t dst_ip = ntohl(ip->daddr);
+
+    for (int i = 0; i < num_connections; i++) {
+        if ((connections[i].socket_fd > 0 || connections[i].tcp_state == CONN_STATE_CLASSIFYING) &&
+            connections[i].protocol == ip->protocol &&
+            connections[i].src_ip == src_ip &&
+            connections[i].src_port == packet->src_port &&
+            connections[i].dst_ip == dst_ip &&
+            connections[i].dst_port == packet->dst_port) {
+            return &connections[i];
+        }
+    }
+    return NULL;
+}
+
+// Find or create connection tracking entry
+static connection_t *find_or_create_connection(const packet_buf_t *packet) {
+    const struct iphdr *ip = (const struct iphdr *)packet->data;
+    uint32_t src_ip = ntohl(ip->saddr);
+    uint32_t dst_ip = ntohl(ip->daddr);
+    uint16_t src_port = packet->src_port;
+    uint16_t dst_port = packet->dst_port;
+
+    if (packet->protocol != IPPROTO_TCP && packet->protocol != IPPROTO_UDP) {
+        return NULL; // Unsupported protocol
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+
+    // Look for existing connection
+    connection_t *existing = find_connection_locked(packet);
+    if (existing != NULL) {
+        pthread_mutex_unlock(&conn_mutex);
+        return existing;
+    }
+
+    // Only a SYN opens a TCP flow. A FIN, ACK, reset or retransmission for
+    // a flow that is gone, such as one closed as blocked, must never connect
+    // to its destination again.
+    if (!opens_flow(packet)) {
+        pthread_mutex_unlock(&conn_mutex);
+        return NULL;
+    }
+
+    // Create new connection if not found, reusing a closed slot first
+    if (num_free_slots > 0 || num_connections < MAX_CONNECTIONS) {
+        int slot = num_free_slots > 0 ? free_slots[--num_free_slots] : num_connections++;
+        connection_t *conn = &connections[slot];
+        memset(conn, 0, sizeof(connection_t));
+        conn->socket_fd = -1;
+
+        conn->protocol = ip->protocol;
+        conn->src_ip = src_ip;
+        conn->src_port = src_port;
+        conn->dst_ip = dst_ip;
+        conn->dst_port = dst_port;
+
+        if (should_defer_connect(packet)) {
+            accept_locally(conn, packet);
+        } else if (connect_upstream(conn) < 0) {
+            close_connection(conn);
+            pthread_mutex_unlock(&conn_mutex);
+            return NULL;
+        }
+        flow_timer_arm(&flow_timers, &conn->idle_timer, connection_timeout(conn));
+
+        pthread_mutex_unlock(&conn_mutex);
+        return conn;
+    }
+
+    pthread_mutex_unlock(&conn_mutex);
+    return NULL; // Too many connections
+}
+
+// Open and connect the upstream socket of a connection. Returns -1 if that
+// failed; the caller closes the connection. Caller holds conn_mutex.
+static int connect_upstream(connection_t *conn) {
+    int slot = (int)(conn - connections);
+
+    // Create socket for real network
+    int sock_type = (conn->protocol == IPPROTO_TCP) ? SOCK_STREAM : SOCK_DGRAM;
+    conn->socket_fd = open_protected_socket(sock_type);
+    conn->tcp_state = CONN_STATE_ESTABLISHED;
+
+    if (conn->socket_fd < 0) {
+        return -1;
+    }
+
+    // Make socket non-blocking before connecting, so a slow destination
+    // never stalls the packet loop
+    int flags = fcntl(conn->socket_fd, F_GETFL, 0);
+    fcntl(conn->socket_fd, F_SETFL, flags | O_NONBLOCK);
+
+    // For UDP, connect is optional but simplifies sending
+    // For TCP, we must connect. It completes in handle_incoming_data().
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(conn->dst_port);
+    addr.sin_addr.s_addr = htonl(conn->dst_ip);
+
+    conn->connect_start = get_time_ms();
+    if (connect(conn->socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            LOGE("Failed to connect socket: %s", strerror(errno));
+            return -1;
+        }
+        conn->tcp_state = CONN_STATE_CONNECTING;
+        connect_stats.started++;
+    }
+
+    // Watch for connect completion first, then for data
+    if (uring_active && uring_io_add(slot, conn->socket_fd, conn->tcp_state == CONN_STATE_CONNECTING
+                                                            ? URING_IO_WRITABLE : URING_IO_RECV) < 0) {
+        LOGE("Failed to add socket to the ring");
+        return -1;
+    }
+
+    conn->last_active = conn->connect_start;
+    return 0;
+}
+
+// Nonzero if a packet without a flow may create one: any UDP datagram,
+// but only the SYN of a TCP handshake
+static int opens_flow(const packet_buf_t *packet) {
+    if (packet->protocol != IPPROTO_TCP) {
+        return 1;
+    }
+
+    const struct tcphdr *tcp = (const struct tcphdr *)(packet->data + packet->l4_offset);
+    return tcp->syn && !tcp->ack && !tcp->rst;
+}
+
+// Nonzero if a packet opens a flow whose first payload names its
+// destination: a SYN to HTTP or HTTPS, whose clients speak first
+static int should_defer_connect(const packet_buf_t *packet) {
+    if (!__atomic_load_n(&lazy_connect, __ATOMIC_RELAXED) || packet->protocol != IPPROTO_TCP ||
+        (packet->dst_port != 80 && packet->dst_port != 443)) {
+        return 0;
+    }
+    return opens_flow(packet);
+}
+
+// Take on a client handshake without an upstream socket. The flow waits in
+// CONN_STATE_CLASSIFYING until its first request or ClientHello has been
+// filtered; the SYN itself is answered by advance_deferred(). Caller holds
+// conn_mutex.
+static void accept_locally(connection_t *conn, const packet_buf_t *packet) {
+    const struct tcphdr *tcp = (const struct tcphdr *)(packet->data + packet->l4_offset);
+
+    // Clock plus a keyed hash of the flow, as in RFC 6528
+    uint32_t hash = (conn->src_ip ^ isn_secret) * 2654435761u;
+    hash ^= ((uint32_t)conn->src_port << 16 | conn->dst_port) * 2246822519u;
+    hash ^= conn->dst_ip * 3266489917u;
+    uint32_t isn = hash + (uint32_t)(packet_trace_clock() / 4000);
+
+    conn->tcp_state = CONN_STATE_CLASSIFYING;
+    conn->answered_locally = 1;
+    conn->tcp_seq_in = isn + 1;
+    conn->tcp_seq_out = ntohl(tcp->seq) + 1;
+    conn->last_active = get_time_ms();
+    conn->connect_start = conn->last_active;
+    connect_stats.deferred++;
+}
+
+// Answer the client's SYN as the destination would. Caller holds conn_mutex.
+static void send_syn_ack(const connection_t *conn) {
+    unsigned char reply[PACKET_IPV4_HEADER + PACKET_TCP_HEADER + 4];
+    int reply_len = packet_build_tcp4(reply, sizeof(reply), htonl(conn->dst_ip), conn->dst_port,
+                                      htonl(conn->src_ip), conn->src_port, conn->tcp_seq_in - 1,
+                                      conn->tcp_seq_out, TH_SYN | TH_ACK,
+                                      (uint16_t)(tun_mtu - PACKET_IPV4_HEADER - PACKET_TCP_HEADER));
+    if (reply_len > 0) {
+        write_tun(reply, (size_t)reply_len);
+    }
+}
+
+// Nonzero if a payload segment of a flow whose handshake was answered
+// locally is the one expected next. Retransmissions of acknowledged data,
+// and segments after a gap, are answered with the current ACK instead; the
+// app sends the missing data again once it sees the duplicate.
+static int in_sequence(const connection_t *conn, const packet_buf_t *packet) {
+    const struct tcphdr *tcp = (const struct tcphdr *)(packet->data + packet->l4_offset);
+    if (ntohl(tcp->seq) == conn->tcp_seq_out) {
+        return 1;
+    }
+
+    send_segment(conn, TH_ACK);
+    return 0;
+}
+
+// Acknowledge an in-sequence segment once it was queued or sent upstream
+static void ack_payload(connection_t *conn, const packet_buf_t *packet) {
+    conn->tcp_seq_out += (uint32_t)packet->payload_len;
+    send_segment(conn, TH_ACK);
+}
+
+// Send the app a segment without payload, acknowledging everything taken
+// from it so far. Caller holds conn_mutex.
+static void send_segment(const connection_t *conn, uint8_t flags) {
+    unsigned char reply[PACKET_IPV4_HEADER + PACKET_TCP_HEADER];
+    int reply_len = packet_build_tcp4(reply, sizeof(reply), htonl(conn->dst_ip), conn->dst_port,
+                                      htonl(conn->src_ip), conn->src_port, conn->tcp_seq_in,
+                                      conn->tcp_seq_out, flags, 0);
+    if (reply_len > 0) {
+        write_tun(reply, (size_t)reply_len);
+    }
+}
+
+// Move a flow in CONN_STATE_CLASSIFYING along with a packet that passed
+// the filter. Payload is held in the pending queue until the request or
+// ClientHello named its destination, ended without a name, or outgrew the
+// queue; then the flow connects upstream and complete_connect() sends what
+// was held. named is set if the packet itself carried an allowed name.
+// Returns 0 if the packet was handled, -1 if the flow could not be
+// connected, and 1 if the held bytes named a blocked destination, whose
+// categories are stored and whose flow is closed. Caller holds conn_mutex.
+static int advance_deferred(connection_t *conn, packet_buf_t *packet, int named, uint8_t *categories) {
+    const struct tcphdr *tcp = (const struct tcphdr *)(packet->data + packet->l4_offset);
+
+    // Given up before sending anything
+    if (tcp->rst || tcp->fin) {
+        close_connection(conn);
+        return 0;
+    }
+
+    conn->last_active = get_time_ms();
+
+    // The SYN, or a retransmission of it if the SYN-ACK was lost
+    if (tcp->syn) {
+        send_syn_ack(conn);
+        return 0;
+    }
+
+    // The ACK completing the handshake
+    if (packet->payload_len == 0 || !in_sequence(conn, packet)) {
+        return 0;
+    }
+
+    // Held until the name shows up. A segment that does not fit is left
+    // unacknowledged for the app to send again once the flow is connected.
+    int held = queue_pending(conn, packet) == 0;
+    if (held) {
+        ack_payload(conn, packet);
+    }
+
+    if (held && !named) {
+        char domain[256];
+        int domain_len = classify_pending(conn, domain, sizeof(domain));
+        if (domain_len == 0) {
+            return 0;
+        }
+        if (domain_len > 0 && filter_check_domain_categories(domain, categories)) {
+            LOGI("Blocking domain: %s", domain);
+            close_connection(conn);
+            return 1;
+        }
+    }
+
+    if (connect_upstream(conn) < 0) {
+        fail_connection(conn);
+        return -1;
+    }
+    flow_timer_arm(&flow_timers, &conn->idle_timer, connection_timeout(conn));
+
+    // Connected at once, as to a local address
+    if (conn->tcp_state == CONN_STATE_ESTABLISHED) {
+        flush_pending(conn);
+    }
+    return 0;
+}
+
+// Look for a name in the payload held for a flow in CONN_STATE_CLASSIFYING,
+// see extract_domain_from_stream(). Caller holds conn_mutex.
+static int classify_pending(const connection_t *conn, char *domain, size_t domain_size) {
+    const packet_buf_t *packet = conn->pending;
+    if (packet->next == NULL) {
+        return extract_domain_from_stream(packet->data + packet->payload_offset, packet->payload_len,
+                                          conn->dst_port, domain, domain_size);
+    }
+
+    unsigned char stream[FLOW_PENDING_BYTES];
+    size_t stream_len = 0;
+    for (; packet != NULL; packet = packet->next) {
+        memcpy(stream + stream_len, packet->data + packet->payload_offset, packet->payload_len);
+        stream_len += packet->payload_len;
+    }
+    return extract_domain_from_stream(stream, stream_len, conn->dst_port, domain, domain_size);
+}
+
+// Idle timeout for a connection by protocol
+static uint64_t connection_timeout(const connection_t *conn) {
+    if (conn->tcp_state == CONN_STATE_CONNECTING || conn->tcp_state == CONN_STATE_CLASSIFYING) {
+        return FLOW_TIMEOUT_CONNECT_MS;
+    }
+    if (conn->protocol == IPPROTO_TCP) {
+        return FLOW_TIMEOUT_TCP_MS;
+    }
+    return conn->dst_port == 53 ? FLOW_TIMEOUT_DNS_MS : FLOW_TIMEOUT_UDP_MS;
+}
+
+// Close a connection and release its slot. Caller holds conn_mutex.
+static void close_connection(connection_t *conn) {
+    if (uring_active) {
+        uring_io_remove((int)(conn - connections));
+    }
+    if (conn->socket_fd >= 0) {
+        close(conn->socket_fd);
+    }
+    conn->socket_fd = -1;
+    if (conn->tcp_state == CONN_STATE_CLASSIFYING) {
+        connect_stats.unconnected++;
+    }
+    conn->tcp_state = 0;
+    release_pending(conn);
+    flow_timer_cancel(&conn->idle_timer);
+    free_slots[num_free_slots++] = (int)(conn - connections);
+}
+
+// Close a connection whose upstream connect failed. An app whose handshake
+// was answered locally believes the flow is up and its data delivered, so
+// it gets a reset instead of waiting out its own timeout. Caller holds
+// conn_mutex.
+static void fail_connection(connection_t *conn) {
+    if (conn->answered_locally) {
+        send_segment(conn, TH_RST | TH_ACK);
+    }
+    close_connection(conn);
+}
+
+// Idle timer callback. Traffic only updates last_active, so a timer that
+// fires on an active connection is pushed back by the remaining time.
+static void expire_connection(flow_timer_t *timer, void *ctx) {
+    connection_t *conn = flow_timer_entry(timer, connection_t, idle_timer);
+    uint64_t now = *(const uint64_t *)ctx;
+    uint64_t timeout = connection_timeout(conn);
+
+    // A pending connect is timed from when it was issued, and a flow being
+    // classified from its handshake, not from the last queued packet
+    uint64_t since = conn->tcp_state == CONN_STATE_CONNECTING || conn->tcp_state == CONN_STATE_CLASSIFYING
+                     ? conn->connect_start : conn->last_active;
+    uint64_t idle = now - since;
+
+    if (idle < timeout) {
+        flow_timer_arm(&flow_timers, timer, timeout - idle);
+        return;
+    }
+
+    // No name after the handshake, or a request that never completed.
+    // Connect anyway with whatever was held rather than stall a client that
+    // waits for the server to speak.
+    if (conn->tcp_state == CONN_STATE_CLASSIFYING) {
+        if (connect_upstream(conn) < 0) {
+            fail_connection(conn);
+            return;
+        }
+        flow_timer_arm(&flow_timers, timer, connection_timeout(conn));
+        if (conn->tcp_state == CONN_STATE_ESTABLISHED) {
+            flush_pending(conn);
+        }
+        return;
+    }
+
+    if (conn->tcp_state == CONN_STATE_CONNECTING) {
+        LOGE("Connect timed out");
+        connect_stats.failed++;
+        fail_connection(conn);
+        return;
+    }
+
+    LOGI("Cleaning up inactive connection");
+    close_connection(conn);
+}
+
+// Finish a non-blocking connect and send what was queued meanwhile.
+// Caller holds conn_mutex.
+static void complete_connect(connection_t *conn) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(conn->socket_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0) {
+        error = errno;
+    }
+
+    if (error != 0) {
+        LOGE("Failed to connect socket: %s", strerror(error));
+        connect_stats.failed++;
+        fail_connection(conn);
+        return;
+    }
+
+    uint64_t now = get_time_ms();
+    uint64_t latency = now - conn->connect_start;
+    connect_stats.completed++;
+    connect_stats.latency_total_ms += latency;
+    if (latency > connect_stats.latency_max_ms) {
+        connect_stats.latency_max_ms = latency;
+    }
+
+    conn->tcp_state = CONN_STATE_ESTABLISHED;
+    conn->last_active = now;
+    if (uring_active) {
+        uring_io_watch((int)(conn - connections), URING_IO_RECV);
+    }
+
+    flush_pending(conn);
+}
+
+// Hold a packet on a connection until it can be sent upstream. The queue
+// keeps a reference instead of copying the payload. Returns -1 if the
+// queue is full.
+static int queue_pending(connection_t *conn, packet_buf_t *packet) {
+    if (conn->pending_count >= FLOW_PENDING_MAX || conn->pending_len + packet->payload_len > FLOW_PENDING_BYTES) {
+        connect_stats.queue_drops++;
+        return -1;
+    }
+
+    packet_retain(packet);
+    packet->next = NULL;
+    if (conn->pending_tail != NULL) {
+        conn->pending_tail->next = packet;
+    } else {
+        conn->pending = packet;
+    }
+    conn->pending_tail = packet;
+    conn->pending_len += packet->payload_len;
+    conn->pending_count++;
+    connect_stats.queued++;
+    return 0;
+}
+
+// Send queued payloads in arrival order and drop the queue. Caller holds
+// conn_mutex.
+static void flush_pending(connection_t *conn) {
+    for (packet_buf_t *packet = conn->pending; packet != NULL; packet = packet->next) {
+        if (send_upstream(conn, packet) < 0) {
+            connect_stats.queue_drops += conn->pending_count;
+            break;
+        }
+        conn->pending_count--;
+    }
+
+    release_pending(conn);
+}
+
+// Drop the references held by a connection's pending queue
+static void release_pending(connection_t *conn) {
+    packet_buf_t *packet = conn->pending;
+    while (packet != NULL) {
+        packet_buf_t *next = packet->next;
+        packet_release(packet);
+        packet = next;
+    }
+
+    conn->pending = NULL;
+    conn->pending_tail = NULL;
+    conn->pending_len = 0;
+    conn->pending_count = 0;
+}
+
+// Take a protected socket from the pool, or create one if it ran dry
+static int open_protected_socket(int type) {
+    int fd = socket_pool_take(type);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    fd = socket(AF_INET, type, 0);
+    if (fd < 0) {
+        LOGE("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Protect socket from VPN routing
+    if (engine_config.protect != NULL && engine_config.protect(fd, engine_config.ctx) < 0) {
+        LOGE("Failed to protect socket: %d", fd);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Run idle timers that are due
+static void expire_connections() {
+    uint64_t now = get_time_ms();
+
+    pthread_mutex_lock(&conn_mutex);
+    flow_wheel_advance(&flow_timers, now, expire_connection, &now);
+    pthread_mutex_unlock(&conn_mutex);
+
+    dns_forwarder_expire(now);
+    rotate_dns_socket(now);
+}
+
+// Swap a shared DNS socket that is due for a freshly bound one. Its ring
+// slot is refilled with whichever socket the forwarder keeps.
+static void rotate_dns_socket(uint64_t now) {
+    int index = dns_forwarder_retiring(now);
+    if (index < 0) {
+        return;
+    }
+
+    int fd = open_protected_socket(SOCK_DGRAM);
+    if (uring_active) {
+        uring_io_remove(MAX_CONNECTIONS + index);
+    }
+    dns_forwarder_replace(index, fd, now);
+
+    if (uring_active) {
+        int dns_fds[DNS_FORWARD_SOCKETS];
+        dns_forwarder_fds(dns_fds, DNS_FORWARD_SOCKETS);
+        uring_io_add(MAX_CONNECTIONS + index, dns_fds[index], URING_IO_READABLE);
+    }
+}
+
+// Get current time in milliseconds
+static uint64_t get_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000ULL);
+}
@@ -18,9 +18,11 @@ import android.os.ParcelFileDescriptor
 import android.preference.PreferenceManager
 import android.util.Log
 import androidx.core.app.NotificationCompat
+import java.io.File
 import java.io.IOException
 import java.util.concurrent.atomic.AtomicBoolean
 import java.util.concurrent.atomic.AtomicInteger
+import java.util.concurrent.atomic.AtomicReference
 
 class FilterVpnService : VpnService() {
     companion object {
@@ -30,13 +32,41 @@ class FilterVpnService : VpnService() {
         const val ACTION_CONNECT = "com.example.domainfilter.CONNECT"
         const val ACTION_DISCONNECT = "com.example.domainfilter.DISCONNECT"
 
+        // Packet tracing. From the host, set the sample rate with
+        //   adb shell setprop debug.domainfilter.trace 100
+        // before the service starts; the trace is written when the VPN stops.
+        const val ACTION_TRACE = "com.example.domainfilter.TRACE"
+        const val ACTION_DUMP_TRACE = "com.example.domainfilter.DUMP_TRACE"
+        const val EXTRA_TRACE_SAMPLE_RATE = "sample_rate"
+        private const val TRACE_FILE = "packet_trace.json"
+
         // Notification
         private const val NOTIFICATION_CHANNEL_ID = "vpn_channel"
         private const val NOTIFICATION_ID = 1
 
+        // Interface MTU, also sizes the native packet buffers
+        private const val VPN_MTU = 1500
+
         // Service state
         private val sRunning = AtomicBoolean(false)
         private val sFilteredCount = AtomicInteger(0)
+        private val sEngineStats = AtomicReference(EngineStats())
+
+        // Socket pool watermark preferences
+        const val PREF_SOCKET_POOL_LOW = "socket_pool_low"
+        const val PREF_SOCKET_POOL_HIGH = "socket_pool_high"
+        private const val SOCKET_POOL_LOW_DEFAULT = 8
+        private const val SOCKET_POOL_HIGH_DEFAULT = 32
+
+        // Lists (native category bits) whose blocked flows get a TCP reset or
+        // ICMP unreachable, so the app fails at once instead of retrying.
+        // Advertising and tracking by default; other lists drop silently.
+        const val PREF_REJECT_CATEGORIES = "reject_categories"
+        private const val REJECT_CATEGORIES_DEFAULT = 0x03
+
+        // Answer HTTP and HTTPS handshakes locally and connect upstream only
+        // for requests that pass the filter
+        const val PREF_LAZY_CONNECT = "lazy_connect"
 
         // Check if VPN is running
         @JvmStatic
@@ -46,12 +76,93 @@ class FilterVpnService : VpnService() {
         @JvmStatic
         fun getFilteredCount(): Int = sFilteredCount.get()
 
+        // Get upstream connect statistics
+        @JvmStatic
+        fun getConnectStats(): ConnectStats = sEngineStats.get().connect
+
+        // Get the statistics of every native subsystem, read together
+        @JvmStatic
+        fun getEngineStats(): EngineStats = sEngineStats.get()
+
         // Load native library
         init {
             System.loadLibrary("domainfilter")
         }
     }
 
+    // Upstream connection statistics as reported by native code
+    data class ConnectStats(
+        val started: Long = 0,
+        val completed: Long = 0,
+        val failed: Long = 0,
+        val latencyAvgMs: Long = 0,
+        val latencyMaxMs: Long = 0,
+        val queuedPackets: Long = 0,
+        val queueDrops: Long = 0,
+        val rejectResets: Long = 0,
+        val rejectUnreachables: Long = 0,
+        val deferredConnects: Long = 0,
+        val deferredUnconnected: Long = 0
+    )
+
+    // Packets through the tun device
+    data class TunStats(
+        val packetsIn: Long = 0,
+        val bytesIn: Long = 0,
+        val packetsOut: Long = 0,
+        val bytesOut: Long = 0,
+        val flows: Long = 0
+    )
+
+    // Sockets protected ahead of the connects that need them
+    data class SocketPoolStats(
+        val readyTcp: Long = 0,
+        val readyUdp: Long = 0,
+        val lowWatermark: Long = 0,
+        val highWatermark: Long = 0,
+        val taken: Long = 0,
+        val misses: Long = 0,
+        val protectFailures: Long = 0
+    )
+
+    // Queries through the shared DNS forwarder sockets
+    data class DnsStats(
+        val queries: Long = 0,
+        val answers: Long = 0,
+        val timeouts: Long = 0,
+        val dropped: Long = 0,
+        val rotations: Long = 0
+    )
+
+    // io_uring packet I/O, all zero when the select loop is in use
+    data class UringStats(
+        val enters: Long = 0,
+        val received: Long = 0,
+        val sent: Long = 0,
+        val fallbacks: Long = 0,
+        val noBuffers: Long = 0,
+        val errors: Long = 0
+    )
+
+    // Native packet buffers
+    data class PacketPoolStats(
+        val buffers: Long = 0,
+        val inUse: Long = 0,
+        val inUseMax: Long = 0,
+        val allocs: Long = 0,
+        val exhausted: Long = 0
+    )
+
+    // One snapshot of the native statistics, refreshed with the notification
+    data class EngineStats(
+        val connect: ConnectStats = ConnectStats(),
+        val tun: TunStats = TunStats(),
+        val socketPool: SocketPoolStats = SocketPoolStats(),
+        val dns: DnsStats = DnsStats(),
+        val uring: UringStats = UringStats(),
+        val packetPool: PacketPoolStats = PacketPoolStats()
+    )
+
     // VPN parameters
     private var mInterface: ParcelFileDescriptor? = null
     private var mThread: Thread? = null
@@ -60,9 +171,20 @@ class FilterVpnService : VpnService() {
 
     // JNI methods
     private external fun jniInit()
-    private external fun jniStart(fd: Int)
+    private external fun jniStart(fd: Int, mtu: Int)
     private external fun jniStop()
     private external fun jniGetFilteredCount(): Int
+    private external fun jniGetConnectStats(): LongArray
+    private external fun jniGetTunStats(): LongArray
+    private external fun jniGetSocketPoolStats(): LongArray
+    private external fun jniGetDnsStats(): LongArray
+    private external fun jniGetUringStats(): LongArray
+    private external fun jniGetPacketPoolStats(): LongArray
+    private external fun jniSetSocketPool(low: Int, high: Int)
+    private external fun jniSetRejectCategories(categories: Int)
+    private external fun jniSetLazyConnect(enabled: Boolean)
+    private external fun jniSetTracing(sampleRate: Int)
+    private external fun jniDumpTrace(filePath: String): Int
 
     override fun onCreate() {
         super.onCreate()
@@ -71,6 +193,10 @@ class FilterVpnService : VpnService() {
 
         // Initialize native code
         jniInit()
+        jniSetSocketPool(mPrefs.getInt(PREF_SOCKET_POOL_LOW, SOCKET_POOL_LOW_DEFAULT),
+            mPrefs.getInt(PREF_SOCKET_POOL_HIGH, SOCKET_POOL_HIGH_DEFAULT))
+        jniSetRejectCategories(mPrefs.getInt(PREF_REJECT_CATEGORIES, REJECT_CATEGORIES_DEFAULT))
+        jniSetLazyConnect(mPrefs.getBoolean(PREF_LAZY_CONNECT, true))
     }
 
     override fun onStartCommand(intent: Intent?, flags: Int, startId: Int): Int {
@@ -87,6 +213,14 @@ class FilterVpnService : VpnService() {
                     stopSelf()
                     return START_NOT_STICKY
                 }
+                ACTION_TRACE -> {
+                    jniSetTracing(intent.getIntExtra(EXTRA_TRACE_SAMPLE_RATE, 0))
+                    return if (sRunning.get()) START_STICKY else START_NOT_STICKY
+                }
+                ACTION_DUMP_TRACE -> {
+                    dumpTrace()
+                    return if (sRunning.get()) START_STICKY else START_NOT_STICKY
+                }
             }
         }
 
@@ -123,7 +257,7 @@ class FilterVpnService : VpnService() {
             setSession(getString(R.string.app_name))
 
             // MTU
-            setMtu(1500)
+            setMtu(VPN_MTU)
 
             // Exclude our app from the VPN
             try {
@@ -164,7 +298,7 @@ class FilterVpnService : VpnService() {
         val fd = mInterface!!.fd
         mThread = Thread({
             Log.i(TAG, "Starting VPN thread with fd: $fd")
-            jniStart(fd)
+            jniStart(fd, VPN_MTU)
         }, "VpnThread").apply { start() }
 
         // Schedule statistics updates
@@ -181,6 +315,7 @@ class FilterVpnService : VpnService() {
 
         // Signal the native thread to stop
         jniStop()
+        dumpTrace()
 
         // Interrupt the thread
         mThread?.let {
@@ -218,11 +353,57 @@ class FilterVpnService : VpnService() {
         }
     }
 
+    // Called from native code by the socket pool thread. Sockets that could
+    // not be protected are set to -1.
+    @Suppress("unused")
+    fun protectSockets(sockets: IntArray) {
+        for (i in sockets.indices) {
+            if (!protect(sockets[i])) {
+                Log.e(TAG, "Failed to protect socket: ${sockets[i]}")
+                sockets[i] = -1
+            }
+        }
+    }
+
+    // Write the native trace buffers where adb can pull them from
+    private fun dumpTrace() {
+        val file = File(getExternalFilesDir(null) ?: filesDir, TRACE_FILE)
+        val events = jniDumpTrace(file.absolutePath)
+        if (events < 0) {
+            Log.e(TAG, "Failed to write trace to ${file.absolutePath}")
+        } else if (events > 0) {
+            Log.i(TAG, "Wrote $events trace events to ${file.absolutePath}")
+        }
+    }
+
+    // Read the native statistics. Each array is in the order of the
+    // matching class's properties.
+    private fun readEngineStats(): EngineStats {
+        val connect = jniGetConnectStats()
+        val tun = jniGetTunStats()
+        val socketPool = jniGetSocketPoolStats()
+        val dns = jniGetDnsStats()
+        val uring = jniGetUringStats()
+        val packetPool = jniGetPacketPoolStats()
+        return EngineStats(
+            ConnectStats(connect[0], connect[1], connect[2], connect[3], connect[4], connect[5],
+                connect[6], connect[7], connect[8], connect[9], connect[10]),
+            TunStats(tun[0], tun[1], tun[2], tun[3], tun[4]),
+            SocketPoolStats(socketPool[0], socketPool[1], socketPool[2], socketPool[3],
+                socketPool[4], socketPool[5], socketPool[6]),
+            DnsStats(dns[0], dns[1], dns[2], dns[3], dns[4]),
+            UringStats(uring[0], uring[1], uring[2], uring[3], uring[4], uring[5]),
+            PacketPoolStats(packetPool[0], packetPool[1], packetPool[2], packetPool[3],
+                packetPool[4])
+        )
+    }
+
     // Update statistics
     private fun updateStatistics() {
         if (sRunning.get()) {
             // Update blocked count from native code
             sFilteredCount.set(jniGetFilteredCount())
+            sEngineStats.set(readEngineStats())
 
             // Update notification
             val manager = getSystemService(NotificationManager::class.java)
@@ -2,6 +2,7 @@ package com.example.domainfilter.util
 
 import android.content.Context
 import android.content.SharedPreferences
+import android.content.res.AssetManager
 import android.preference.PreferenceManager
 import android.util.Log
 import java.io.BufferedReader
@@ -12,6 +13,7 @@ import java.io.InputStream
 import java.io.InputStreamReader
 import java.net.HttpURLConnection
 import java.net.URL
+import java.nio.ByteBuffer
 import java.util.concurrent.ExecutorService
 import java.util.concurrent.Executors
 
@@ -19,13 +21,17 @@ class FilterManager(context: Context) {
     companion object {
         private const val TAG = "FilterManager"
 
-        // Default filter lists
+        // Default filter lists, in native category bit order
         private val DEFAULT_FILTER_LISTS = arrayOf(
             "advertising", // Common advertising domains
             "tracking",    // Tracking domains
             "malware"      // Known malware domains
         )
 
+        // Native matcher backends, see FILTER_BACKEND_* in domainfilter.h
+        const val BACKEND_TRIE = 0
+        const val BACKEND_HASH = 1
+
         // Load native library
         init {
             System.loadLibrary("domainfilter")
@@ -34,25 +40,75 @@ class FilterManager(context: Context) {
 
     // JNI methods for domain filtering
     private external fun jniInitFilter()
+    private external fun jniInitFilterBackend(backend: Int): Int
     private external fun jniAddDomain(domain: String)
     private external fun jniLoadFilterFile(filePath: String)
     private external fun jniCheckDomain(domain: String): Boolean
+    private external fun jniGetFilterStats(): LongArray
+    private external fun jniGetListStats(category: Int): LongArray?
+    private external fun jniUseBuiltinFilters(categories: Int): Int
+    private external fun jniLoadFilterBuffer(buffer: ByteBuffer, length: Int): Int
+    private external fun jniLoadFilterAsset(assets: AssetManager, path: String, category: Int): Int
+    private external fun jniAddDomains(domains: Array<String>): Int
+    private external fun jniAddDomainsBuffer(buffer: ByteBuffer, length: Int): Int
+    private external fun jniCheckDomains(domains: Array<String>): ByteArray
+
+    // Matcher memory usage as reported by the native filter
+    data class FilterStats(
+        val nodes: Long,
+        val nodeCapacity: Long,
+        val bytesUsed: Long,
+        val bytesReserved: Long,
+        val bytesShared: Long,
+        val chunks: Long,
+        val fragmentationPerMille: Long,
+        val regexRules: Long,
+        val regexCacheBytes: Long,
+        val regexCacheFlushes: Long,
+        val backend: Long
+    )
+
+    // What one list contributed after duplicates and covered rules were dropped
+    data class ListStats(
+        val rules: Long,
+        val added: Long,
+        val duplicates: Long,
+        val redundant: Long,
+        val unsupported: Long
+    )
 
     private val mContext: Context = context.applicationContext
     private val mPrefs: SharedPreferences = PreferenceManager.getDefaultSharedPreferences(mContext)
     private val mExecutor: ExecutorService = Executors.newSingleThreadExecutor()
 
     init {
-        // Initialize native filter
-        jniInitFilter()
+        // Initialize native filter with the configured matcher
+        val backend = mPrefs.getInt("filter_backend", BACKEND_TRIE)
+        if (backend == BACKEND_TRIE || jniInitFilterBackend(backend) < 0) {
+            jniInitFilter()
+        }
     }
 
     // Load default filter lists
     fun loadDefaultFilters() {
         mExecutor.execute {
-            for (list in DEFAULT_FILTER_LISTS) {
+            var categories = 0
+            DEFAULT_FILTER_LISTS.forEachIndexed { index, list ->
                 if (mPrefs.getBoolean("filter_$list", true)) {
-                    loadFilterAsset("$list.txt")
+                    categories = categories or (1 shl index)
+                }
+            }
+
+            // The default lists are compiled into the native library
+            if (jniUseBuiltinFilters(categories) >= 0) {
+                Log.i(TAG, "Using built-in filter lists")
+                return@execute
+            }
+
+            // Fall back to parsing the assets
+            DEFAULT_FILTER_LISTS.forEachIndexed { index, list ->
+                if (categories and (1 shl index) != 0) {
+                    loadFilterAsset("$list.txt", 1 shl index)
                 }
             }
         }
@@ -65,36 +121,27 @@ class FilterManager(context: Context) {
 
     // Add multiple domains to the filter
     fun addDomains(domains: List<String>) {
-        mExecutor.execute {
-            domains.forEach { domain ->
-                jniAddDomain(domain)
-            }
-        }
+        val array = domains.toTypedArray()
+        mExecutor.execute { jniAddDomains(array) }
     }
 
-    // Load filter from assets
-    private fun loadFilterAsset(assetName: String) {
-        try {
-            val inputStream = mContext.assets.open("filters/$assetName")
-            val outputFile = File(mContext.filesDir, assetName)
-
-            // Copy the asset to internal storage
-            inputStream.use { input ->
-                FileOutputStream(outputFile).use { output ->
-                    input.copyTo(output)
-                }
-            }
-
-            // Load the filter file
-            jniLoadFilterFile(outputFile.absolutePath)
+    // Add newline-separated domains from a direct buffer
+    fun addDomainsPacked(buffer: ByteBuffer, length: Int) {
+        mExecutor.execute { jniAddDomainsBuffer(buffer, length) }
+    }
 
-            Log.i(TAG, "Loaded filter asset: $assetName")
-        } catch (e: IOException) {
-            Log.e(TAG, "Error loading filter asset: $assetName", e)
+    // Load filter from assets. Native code reads the asset in place.
+    private fun loadFilterAsset(assetName: String, category: Int) {
+        val count = jniLoadFilterAsset(mContext.assets, "filters/$assetName", category)
+        if (count >= 0) {
+            Log.i(TAG, "Loaded filter asset: $assetName ($count rules)")
+        } else {
+            Log.e(TAG, "Error loading filter asset: $assetName")
         }
     }
 
-    // Load filter from a URL
+    // Load filter from a URL. The download is parsed from memory and then
+    // kept in filesDir as a cached copy.
     fun loadFilterFromUrl(url: String, fileName: String) {
         mExecutor.execute {
             try {
@@ -106,17 +153,18 @@ class FilterManager(context: Context) {
 
                 val responseCode = connection.responseCode
                 if (responseCode == HttpURLConnection.HTTP_OK) {
-                    val outputFile = File(mContext.filesDir, fileName)
-                    connection.inputStream.use { input ->
-                        FileOutputStream(outputFile).use { output ->
-                            input.copyTo(output)
-                        }
+                    val buffer = connection.inputStream.use { input ->
+                        readFully(input, connection.contentLengthLong)
                     }
 
-                    // Load the filter file
-                    jniLoadFilterFile(outputFile.absolutePath)
+                    // Load the filter straight from the download buffer
+                    val count = jniLoadFilterBuffer(buffer, buffer.limit())
 
-                    Log.i(TAG, "Loaded filter from URL: $url")
+                    FileOutputStream(File(mContext.filesDir, fileName)).use { output ->
+                        output.channel.write(buffer)
+                    }
+
+                    Log.i(TAG, "Loaded filter from URL: $url ($count rules)")
                 } else {
                     Log.e(TAG, "Error loading filter from URL: $url, response code: $responseCode")
                 }
@@ -126,11 +174,54 @@ class FilterManager(context: Context) {
         }
     }
 
+    // Read a stream into a direct buffer that native code can parse in place
+    @Throws(IOException::class)
+    private fun readFully(input: InputStream, sizeHint: Long): ByteBuffer {
+        var buffer = ByteBuffer.allocateDirect(if (sizeHint > 0) sizeHint.toInt() else 64 * 1024)
+        val chunk = ByteArray(16 * 1024)
+
+        while (true) {
+            val read = input.read(chunk)
+            if (read < 0) {
+                break
+            }
+            if (buffer.remaining() < read) {
+                val grown = ByteBuffer.allocateDirect(maxOf(buffer.capacity() * 2, buffer.position() + read))
+                buffer.flip()
+                grown.put(buffer)
+                buffer = grown
+            }
+            buffer.put(chunk, 0, read)
+        }
+
+        buffer.flip()
+        return buffer
+    }
+
     // Check if a domain is blocked
     fun isDomainBlocked(domain: String): Boolean {
         return jniCheckDomain(domain)
     }
 
+    // Check several domains in one native call
+    fun areDomainsBlocked(domains: List<String>): BooleanArray {
+        val bits = jniCheckDomains(domains.toTypedArray())
+        return BooleanArray(domains.size) { i -> (bits[i shr 3].toInt() shr (i and 7)) and 1 != 0 }
+    }
+
+    // Get matcher memory statistics
+    fun getFilterStats(): FilterStats {
+        val values = jniGetFilterStats()
+        return FilterStats(values[0], values[1], values[2], values[3], values[4], values[5],
+            values[6], values[7], values[8], values[9], values[10])
+    }
+
+    // Get load statistics for one list, by native category bit
+    fun getListStats(category: Int): ListStats? {
+        val values = jniGetListStats(category) ?: return null
+        return ListStats(values[0], values[1], values[2], values[3], values[4])
+    }
+
     // Parse hosts file from input stream
     @Throws(IOException::class)
     fun parseHostsFile(inputStream: InputStream): List<String> {
@@ -0,0 +1,226 @@
+// filter_match_bench.c
+// Times filter_check_domain against query length, once per backend. The
+// cost per character should stay flat as names get longer. Then times
+// filter_check_domains against the same names checked one by one, for
+// batch sizes 1 to 64.
+//
+// Usage: filter_match_bench [rules] [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "domainfilter.h"
+
+#define NUM_QUERIES 256
+#define NUM_NAMES 8192
+
+static const size_t query_lengths[] = {16, 32, 64, 128, 253};
+static const size_t batch_sizes[] = {1, 2, 4, 8, 16, 32, 64};
+
+static const struct {
+    const char *name;
+    int backend;
+} backends[] = {
+        {"trie", FILTER_BACKEND_TRIE},
+        {"hash", FILTER_BACKEND_HASH},
+};
+
+static uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// Append a random label of length len to out
+static size_t random_label(char *out, size_t len, uint32_t *state) {
+    for (size_t i = 0; i < len; i++) {
+        out[i] = (char)('a' + next_random(state) % 26);
+    }
+    return len;
+}
+
+// Rules for a mix of plain, wildcard and exception names two to four labels
+// deep, several sharing each parent so the matcher has branches to follow
+static char *generate_rules(int count, size_t *len) {
+    char *rules = malloc((size_t)count * 64);
+    uint32_t state = 1;
+    size_t pos = 0;
+    char parent[32];
+    size_t parent_len = 0;
+
+    for (int i = 0; i < count && rules != NULL; i++) {
+        if (i % 8 == 0) {
+            parent_len = random_label(parent, 4 + next_random(&state) % 8, &state);
+            memcpy(parent + parent_len, ".com", 4);
+            parent_len += 4;
+        }
+
+        int kind = (int)(next_random(&state) % 8);
+        if (kind == 0) {
+            pos += (size_t)sprintf(rules + pos, "*.");
+        } else if (kind == 1) {
+            pos += (size_t)sprintf(rules + pos, "@@||");
+        }
+        int labels = (int)(next_random(&state) % 3);
+        for (int j = 0; j < labels; j++) {
+            pos += random_label(rules + pos, 3 + next_random(&state) % 6, &state);
+            rules[pos++] = '.';
+        }
+        memcpy(rules + pos, parent, parent_len);
+        pos += parent_len;
+        if (kind == 1) {
+            rules[pos++] = '^';
+        }
+        rules[pos++] = '\n';
+    }
+
+    *len = pos;
+    return rules;
+}
+
+// Queries of exactly len characters under one of the rule parents, built
+// from short labels so every query crosses many '.' boundaries
+static void generate_queries(char queries[NUM_QUERIES][256], size_t len, uint32_t seed) {
+    uint32_t state = seed;
+    for (int q = 0; q < NUM_QUERIES; q++) {
+        char *out = queries[q];
+        size_t pos = 0;
+        while (pos + 8 < len) {
+            pos += random_label(out + pos, 3 + next_random(&state) % 5, &state);
+            out[pos++] = '.';
+        }
+        while (pos + 4 < len) {
+            out[pos++] = 'x';
+        }
+        memcpy(out + pos, ".com", 4);
+        out[len] = '\0';
+    }
+}
+
+// Names below random rules, so that lookups walk deep into the matcher
+// and touch memory all over it
+static char *generate_names(const char *rules, size_t rules_len, const char **names) {
+    size_t num_lines = 0;
+    const char **lines = malloc(sizeof(char *) * (rules_len / 4 + 1));
+    char *buffer = malloc((size_t)NUM_NAMES * 96);
+    if (lines == NULL || buffer == NULL) {
+        free(lines);
+        free(buffer);
+        return NULL;
+    }
+    for (const char *line = rules; line < rules + rules_len; line = strchr(line, '\n') + 1) {
+        lines[num_lines++] = line;
+    }
+
+    uint32_t state = 7;
+    char *out = buffer;
+    for (int i = 0; i < NUM_NAMES; i++) {
+        const char *rule = lines[next_random(&state) % num_lines];
+        rule += strncmp(rule, "*.", 2) == 0 ? 2 : strncmp(rule, "@@||", 4) == 0 ? 4 : 0;
+        size_t len = strcspn(rule, "^\n");
+
+        names[i] = out;
+        out += random_label(out, 3 + next_random(&state) % 4, &state);
+        *out++ = '.';
+        memcpy(out, rule, len);
+        out += len;
+        *out++ = '\0';
+    }
+    free(lines);
+    return buffer;
+}
+
+// ns per name for the scalar and the batched API at each batch size
+static void bench_batches(const char **names, int iterations) {
+    static uint8_t verdicts[NUM_NAMES];
+    int rounds = iterations / 8 > 0 ? iterations / 8 : 1;
+
+    for (size_t s = 0; s < sizeof(batch_sizes) / sizeof(batch_sizes[0]); s++) {
+        size_t size = batch_sizes[s];
+        int blocked = 0;
+
+        uint64_t start = clock_ns();
+        for (int r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < NUM_NAMES; i++) {
+                blocked += filter_check_domain(names[i]);
+            }
+        }
+        uint64_t scalar = clock_ns() - start;
+
+        start = clock_ns();
+        for (int r = 0; r < rounds; r++) {
+            for (size_t i = 0; i + size <= NUM_NAMES; i += size) {
+                filter_check_domains(names + i, size, verdicts + i);
+            }
+        }
+        uint64_t batched = clock_ns() - start;
+
+        for (size_t i = 0; i < NUM_NAMES; i++) {
+            blocked -= verdicts[i] * rounds;
+        }
+        double lookups = (double)rounds * NUM_NAMES;
+        printf("%8s %8zu %12.1f %12.1f %8.2fx%s\n", "", size, (double)scalar / lookups, (double)batched / lookups,
+               (double)scalar / (double)batched, blocked != 0 ? " mismatch" : "");
+    }
+}
+
+int main(int argc, char **argv) {
+    int num_rules = argc > 1 ? atoi(argv[1]) : 100000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+
+    size_t rules_len;
+    char *rules = generate_rules(num_rules, &rules_len);
+    if (rules == NULL) {
+        return 1;
+    }
+
+    static const char *names[NUM_NAMES];
+    char *name_buffer = generate_names(rules, rules_len, names);
+    if (name_buffer == NULL) {
+        free(rules);
+        return 1;
+    }
+
+    static char queries[NUM_QUERIES][256];
+    printf("%d rules, %d lookups per length\n", num_rules, iterations * NUM_QUERIES);
+    printf("%-8s %8s %12s %12s\n", "backend", "length", "ns/lookup", "ns/char");
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        if (filter_init_backend(backends[b].backend) < 0 || filter_load_buffer(rules, rules_len) <= 0) {
+            fprintf(stderr, "%s: failed to load the rules\n", backends[b].name);
+            free(rules);
+            return 1;
+        }
+
+        for (size_t l = 0; l < sizeof(query_lengths) / sizeof(query_lengths[0]); l++) {
+            size_t len = query_lengths[l];
+            generate_queries(queries, len, (uint32_t)len);
+
+            int blocked = 0;
+            uint64_t start = clock_ns();
+            for (int i = 0; i < iterations; i++) {
+                for (int q = 0; q < NUM_QUERIES; q++) {
+                    blocked += filter_check_domain(queries[q]);
+                }
+            }
+            uint64_t elapsed = clock_ns() - start;
+
+            double per_lookup = (double)elapsed / ((double)iterations * NUM_QUERIES);
+            printf("%-8s %8zu %12.1f %12.2f%s\n", backends[b].name, len, per_lookup, per_lookup / (double)len,
+                   blocked < 0 ? " ?" : "");
+        }
+
+        printf("%8s %8s %12s %12s %9s\n", "", "batch", "ns scalar", "ns batched", "speedup");
+        bench_batches(names, iterations);
+    }
+
+    filter_cleanup();
+    free(name_buffer);
+    free(rules);
+    return 0;
+}
@@ -0,0 +1,225 @@
+// filter_match_test.c
+// Checks matcher verdicts against a corpus, once per backend, one name at
+// a time and batched, with the lists the corpus enables for each check.
+//
+// Usage: filter_match_test <corpus>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "domainfilter.h"
+
+#define MAX_CHECKS 1024
+
+typedef struct {
+    int expected;
+    uint8_t categories;     // Lists enabled for the check
+    char domain[256];
+    int line;
+} match_check_t;
+
+static const struct {
+    const char *name;
+    int backend;
+} backends[] = {
+        {"trie", FILTER_BACKEND_TRIE},
+        {"hash", FILTER_BACKEND_HASH},
+};
+
+static const struct {
+    const char *name;
+    uint8_t category;
+} lists[] = {
+        {"advertising", FILTER_CATEGORY_ADVERTISING},
+        {"tracking", FILTER_CATEGORY_TRACKING},
+        {"malware", FILTER_CATEGORY_MALWARE},
+        {"custom", FILTER_CATEGORY_CUSTOM},
+};
+
+#define NUM_LISTS (sizeof(lists) / sizeof(lists[0]))
+
+// Rule text of each list
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} list_text_t;
+
+static match_check_t checks[MAX_CHECKS];
+static int num_checks = 0;
+static list_text_t texts[NUM_LISTS];
+
+// Index in lists of a list name, -1 if unknown
+static int find_list(const char *name, size_t len) {
+    for (size_t i = 0; i < NUM_LISTS; i++) {
+        if (strlen(lists[i].name) == len && memcmp(lists[i].name, name, len) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Parse a comma separated list of list names, or "all"
+static int parse_categories(const char *names, uint8_t *categories) {
+    if (strcmp(names, "all") == 0) {
+        *categories = 0xff;
+        return 0;
+    }
+
+    *categories = 0;
+    while (*names != '\0') {
+        size_t len = strcspn(names, ",");
+        int list = find_list(names, len);
+        if (list < 0) {
+            return -1;
+        }
+        *categories |= lists[list].category;
+        names += len + (names[len] == ',');
+    }
+    return 0;
+}
+
+static int append_line(list_text_t *text, const char *line, size_t len) {
+    if (text->len + len + 1 > text->capacity) {
+        size_t capacity = text->capacity ? text->capacity * 2 : 4096;
+        while (text->len + len + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *grown = realloc(text->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        text->data = grown;
+        text->capacity = capacity;
+    }
+    memcpy(text->data + text->len, line, len);
+    text->data[text->len + len] = '\n';
+    text->len += len + 1;
+    return 0;
+}
+
+// Split the corpus into the rule text of each list and checks
+static int read_corpus(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[512];
+    int line_number = 0;
+    int list = find_list("custom", 6);
+    uint8_t enabled = 0xff;
+    int result = 0;
+
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+
+        if (strncmp(line, "%list ", 6) == 0) {
+            list = find_list(line + 6, len - 6);
+            if (list < 0) {
+                fprintf(stderr, "%s:%d: unknown list\n", path, line_number);
+                result = -1;
+            }
+            continue;
+        }
+
+        if (strncmp(line, "%enable ", 8) == 0) {
+            if (parse_categories(line + 8, &enabled) < 0) {
+                fprintf(stderr, "%s:%d: unknown list\n", path, line_number);
+                result = -1;
+            }
+            continue;
+        }
+
+        if (line[0] == '=' && (line[1] == '0' || line[1] == '1') && line[2] == ' ') {
+            if (num_checks == MAX_CHECKS || len - 3 >= sizeof(checks[0].domain)) {
+                fprintf(stderr, "%s:%d: too many or too long checks\n", path, line_number);
+                result = -1;
+                break;
+            }
+            checks[num_checks].expected = line[1] == '1';
+            checks[num_checks].categories = enabled;
+            checks[num_checks].line = line_number;
+            strcpy(checks[num_checks].domain, line + 3);
+            num_checks++;
+            continue;
+        }
+
+        result = append_line(&texts[list], line, len);
+    }
+
+    fclose(file);
+    return result;
+}
+
+// Load the rules of every list. Returns the number of rules loaded.
+static int load_lists() {
+    int total = 0;
+    for (size_t i = 0; i < NUM_LISTS; i++) {
+        if (texts[i].len == 0) {
+            continue;
+        }
+        int loaded = filter_load_list_buffer(texts[i].data, texts[i].len, lists[i].category);
+        if (loaded < 0) {
+            return -1;
+        }
+        total += loaded;
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: filter_match_test <corpus>\n");
+        return 1;
+    }
+
+    if (read_corpus(argv[1]) < 0) {
+        return 1;
+    }
+
+    int failures = 0;
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        if (filter_init_backend(backends[b].backend) < 0 || load_lists() <= 0) {
+            fprintf(stderr, "%s: failed to load the corpus rules\n", backends[b].name);
+            failures++;
+            continue;
+        }
+
+        // Checks run in groups of consecutive checks with the same lists enabled
+        for (int first = 0, end; first < num_checks; first = end) {
+            end = first + 1;
+            while (end < num_checks && checks[end].categories == checks[first].categories) {
+                end++;
+            }
+            filter_set_categories(checks[first].categories);
+
+            static const char *domains[MAX_CHECKS];
+            static uint8_t batch[MAX_CHECKS];
+            for (int i = first; i < end; i++) {
+                domains[i - first] = checks[i].domain;
+            }
+            filter_check_domains(domains, (size_t)(end - first), batch);
+
+            for (int i = first; i < end; i++) {
+                int blocked = filter_check_domain(checks[i].domain);
+                if (blocked != checks[i].expected || batch[i - first] != checks[i].expected) {
+                    fprintf(stderr, "%s:%d: %s: %s should be %s%s\n", argv[1], checks[i].line, backends[b].name,
+                            checks[i].domain, checks[i].expected ? "blocked" : "allowed",
+                            blocked == checks[i].expected ? " (batched)" : "");
+                    failures++;
+                }
+            }
+        }
+    }
+
+    filter_cleanup();
+    for (size_t i = 0; i < NUM_LISTS; i++) {
+        free(texts[i].data);
+    }
+
+    printf("%d checks per backend, %d failures\n", num_checks, failures);
+    return failures == 0 ? 0 : 1;
+}
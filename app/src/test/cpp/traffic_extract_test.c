@@ -0,0 +1,121 @@
+// traffic_extract_test.c
+// Generates traffic from a fixed seed and checks that extraction finds the
+// name in every request that fits one packet, and in every TCP request once
+// its segments are put back together, and that the generated blocklist
+// gives each name the verdict the generator intended.
+//
+// Usage: traffic_extract_test [requests]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "domainfilter.h"
+#include "traffic_gen.h"
+
+static const char *const kinds[] = {"dns", "http", "tls"};
+
+// Append the TCP payload of an IPv4 packet to a stream
+static size_t append_payload(uint8_t *stream, size_t stream_len, const uint8_t *packet, size_t len) {
+    size_t offset = (size_t)(packet[0] & 0x0f) * 4;
+    offset += (size_t)(packet[offset + 12] >> 4) * 4;
+    memcpy(stream + stream_len, packet + offset, len - offset);
+    return stream_len + len - offset;
+}
+
+int main(int argc, char **argv) {
+    int num_requests = argc > 1 ? atoi(argv[1]) : 20000;
+
+    traffic_gen_config_t config;
+    traffic_gen_default_config(&config);
+    config.seed = 46;
+    config.domains = 50000;
+    config.rules = 20000;
+    config.large_ratio = 0.2;
+    config.tcp_handshake = 1;
+    traffic_gen_t *gen = traffic_gen_create(&config);
+
+    char *rules = NULL;
+    size_t rules_len = 0;
+    FILE *out = open_memstream(&rules, &rules_len);
+    if (gen == NULL || out == NULL || traffic_gen_write_rules(gen, out) < 0 || fclose(out) != 0) {
+        fprintf(stderr, "failed to generate the blocklist\n");
+        return 1;
+    }
+    if (filter_init_backend(FILTER_BACKEND_TRIE) < 0 || filter_load_buffer(rules, rules_len) != (int)config.rules) {
+        fprintf(stderr, "failed to load the blocklist\n");
+        return 1;
+    }
+
+    int failures = 0;
+    int blocked = 0;
+    int segmented = 0;
+    int segmented_found = 0;
+    size_t packets = 0;
+    uint8_t stream[TRAFFIC_MAX_PACKETS * TRAFFIC_MAX_PACKET];
+
+    for (int i = 0; i < num_requests; i++) {
+        traffic_request_t request;
+        traffic_gen_next(gen, &request);
+        packets += request.num_packets;
+
+        // A SYN carries no name, the payload starts after it
+        size_t first = request.kind != TRAFFIC_DNS && config.tcp_handshake ? 1 : 0;
+        int single = request.num_packets == first + 1;
+        segmented += !single;
+
+        char domain[256];
+        int found = 0;
+        for (size_t p = 0; p < request.num_packets; p++) {
+            int len = extract_domain_from_packet(request.packets[p], request.lens[p], domain, sizeof(domain));
+            if (len <= 0) {
+                continue;
+            }
+            if (p != first || strcmp(domain, request.host) != 0) {
+                fprintf(stderr, "%s request %d: packet %zu gave '%s' for %s\n", kinds[request.kind], i, p, domain,
+                        request.host);
+                failures++;
+            }
+            found = 1;
+        }
+        if (single && !found) {
+            fprintf(stderr, "%s request %d: no name found for %s\n", kinds[request.kind], i, request.host);
+            failures++;
+        }
+        segmented_found += !single && found;
+
+        // The name shows up once the segments are put back together, and
+        // never before the request is complete
+        if (request.kind != TRAFFIC_DNS) {
+            uint16_t port = request.kind == TRAFFIC_HTTP ? 80 : 443;
+            size_t stream_len = 0;
+            int len = 0;
+            size_t p = first;
+            for (; p < request.num_packets && len == 0; p++) {
+                stream_len = append_payload(stream, stream_len, request.packets[p], request.lens[p]);
+                len = extract_domain_from_stream(stream, stream_len, port, domain, sizeof(domain));
+            }
+            if (p < request.num_packets) {
+                fprintf(stderr, "%s request %d: stream gave %d after %zu of %zu segments for %s\n",
+                        kinds[request.kind], i, len, p - first, request.num_packets - first, request.host);
+                failures++;
+            } else if (len <= 0 || strcmp(domain, request.host) != 0) {
+                fprintf(stderr, "%s request %d: stream gave %d for %s\n", kinds[request.kind], i, len, request.host);
+                failures++;
+            }
+        }
+
+        if (filter_check_domain(request.host) != request.blocked) {
+            fprintf(stderr, "%s request %d: %s should be %s\n", kinds[request.kind], i, request.host,
+                    request.blocked ? "blocked" : "allowed");
+            failures++;
+        }
+        blocked += request.blocked;
+    }
+
+    filter_cleanup();
+    traffic_gen_destroy(gen);
+    free(rules);
+
+    printf("%d requests in %zu packets, %d blocked, %d over several segments (%d named in the first), "
+           "%d failures\n", num_requests, packets, blocked, segmented, segmented_found, failures);
+    return failures == 0 ? 0 : 1;
+}
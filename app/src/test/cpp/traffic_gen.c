@@ -0,0 +1,720 @@
+// traffic_gen.c
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "traffic_gen.h"
+
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+
+// Hybrid X25519 + ML-KEM-768 key share, what makes modern ClientHellos
+// outgrow a single segment
+#define TLS_GROUP_X25519_MLKEM768 0x11ec
+#define TLS_MLKEM768_SHARE_LEN    1216
+
+#define MAX_PAYLOAD 4096
+
+struct traffic_gen {
+    traffic_gen_config_t config;
+    uint64_t state;
+    double *blocked_cdf;      // Zipf over the rules
+    double *allowed_cdf;      // Zipf over the allowed names
+    uint32_t weight_total;
+    uint16_t next_port;
+    uint16_t ip_id;
+    uint8_t packets[TRAFFIC_MAX_PACKETS][TRAFFIC_MAX_PACKET];
+    uint8_t payload[MAX_PAYLOAD];
+};
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} writer_t;
+
+static const char *const tlds[] = {"com", "com", "com", "net", "org", "io", "de", "co.uk", "com.br", "app"};
+static const char *const rule_prefixes[] = {"ads", "ad", "track", "pixel", "metrics", "telemetry", "stats", "beacon"};
+static const char *const host_prefixes[] = {"www", "cdn", "api", "static", "m", "img", "eu", "edge"};
+static const char *const user_agents[] = {
+        "Mozilla/5.0 (Linux; Android 14; Pixel 8) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0 Mobile Safari/537.36",
+        "Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0",
+        "okhttp/4.12.0",
+        "Dalvik/2.1.0 (Linux; U; Android 13; SM-S911B Build/TP1A.220624.014)",
+};
+
+static const uint16_t cipher_suites[] = {
+        0x1301, 0x1302, 0x1303, 0xc02b, 0xc02f, 0xc02c, 0xc030, 0xcca9,
+        0xcca8, 0xc013, 0xc014, 0x009c, 0x009d, 0x002f, 0x0035,
+};
+static const uint16_t signature_algorithms[] = {
+        0x0403, 0x0804, 0x0401, 0x0503, 0x0805, 0x0501, 0x0806, 0x0601,
+};
+
+// ClientHello extensions, in Firefox's fixed order. Chrome sends the same
+// set shuffled between a leading and a trailing GREASE extension.
+static const uint16_t tls_extensions[] = {
+        0x0000,   // server_name
+        0x0017,   // extended_master_secret
+        0xff01,   // renegotiation_info
+        0x000a,   // supported_groups
+        0x000b,   // ec_point_formats
+        0x0023,   // session_ticket
+        0x0010,   // application_layer_protocol_negotiation
+        0x0005,   // status_request
+        0x000d,   // signature_algorithms
+        0x0012,   // signed_certificate_timestamp
+        0x0033,   // key_share
+        0x002d,   // psk_key_exchange_modes
+        0x002b,   // supported_versions
+        0x001b,   // compress_certificate
+};
+
+#define NUM(array) (sizeof(array) / sizeof((array)[0]))
+
+// splitmix64
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t next_random(traffic_gen_t *gen) {
+    gen->state += 0x9e3779b97f4a7c15ull;
+    return mix(gen->state);
+}
+
+static uint32_t random_below(traffic_gen_t *gen, uint32_t n) {
+    return (uint32_t)(((next_random(gen) >> 32) * n) >> 32);
+}
+
+static double random_unit(traffic_gen_t *gen) {
+    return (double)(next_random(gen) >> 11) * 0x1.0p-53;
+}
+
+static void random_bytes(traffic_gen_t *gen, uint8_t *out, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        out[i] = (uint8_t)next_random(gen);
+    }
+}
+
+// Fixed properties of universe entry index, independent of the request
+// stream
+static uint64_t name_hash(const traffic_gen_t *gen, uint32_t index, uint32_t salt) {
+    return mix(gen->config.seed ^ mix(((uint64_t)index << 8) | salt));
+}
+
+// Registrable name of universe entry index: rules come first, then the
+// allowed names. The last seven letters of the label spell a bijection of
+// the index, so two entries never share a name and no entry lies below
+// another one.
+static size_t registrable_name(const traffic_gen_t *gen, uint32_t index, char *out) {
+    uint64_t h = name_hash(gen, index, 1);
+    size_t pos = 0;
+
+    size_t word = h % 6;
+    for (size_t i = 0; i < word; i++) {
+        out[pos++] = (char)('a' + (h >> (8 + 5 * i)) % 26);
+    }
+
+    uint32_t x = index + (uint32_t)mix(gen->config.seed);
+    x *= 0x9e3779b1u;
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    for (int i = 0; i < 7; i++) {
+        out[pos++] = (char)('a' + x % 26);
+        x /= 26;
+    }
+
+    const char *tld = tlds[(h >> 40) % NUM(tlds)];
+    out[pos++] = '.';
+    memcpy(out + pos, tld, strlen(tld) + 1);
+    return pos + strlen(tld);
+}
+
+#define RULE_PLAIN    0
+#define RULE_HOSTS    1
+#define RULE_ADBLOCK  2
+#define RULE_WILDCARD 3   // *.name, subdomains only
+
+// Name and syntax of rule index. Four in ten name a tracking subdomain
+// rather than the registrable name itself.
+static size_t rule_name(const traffic_gen_t *gen, uint32_t index, char *out, int *syntax) {
+    uint64_t h = name_hash(gen, index, 2);
+    size_t pos = 0;
+
+    if (h % 10 < 4) {
+        const char *prefix = rule_prefixes[(h >> 8) % NUM(rule_prefixes)];
+        pos = strlen(prefix);
+        memcpy(out, prefix, pos);
+        out[pos++] = '.';
+    }
+
+    uint32_t kind = (h >> 16) % 20;
+    *syntax = kind < 10 ? RULE_PLAIN : kind < 15 ? RULE_HOSTS : kind < 19 ? RULE_ADBLOCK : RULE_WILDCARD;
+    return pos + registrable_name(gen, index, out + pos);
+}
+
+// Prepend one or two labels to name, in place
+static size_t add_subdomain(traffic_gen_t *gen, char *name, size_t len, int labels) {
+    char prefix[32];
+    size_t pos = 0;
+    for (int i = 0; i < labels; i++) {
+        if (random_below(gen, 3) > 0) {
+            const char *label = host_prefixes[random_below(gen, NUM(host_prefixes))];
+            memcpy(prefix + pos, label, strlen(label));
+            pos += strlen(label);
+        } else {
+            size_t label_len = 2 + random_below(gen, 8);
+            for (size_t j = 0; j < label_len; j++) {
+                prefix[pos++] = (char)('a' + random_below(gen, 26));
+            }
+        }
+        prefix[pos++] = '.';
+    }
+
+    memmove(name + pos, name, len + 1);
+    memcpy(name, prefix, pos);
+    return len + pos;
+}
+
+static double *zipf_table(uint32_t n, double exponent) {
+    if (n == 0) {
+        return NULL;
+    }
+    double *cdf = malloc(n * sizeof(double));
+    if (cdf == NULL) {
+        return NULL;
+    }
+
+    double sum = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        sum += pow((double)(i + 1), -exponent);
+        cdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+// Rank for u in [0, 1), rank 0 the most popular
+static uint32_t zipf_sample(const double *cdf, uint32_t n, double u) {
+    uint32_t low = 0;
+    uint32_t high = n - 1;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (cdf[middle] > u) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+void traffic_gen_default_config(traffic_gen_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    config->seed = 1;
+    config->domains = 100000;
+    config->rules = 10000;
+    config->zipf_exponent = 1.0;
+    config->block_ratio = 0.2;
+    config->weights[TRAFFIC_DNS] = 6;
+    config->weights[TRAFFIC_HTTP] = 1;
+    config->weights[TRAFFIC_TLS] = 3;
+    config->grease_ratio = 0.8;
+    config->large_ratio = 0.1;
+    config->mss = 1460;
+    config->src_ip = 0x0a000002;      // 10.0.0.2
+    config->dns_server = 0xc6120035;  // 198.18.0.53
+}
+
+traffic_gen_t *traffic_gen_create(const traffic_gen_config_t *config) {
+    uint32_t weight_total = config->weights[0] + config->weights[1] + config->weights[2];
+    if ((uint64_t)config->domains + config->rules > UINT32_MAX || config->domains + config->rules == 0 ||
+        weight_total == 0 || config->mss < 536 || config->mss > TRAFFIC_MAX_PACKET - 40 ||
+        config->block_ratio < 0 || config->block_ratio > 1) {
+        return NULL;
+    }
+
+    traffic_gen_t *gen = calloc(1, sizeof(traffic_gen_t));
+    if (gen == NULL) {
+        return NULL;
+    }
+    gen->config = *config;
+    gen->state = config->seed;
+    gen->weight_total = weight_total;
+    gen->next_port = 32768;
+    gen->blocked_cdf = zipf_table(config->rules, config->zipf_exponent);
+    gen->allowed_cdf = zipf_table(config->domains, config->zipf_exponent);
+    if ((config->rules > 0 && gen->blocked_cdf == NULL) || (config->domains > 0 && gen->allowed_cdf == NULL)) {
+        traffic_gen_destroy(gen);
+        return NULL;
+    }
+    return gen;
+}
+
+void traffic_gen_destroy(traffic_gen_t *gen) {
+    if (gen != NULL) {
+        free(gen->blocked_cdf);
+        free(gen->allowed_cdf);
+        free(gen);
+    }
+}
+
+int traffic_gen_write_rules(const traffic_gen_t *gen, FILE *out) {
+    fprintf(out, "# Generated blocklist: seed %llu, %u rules\n",
+            (unsigned long long)gen->config.seed, gen->config.rules);
+
+    char name[256];
+    for (uint32_t i = 0; i < gen->config.rules; i++) {
+        int syntax;
+        rule_name(gen, i, name, &syntax);
+        switch (syntax) {
+            case RULE_HOSTS: fprintf(out, "0.0.0.0 %s\n", name); break;
+            case RULE_ADBLOCK: fprintf(out, "||%s^\n", name); break;
+            case RULE_WILDCARD: fprintf(out, "*.%s\n", name); break;
+            default: fprintf(out, "%s\n", name); break;
+        }
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+static void put_u8(writer_t *w, uint8_t value) {
+    w->data[w->len++] = value;
+}
+
+static void put_u16(writer_t *w, uint16_t value) {
+    w->data[w->len++] = (uint8_t)(value >> 8);
+    w->data[w->len++] = (uint8_t)value;
+}
+
+static void put_bytes(writer_t *w, const void *data, size_t len) {
+    memcpy(w->data + w->len, data, len);
+    w->len += len;
+}
+
+static void put_string(writer_t *w, const char *s) {
+    put_bytes(w, s, strlen(s));
+}
+
+// Back-patch a length field of size bytes at offset to cover what follows it
+static void patch_len(writer_t *w, size_t offset, int size) {
+    size_t len = w->len - offset - (size_t)size;
+    for (int i = size - 1; i >= 0; i--) {
+        w->data[offset + (size_t)i] = (uint8_t)len;
+        len >>= 8;
+    }
+}
+
+// 0x0a0a, 0x1a1a ... 0xfafa, reserved so that servers must ignore them
+static uint16_t grease_value(traffic_gen_t *gen) {
+    uint16_t n = (uint16_t)random_below(gen, 16);
+    return (uint16_t)(0x0a0a | n << 12 | n << 4);
+}
+
+static size_t dns_query(traffic_gen_t *gen, const char *host, uint8_t *out) {
+    writer_t w = {out, 0};
+    put_u16(&w, (uint16_t)next_random(gen));
+    put_u16(&w, 0x0100);                       // Recursion desired
+    put_u16(&w, 1);
+    put_u16(&w, 0);
+    put_u16(&w, 0);
+    put_u16(&w, 1);                            // EDNS OPT record
+
+    while (*host != '\0') {
+        size_t label = strcspn(host, ".");
+        put_u8(&w, (uint8_t)label);
+        put_bytes(&w, host, label);
+        host += label + (host[label] == '.');
+    }
+    put_u8(&w, 0);
+
+    uint32_t type = random_below(gen, 20);
+    put_u16(&w, type < 10 ? 1 : type < 17 ? 28 : 65);  // A, AAAA, HTTPS
+    put_u16(&w, 1);
+
+    put_u8(&w, 0);
+    put_u16(&w, 41);
+    put_u16(&w, 1232);                         // UDP payload size
+    put_u16(&w, 0);
+    put_u16(&w, 0);
+    put_u16(&w, 0);
+    return w.len;
+}
+
+static size_t http_request(traffic_gen_t *gen, const char *host, int large, uint8_t *out) {
+    writer_t w = {out, 0};
+    char line[128];
+
+    if (random_below(gen, 3) == 0) {
+        put_string(&w, "GET / HTTP/1.1\r\n");
+    } else {
+        snprintf(line, sizeof(line), "GET /assets/%08x.js?v=%u HTTP/1.1\r\n",
+                 (unsigned)next_random(gen), random_below(gen, 100));
+        put_string(&w, line);
+    }
+
+    put_string(&w, "Host: ");
+    put_string(&w, host);
+    put_string(&w, random_below(gen, 20) == 0 ? ":80\r\n" : "\r\n");
+    put_string(&w, "User-Agent: ");
+    put_string(&w, user_agents[random_below(gen, NUM(user_agents))]);
+    put_string(&w, "\r\nAccept: */*\r\nAccept-Language: en-US,en;q=0.9\r\nAccept-Encoding: gzip, deflate\r\n");
+
+    if (large) {
+        put_string(&w, "Cookie: ");
+        size_t cookies = 12 + random_below(gen, 12);
+        for (size_t i = 0; i < cookies; i++) {
+            snprintf(line, sizeof(line), "%sc%zu=", i > 0 ? "; " : "", i);
+            put_string(&w, line);
+            size_t value_len = 48 + random_below(gen, 48);
+            for (size_t j = 0; j < value_len; j++) {
+                put_u8(&w, (uint8_t)"0123456789abcdef"[random_below(gen, 16)]);
+            }
+        }
+        put_string(&w, "\r\n");
+    }
+
+    put_string(&w, "Connection: keep-alive\r\n\r\n");
+    return w.len;
+}
+
+static void put_tls_extension(traffic_gen_t *gen, writer_t *w, uint16_t type, const char *host, int grease, int large) {
+    put_u16(w, type);
+    size_t ext_len = w->len;
+    put_u16(w, 0);
+
+    switch (type) {
+        case 0x0000: {
+            size_t list_len = w->len;
+            put_u16(w, 0);
+            put_u8(w, 0);
+            put_u16(w, (uint16_t)strlen(host));
+            put_string(w, host);
+            patch_len(w, list_len, 2);
+            break;
+        }
+        case 0xff01:
+        case 0x000b:
+            put_u8(w, 1);
+            put_u8(w, 0);
+            break;
+        case 0x000a: {
+            size_t list_len = w->len;
+            put_u16(w, 0);
+            if (grease) {
+                put_u16(w, grease_value(gen));
+            }
+            if (large) {
+                put_u16(w, TLS_GROUP_X25519_MLKEM768);
+            }
+            put_u16(w, 0x001d);
+            put_u16(w, 0x0017);
+            put_u16(w, 0x0018);
+            patch_len(w, list_len, 2);
+            break;
+        }
+        case 0x0010:
+            put_u16(w, 12);
+            put_u8(w, 2);
+            put_string(w, "h2");
+            put_u8(w, 8);
+            put_string(w, "http/1.1");
+            break;
+        case 0x0005:
+            put_u8(w, 1);
+            put_u16(w, 0);
+            put_u16(w, 0);
+            break;
+        case 0x000d:
+            put_u16(w, (uint16_t)(NUM(signature_algorithms) * 2));
+            for (size_t i = 0; i < NUM(signature_algorithms); i++) {
+                put_u16(w, signature_algorithms[i]);
+            }
+            break;
+        case 0x0033: {
+            size_t list_len = w->len;
+            put_u16(w, 0);
+            if (grease) {
+                put_u16(w, grease_value(gen));
+                put_u16(w, 1);
+                put_u8(w, 0);
+            }
+            if (large) {
+                put_u16(w, TLS_GROUP_X25519_MLKEM768);
+                put_u16(w, TLS_MLKEM768_SHARE_LEN + 32);
+                random_bytes(gen, w->data + w->len, TLS_MLKEM768_SHARE_LEN + 32);
+                w->len += TLS_MLKEM768_SHARE_LEN + 32;
+            }
+            put_u16(w, 0x001d);
+            put_u16(w, 32);
+            random_bytes(gen, w->data + w->len, 32);
+            w->len += 32;
+            patch_len(w, list_len, 2);
+            break;
+        }
+        case 0x002d:
+            put_u8(w, 1);
+            put_u8(w, 1);
+            break;
+        case 0x002b: {
+            size_t list_len = w->len;
+            put_u8(w, 0);
+            if (grease) {
+                put_u16(w, grease_value(gen));
+            }
+            put_u16(w, 0x0304);
+            put_u16(w, 0x0303);
+            patch_len(w, list_len, 1);
+            break;
+        }
+        case 0x001b:
+            put_u8(w, 2);
+            put_u16(w, 0x0002);
+            break;
+        default:
+            // Empty extensions, and GREASE ones that carry zero or one byte
+            if ((type & 0x0f0f) == 0x0a0a && random_below(gen, 2)) {
+                put_u8(w, 0);
+            }
+            break;
+    }
+
+    patch_len(w, ext_len, 2);
+}
+
+static size_t client_hello(traffic_gen_t *gen, const char *host, int grease, int large, uint8_t *out) {
+    writer_t w = {out, 0};
+
+    put_u8(&w, 0x16);
+    put_u16(&w, 0x0301);
+    size_t record_len = w.len;
+    put_u16(&w, 0);
+
+    put_u8(&w, 0x01);
+    size_t handshake_len = w.len;
+    put_u8(&w, 0);
+    put_u16(&w, 0);
+
+    put_u16(&w, 0x0303);
+    random_bytes(gen, w.data + w.len, 32);
+    w.len += 32;
+    put_u8(&w, 32);
+    random_bytes(gen, w.data + w.len, 32);
+    w.len += 32;
+
+    size_t suites_len = w.len;
+    put_u16(&w, 0);
+    if (grease) {
+        // Some stacks sprinkle several
+        int count = 1 + (int)random_below(gen, 3);
+        for (int i = 0; i < count; i++) {
+            put_u16(&w, grease_value(gen));
+        }
+    }
+    for (size_t i = 0; i < NUM(cipher_suites); i++) {
+        put_u16(&w, cipher_suites[i]);
+    }
+    patch_len(&w, suites_len, 2);
+
+    put_u8(&w, 1);
+    put_u8(&w, 0);
+
+    size_t extensions_len = w.len;
+    put_u16(&w, 0);
+
+    uint16_t order[NUM(tls_extensions)];
+    memcpy(order, tls_extensions, sizeof(order));
+    uint16_t first_grease = grease_value(gen);
+    if (grease) {
+        for (size_t i = NUM(order) - 1; i > 0; i--) {
+            size_t j = random_below(gen, (uint32_t)i + 1);
+            uint16_t swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+        put_tls_extension(gen, &w, first_grease, host, grease, large);
+    }
+    for (size_t i = 0; i < NUM(order); i++) {
+        put_tls_extension(gen, &w, order[i], host, grease, large);
+    }
+    if (grease) {
+        // Extension types must not repeat
+        put_tls_extension(gen, &w, first_grease ^ 0x1010, host, grease, large);
+    }
+    patch_len(&w, extensions_len, 2);
+
+    patch_len(&w, handshake_len, 3);
+    patch_len(&w, record_len, 2);
+    return w.len;
+}
+
+static uint32_t checksum_add(uint32_t sum, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += (uint32_t)data[i] << 8 | data[i + 1];
+    }
+    if (len & 1) {
+        sum += (uint32_t)data[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+static void store16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static void store32(uint8_t *p, uint32_t value) {
+    store16(p, (uint16_t)(value >> 16));
+    store16(p + 2, (uint16_t)value);
+}
+
+// IPv4 header in front of an l4_len byte segment already at out + 20, and
+// the segment's checksum at checksum_offset within it
+static size_t finish_ipv4(traffic_gen_t *gen, uint8_t *out, uint8_t protocol, uint32_t dst, size_t l4_len,
+                          size_t checksum_offset) {
+    out[0] = 0x45;
+    out[1] = 0;
+    store16(out + 2, (uint16_t)(20 + l4_len));
+    store16(out + 4, gen->ip_id++);
+    store16(out + 6, protocol == 6 ? 0x4000 : 0);  // DF for TCP
+    out[8] = 64;
+    out[9] = protocol;
+    store16(out + 10, 0);
+    store32(out + 12, gen->config.src_ip);
+    store32(out + 16, dst);
+    store16(out + 10, checksum_fold(checksum_add(0, out, 20)));
+
+    uint32_t sum = checksum_add(0, out + 12, 8) + protocol + (uint32_t)l4_len;
+    uint16_t l4_sum = checksum_fold(checksum_add(sum, out + 20, l4_len));
+    store16(out + 20 + checksum_offset, protocol == 17 && l4_sum == 0 ? 0xffff : l4_sum);
+    return 20 + l4_len;
+}
+
+static size_t build_udp(traffic_gen_t *gen, uint8_t *out, uint32_t dst, uint16_t src_port, uint16_t dst_port,
+                        const uint8_t *payload, size_t len) {
+    uint8_t *udp = out + 20;
+    store16(udp, src_port);
+    store16(udp + 2, dst_port);
+    store16(udp + 4, (uint16_t)(8 + len));
+    store16(udp + 6, 0);
+    memcpy(udp + 8, payload, len);
+    return finish_ipv4(gen, out, 17, dst, 8 + len, 6);
+}
+
+static size_t build_tcp(traffic_gen_t *gen, uint8_t *out, uint32_t dst, uint16_t src_port, uint16_t dst_port,
+                        uint32_t seq, uint32_t ack, uint8_t flags, const uint8_t *payload, size_t len) {
+    uint8_t *tcp = out + 20;
+    size_t header_len = flags & TCP_FLAG_SYN ? 24 : 20;
+    store16(tcp, src_port);
+    store16(tcp + 2, dst_port);
+    store32(tcp + 4, seq);
+    store32(tcp + 8, ack);
+    tcp[12] = (uint8_t)(header_len / 4 << 4);
+    tcp[13] = flags;
+    store16(tcp + 14, 65535);
+    store16(tcp + 16, 0);
+    store16(tcp + 18, 0);
+    if (flags & TCP_FLAG_SYN) {
+        tcp[20] = 2;
+        tcp[21] = 4;
+        store16(tcp + 22, gen->config.mss);
+    }
+    if (len > 0) {
+        memcpy(tcp + header_len, payload, len);
+    }
+    return finish_ipv4(gen, out, 6, dst, header_len + len, 16);
+}
+
+// Servers in the 198.18.0.0/15 benchmarking range, one per name
+static uint32_t server_for(const char *host) {
+    uint32_t h = 2166136261u;
+    for (const char *p = host; *p != '\0'; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    return 0xc6120000u | (h & 0x1fffe) | 1;
+}
+
+static uint16_t next_port(traffic_gen_t *gen) {
+    uint16_t port = gen->next_port;
+    gen->next_port = port >= 60999 ? 32768 : port + 1;
+    return port;
+}
+
+static void add_packet(traffic_gen_t *gen, traffic_request_t *request, size_t len) {
+    request->packets[request->num_packets] = gen->packets[request->num_packets];
+    request->lens[request->num_packets] = len;
+    request->num_packets++;
+}
+
+// A TCP request: an optional SYN, then the payload in mss-sized segments
+static void tcp_request(traffic_gen_t *gen, traffic_request_t *request, uint16_t dst_port, size_t len) {
+    uint32_t dst = server_for(request->host);
+    uint16_t src_port = next_port(gen);
+    uint32_t seq = (uint32_t)next_random(gen);
+    uint32_t ack = (uint32_t)next_random(gen);
+
+    if (gen->config.tcp_handshake) {
+        size_t syn_len = build_tcp(gen, gen->packets[0], dst, src_port, dst_port, seq, 0, TCP_FLAG_SYN, NULL, 0);
+        add_packet(gen, request, syn_len);
+    }
+    seq++;
+
+    for (size_t offset = 0; offset < len && request->num_packets < TRAFFIC_MAX_PACKETS;) {
+        size_t chunk = len - offset < gen->config.mss ? len - offset : gen->config.mss;
+        uint8_t flags = TCP_FLAG_ACK | (offset + chunk == len ? TCP_FLAG_PSH : 0);
+        size_t packet_len = build_tcp(gen, gen->packets[request->num_packets], dst, src_port, dst_port,
+                                      seq + (uint32_t)offset, ack, flags, gen->payload + offset, chunk);
+        add_packet(gen, request, packet_len);
+        offset += chunk;
+    }
+}
+
+void traffic_gen_next(traffic_gen_t *gen, traffic_request_t *request) {
+    const traffic_gen_config_t *config = &gen->config;
+    memset(request, 0, sizeof(*request));
+
+    // Blocked hosts are a rule's name or below it, allowed ones belong to
+    // the rest of the universe
+    request->blocked = config->domains == 0 || (config->rules > 0 && random_unit(gen) < config->block_ratio);
+    if (request->blocked) {
+        int syntax;
+        uint32_t rule = zipf_sample(gen->blocked_cdf, config->rules, random_unit(gen));
+        size_t len = rule_name(gen, rule, request->host, &syntax);
+        if (syntax == RULE_WILDCARD || random_below(gen, 2) == 0) {
+            add_subdomain(gen, request->host, len, 1);
+        }
+    } else {
+        uint32_t rank = zipf_sample(gen->allowed_cdf, config->domains, random_unit(gen));
+        size_t len = registrable_name(gen, config->rules + rank, request->host);
+        uint32_t labels = random_below(gen, 10);
+        if (labels > 2) {
+            add_subdomain(gen, request->host, len, labels > 8 ? 2 : 1);
+        }
+    }
+
+    uint32_t pick = random_below(gen, gen->weight_total);
+    request->kind = pick < config->weights[0] ? TRAFFIC_DNS
+                  : pick < config->weights[0] + config->weights[1] ? TRAFFIC_HTTP : TRAFFIC_TLS;
+    int large = random_unit(gen) < config->large_ratio;
+
+    if (request->kind == TRAFFIC_DNS) {
+        size_t query_len = dns_query(gen, request->host, gen->payload);
+        add_packet(gen, request, build_udp(gen, gen->packets[0], config->dns_server, next_port(gen), 53,
+                                           gen->payload, query_len));
+    } else if (request->kind == TRAFFIC_HTTP) {
+        tcp_request(gen, request, 80, http_request(gen, request->host, large, gen->payload));
+    } else {
+        int grease = random_unit(gen) < config->grease_ratio;
+        tcp_request(gen, request, 443, client_hello(gen, request->host, grease, large, gen->payload));
+    }
+}
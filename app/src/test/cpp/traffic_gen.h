@@ -0,0 +1,70 @@
+// traffic_gen.h
+#ifndef TRAFFIC_GEN_H
+#define TRAFFIC_GEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Synthetic traffic for load tests and benchmarks: IPv4 DNS queries, HTTP
+// requests and TLS ClientHellos for hostnames drawn from a Zipf
+// distribution, plus a blocklist that covers exactly the names the
+// generator reports as blocked. Everything follows from the seed, so a run
+// can be reproduced from its configuration alone.
+
+#define TRAFFIC_DNS  0
+#define TRAFFIC_HTTP 1
+#define TRAFFIC_TLS  2
+
+#define TRAFFIC_MAX_PACKETS 8
+#define TRAFFIC_MAX_PACKET  1500
+
+typedef struct {
+    uint64_t seed;
+    uint32_t domains;         // Allowed registrable names in the universe
+    uint32_t rules;           // Blocklist size, each rule a blocked name
+    double zipf_exponent;     // Popularity skew, 1.0 is typical of DNS logs
+    double block_ratio;       // Share of requests for blocked names
+    uint32_t weights[3];      // Relative share of each TRAFFIC_* kind
+    double grease_ratio;      // ClientHellos with GREASE values and shuffled extensions
+    double large_ratio;       // Requests padded past one segment: long cookies, hybrid key shares
+    int tcp_handshake;        // Open each TCP request with a SYN
+    uint16_t mss;             // Largest TCP payload per packet
+    uint32_t src_ip;          // Host order
+    uint32_t dns_server;      // Host order
+} traffic_gen_config_t;
+
+typedef struct {
+    int kind;                 // TRAFFIC_*
+    int blocked;              // The host is covered by a generated rule
+    char host[256];
+    size_t num_packets;
+    // Valid until the next traffic_gen_next call
+    const uint8_t *packets[TRAFFIC_MAX_PACKETS];
+    size_t lens[TRAFFIC_MAX_PACKETS];
+} traffic_request_t;
+
+typedef struct traffic_gen traffic_gen_t;
+
+void traffic_gen_default_config(traffic_gen_config_t *config);
+
+// Returns NULL if the configuration is invalid or memory runs out
+traffic_gen_t *traffic_gen_create(const traffic_gen_config_t *config);
+void traffic_gen_destroy(traffic_gen_t *gen);
+
+// Generate the next request and its packets
+void traffic_gen_next(traffic_gen_t *gen, traffic_request_t *request);
+
+// Write the blocklist in a mix of plain, hosts and adblock syntax.
+// Returns -1 on a write error.
+int traffic_gen_write_rules(const traffic_gen_t *gen, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TRAFFIC_GEN_H
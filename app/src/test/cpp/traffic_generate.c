@@ -0,0 +1,192 @@
+// traffic_generate.c
+// Writes a generated blocklist and the matching traffic, for load tests
+// that are reproduced from a seed instead of from captures.
+//
+// Usage: traffic_generate [options]
+//   -s <seed>           (default 1)
+//   -d <names>          allowed names in the universe (default 100000)
+//   -n <rules>          blocklist size (default 10000)
+//   -z <exponent>       Zipf exponent of name popularity (default 1.0)
+//   -b <ratio>          share of requests for blocked names (default 0.2)
+//   -k <dns,http,tls>   relative weights of the request kinds (default 6,1,3)
+//   -g <ratio>          ClientHellos with GREASE (default 0.8)
+//   -l <ratio>          requests larger than one segment (default 0.1)
+//   -S                  open each TCP request with a SYN; the engine tracks
+//                       no TCP flow that does not start with one
+//   -M <mss>            (default 1460)
+//   -o <file>           write the blocklist
+//   -c <requests>       requests to generate (default 0)
+//   -w <file>           write them as a pcap capture
+//   -f <fd>             send each packet on a datagram socket, e.g. to
+//                       domainfilterd -x, which sets $DOMAINFILTER_TUN_FD
+//   -r <packets/s>      rate limit for -f
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "traffic_gen.h"
+
+static void usage() {
+    fprintf(stderr, "usage: traffic_generate [-s seed] [-d names] [-n rules] [-z exponent] [-b ratio]\n"
+                    "                        [-k dns,http,tls] [-g ratio] [-l ratio] [-S] [-M mss] [-o rules]\n"
+                    "                        [-c requests] [-w pcap] [-f fd] [-r packets/s]\n");
+}
+
+static uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int write_pcap_header(FILE *out) {
+    uint32_t header[6] = {
+            0xa1b2c3d4,     // Magic, microsecond timestamps
+            0x00040002,     // Version 2.4
+            0,
+            0,
+            65535,          // Snap length
+            101,            // LINKTYPE_RAW, packets start with the IP header
+    };
+    return fwrite(header, sizeof(header), 1, out) == 1 ? 0 : -1;
+}
+
+static int write_pcap_packet(FILE *out, const uint8_t *packet, size_t len, uint64_t usec) {
+    uint32_t header[4] = {(uint32_t)(usec / 1000000), (uint32_t)(usec % 1000000), (uint32_t)len, (uint32_t)len};
+    return fwrite(header, sizeof(header), 1, out) == 1 && fwrite(packet, len, 1, out) == 1 ? 0 : -1;
+}
+
+// Send a packet, draining whatever the other end sent back so that its
+// writes never block
+static int send_packet(int fd, const uint8_t *packet, size_t len, size_t *replies) {
+    uint8_t reply[TRAFFIC_MAX_PACKET * 44];
+    while (recv(fd, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+        (*replies)++;
+    }
+    while (send(fd, packet, len, 0) < 0) {
+        if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+        usleep(100);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    traffic_gen_config_t config;
+    traffic_gen_default_config(&config);
+    const char *rules_path = NULL;
+    const char *pcap_path = NULL;
+    const char *fd_env = getenv("DOMAINFILTER_TUN_FD");
+    int fd = -1;
+    long requests = 0;
+    double rate = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:d:n:z:b:k:g:l:SM:o:c:w:f:r:")) != -1) {
+        switch (opt) {
+            case 's': config.seed = strtoull(optarg, NULL, 0); break;
+            case 'd': config.domains = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'n': config.rules = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'z': config.zipf_exponent = atof(optarg); break;
+            case 'b': config.block_ratio = atof(optarg); break;
+            case 'g': config.grease_ratio = atof(optarg); break;
+            case 'l': config.large_ratio = atof(optarg); break;
+            case 'S': config.tcp_handshake = 1; break;
+            case 'M': config.mss = (uint16_t)atoi(optarg); break;
+            case 'o': rules_path = optarg; break;
+            case 'c': requests = atol(optarg); break;
+            case 'w': pcap_path = optarg; break;
+            case 'f': fd = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'k':
+                if (sscanf(optarg, "%u,%u,%u", &config.weights[TRAFFIC_DNS], &config.weights[TRAFFIC_HTTP],
+                           &config.weights[TRAFFIC_TLS]) != 3) {
+                    usage();
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (fd < 0 && fd_env != NULL && pcap_path == NULL) {
+        fd = atoi(fd_env);
+    }
+
+    traffic_gen_t *gen = traffic_gen_create(&config);
+    if (gen == NULL) {
+        fprintf(stderr, "traffic_generate: invalid configuration\n");
+        return 1;
+    }
+
+    if (rules_path != NULL) {
+        FILE *out = fopen(rules_path, "w");
+        if (out == NULL || traffic_gen_write_rules(gen, out) < 0 || fclose(out) != 0) {
+            perror(rules_path);
+            traffic_gen_destroy(gen);
+            return 1;
+        }
+    }
+
+    FILE *pcap = NULL;
+    if (pcap_path != NULL && ((pcap = fopen(pcap_path, "wb")) == NULL || write_pcap_header(pcap) < 0)) {
+        perror(pcap_path);
+        traffic_gen_destroy(gen);
+        return 1;
+    }
+
+    size_t packets = 0;
+    size_t bytes = 0;
+    size_t replies = 0;
+    long counts[3] = {0, 0, 0};
+    long blocked = 0;
+    uint64_t start = clock_ns();
+    int result = 0;
+
+    for (long i = 0; i < requests && result == 0; i++) {
+        traffic_request_t request;
+        traffic_gen_next(gen, &request);
+        counts[request.kind]++;
+        blocked += request.blocked;
+
+        for (size_t p = 0; p < request.num_packets && result == 0; p++) {
+            if (pcap != NULL) {
+                // Timestamps at the requested rate, or 10 us apart
+                uint64_t usec = rate > 0 ? (uint64_t)((double)packets * 1e6 / rate) : packets * 10;
+                result = write_pcap_packet(pcap, request.packets[p], request.lens[p], usec);
+            }
+            if (fd >= 0) {
+                if (rate > 0) {
+                    uint64_t due = start + (uint64_t)((double)packets * 1e9 / rate);
+                    for (uint64_t now = clock_ns(); now < due; now = clock_ns()) {
+                        usleep((useconds_t)((due - now) / 1000));
+                    }
+                }
+                result = send_packet(fd, request.packets[p], request.lens[p], &replies);
+            }
+            packets++;
+            bytes += request.lens[p];
+        }
+    }
+    if (result < 0) {
+        perror("traffic_generate");
+    }
+
+    double seconds = (double)(clock_ns() - start) / 1e9;
+    if (requests > 0) {
+        fprintf(stderr, "%ld requests (%ld dns, %ld http, %ld tls, %ld blocked), %zu packets, %zu bytes, "
+                        "%zu replies in %.2f s\n", requests, counts[0], counts[1], counts[2], blocked, packets,
+                bytes, replies, seconds);
+    }
+
+    if (pcap != NULL && fclose(pcap) != 0) {
+        result = -1;
+    }
+    traffic_gen_destroy(gen);
+    return result == 0 ? 0 : 1;
+}